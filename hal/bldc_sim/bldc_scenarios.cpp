@@ -0,0 +1,212 @@
+#include "bldc_sim.h"
+#include <motor.h>
+#include <tones.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Scenarios
+
+  Entry point of the sim environment. Each scenario starts the simulated motor from rest
+  and prints one line of results, so runs of two builds can be compared line by line.
+  A scenario can be picked by passing its name, otherwise they are all run in order.
+*/
+
+struct simScenario {
+  const char *name;
+  void (*run)();
+};
+
+const unsigned long simStartTimeOut = 3000000; // Give up on starting after this long (us)
+const double simDynoGain = 5e-8;              // Load added each millisecond per eRPM over the held speed (N m)
+
+bool simFailed = false; // Set by scenarios that check a result, makes the run exit with an error
+
+// Starts the motor and runs until it is commutating off BEMF, returns the time taken (us) or 0 if it never did
+unsigned long simStart(byte startDuty) {
+  clearDesyncCounts();
+  enableMotor(startDuty);
+
+  unsigned long taken = 0;
+  while ((spinUpState != spinUpStateEnum::RUNNING) && (motorStatus == true) && (taken < simStartTimeOut)) {
+    simRun(100);
+    taken += 100;
+  }
+  return (spinUpState == spinUpStateEnum::RUNNING) ? taken : 0;
+}
+
+// Prints the results of a scenario on one line
+void simReport(const char *name, unsigned long startMicros, double runMicros, double steadyERPM) {
+  unsigned long desyncs = 0;
+  for (byte i = 0; i < desyncCauseCount; i++) desyncs += desyncCounts[i];
+
+  double meanError = 0;
+  double rmsError = 0;
+  if (simStats.commutations != 0) {
+    meanError = simStats.timingErrorSum / simStats.commutations;
+    rmsError = sqrt(simStats.timingErrorSquares / simStats.commutations);
+  }
+
+  printf("%-10s start_ms=%.1f steady_erpm=%.0f peak_erpm=%.0f timing_mean_deg=%.2f timing_rms_deg=%.2f timing_max_deg=%.1f "
+         "desyncs=%lu desync_per_s=%.2f (interval %u, timeout %u, missed %u) shoot_throughs=%lu\n",
+         name, startMicros / 1000.0, steadyERPM, simStats.peakERPM, meanError, rmsError, simStats.timingErrorMax,
+         desyncs, desyncs / (runMicros / 1e6), desyncCounts[0], desyncCounts[1], desyncCounts[2], simStats.shootThroughs);
+}
+
+// Mean electrical RPM over a run
+double simAverageERPM(unsigned long micros) {
+  double sum = 0;
+  unsigned long samples = micros / 1000;
+  for (unsigned long i = 0; i < samples; i++) {
+    simRun(1000);
+    sum += simERPM();
+  }
+  return sum / samples;
+}
+
+// Moves the duty in single counts over a period, a step in duty is a scenario of its own
+void simRampDuty(byte fromDuty, byte toDuty, unsigned long micros) {
+  int change = (toDuty > fromDuty) ? 1 : -1;
+  unsigned long stepMicros = micros / max(abs(int(toDuty) - int(fromDuty)), 1);
+  for (byte target = fromDuty; target != toDuty; target += change) {
+    setPWMDuty(target);
+    simRun(stepMicros);
+  }
+  setPWMDuty(toDuty);
+}
+
+// Adds or takes off load each millisecond to hold a speed, like a dynamometer, returns the mean eRPM
+double simHoldERPM(double erpm, unsigned long micros) {
+  double sum = 0;
+  unsigned long samples = micros / 1000;
+  for (unsigned long i = 0; i < samples; i++) {
+    simDisturb.loadTorque += simDynoGain * (simERPM() - erpm);
+    if (simDisturb.loadTorque < 0) simDisturb.loadTorque = 0;
+    simRun(1000);
+    sum += simERPM();
+  }
+  return sum / samples;
+}
+
+// Starts at a moderate duty and holds it
+void scenarioStartup() {
+  unsigned long start = simStart(60);
+  simClearStatistics();
+  double erpm = simAverageERPM(500000);
+  simReport("startup", start, 500000, erpm);
+}
+
+// Raises the duty to the maximum over half a second then holds it
+void scenarioTopSpeed() {
+  unsigned long start = simStart(60);
+  simClearStatistics();
+  simRampDuty(60, maxDuty, 500000);
+  double erpm = simAverageERPM(500000);
+  simReport("top_speed", start, 1000000, erpm);
+}
+
+// Steady running with comparator noise and a spike after each commutation
+void scenarioNoise() {
+  unsigned long start = simStart(60);
+  simRampDuty(60, 120, 200000);
+  simRun(100000);
+
+  simClearStatistics();
+  clearDesyncCounts();
+  simDisturb.noiseVolts = 0.3;
+  simDisturb.spikeVolts = 1.0;
+  simDisturb.spikeMicros = 20;
+  double erpm = simAverageERPM(1000000);
+  simReport("noise", start, 1000000, erpm);
+}
+
+// Steady running with the load stepped up and back down
+void scenarioLoadStep() {
+  unsigned long start = simStart(60);
+  simRampDuty(60, 120, 200000);
+  simRun(100000);
+
+  simClearStatistics();
+  clearDesyncCounts();
+  simDisturb.loadTorque = 0.1;
+  simRun(300000);
+  simDisturb.loadTorque = 0;
+  double erpm = simAverageERPM(300000);
+  simReport("load_step", start, 600000, erpm);
+}
+
+// Throttle stepped from low to full, left to the duty ramp
+void scenarioDutyStep() {
+  unsigned long start = simStart(60);
+  simRun(200000);
+
+  simClearStatistics();
+  clearDesyncCounts();
+  setPWMDuty(maxDuty);
+  double erpm = simAverageERPM(500000);
+  simReport("duty_step", start, 500000, erpm);
+}
+
+// Low throttle with noise on the comparator each time the high sides switch
+void scenarioPWMNoise() {
+  unsigned long start = simStart(60);
+  simRampDuty(60, 30, 200000);
+  simRun(100000);
+
+  simClearStatistics();
+  clearDesyncCounts();
+  simDisturb.pwmEdgeVolts = 1.0;
+  simDisturb.pwmEdgeMicros = 0.6;
+  double erpm = simAverageERPM(1000000);
+  simReport("pwm_noise", start, 1000000, erpm);
+}
+
+// Loaded down to steps longer than TCB1 can count in one go (6.5ms), with a spike after each commutation, must not desync
+void scenarioSlowSteps() {
+  unsigned long start = simStart(60);
+  clearDesyncCounts();
+  simRampDuty(60, 20, 200000);
+  simHoldERPM(750, 2000000); // About 13ms steps
+
+  simClearStatistics();
+  simDisturb.spikeVolts = 1.0;
+  simDisturb.spikeMicros = 20;
+  double erpm = simHoldERPM(750, 1000000);
+  simReport("slow_steps", start, 3200000, erpm);
+
+  unsigned long desyncs = 0;
+  for (byte i = 0; i < desyncCauseCount; i++) desyncs += desyncCounts[i];
+  if ((desyncs != 0) || (erpm < 500)) {
+    printf("slow_steps FAILED: %lu desyncs, %.0f eRPM\n", desyncs, erpm);
+    simFailed = true;
+  }
+}
+
+const simScenario simScenarios[] = {
+  {"startup", scenarioStartup},
+  {"top_speed", scenarioTopSpeed},
+  {"noise", scenarioNoise},
+  {"load_step", scenarioLoadStep},
+  {"duty_step", scenarioDutyStep},
+  {"pwm_noise", scenarioPWMNoise},
+  {"slow_steps", scenarioSlowSteps}
+};
+
+#ifndef PIO_UNIT_TESTING // Unit tests bring their own
+int main(int argc, char **argv) {
+  setup();
+  stopTones(); // Pulses of the startup melody would nudge the rotor
+
+  for (const simScenario &scenario : simScenarios) {
+    if ((argc > 1) && (strcmp(argv[1], scenario.name) != 0)) continue;
+
+    disableMotor();
+    simReset(simDefaultMotor);
+    simRun(10000); // Let loop() settle with the motor stopped
+    scenario.run();
+  }
+
+  disableMotor();
+  return simFailed ? 1 : 0;
+}
+#endif
@@ -0,0 +1,412 @@
+#include "bldc_sim.h"
+#include <math.h>
+#include <motor.h>
+
+const simMotorParameters simDefaultMotor = {
+  0.1,      // resistance
+  20e-6,    // inductance
+  0.0096,   // backEMFConstant, half the line to line constant of 500 Kv
+  7,        // polePairs
+  3e-6,     // inertia
+  2e-8,     // propCoefficient
+  1e-5,     // friction
+  12.0,     // supplyVoltage
+  0.7       // diodeDrop
+};
+
+simDisturbances simDisturb;
+simStatistics simStats;
+
+/* Phase map
+
+  How the firmware drives and watches each phase, this mirrors the one in motor.cpp.
+*/
+const byte simHighPWM[3] = {TCA_SPLIT_HCMP2EN_bm, TCA_SPLIT_HCMP0EN_bm, TCA_SPLIT_HCMP1EN_bm};
+const byte simLowPin[3] = {PIN5_bm, PIN1_bm, PIN0_bm};
+// Start of the best torque window (electrical degrees) for each high and low phase pair
+const double simWindowStart[3][3] = {{0, 30, 90}, {210, 0, 150}, {270, 330, 0}};
+const byte simBEMFMux[3] = {AC_MUXPOS_PIN1_gc | AC_MUXNEG_PIN1_gc, AC_MUXPOS_PIN0_gc | AC_MUXNEG_PIN1_gc, AC_MUXPOS_PIN3_gc | AC_MUXNEG_PIN1_gc};
+
+const double simPi = 3.14159265358979;
+const double simStepSeconds = simStepTicks * 1e-7;
+
+// Motor state
+simMotorParameters simMotor;
+double simCurrents[3];    // Into the motor (A)
+double simSpeed;          // Mechanical (rad/s)
+double simAngle;          // Electrical (rad), not wrapped
+double simTerminals[3];   // Phase voltages from the last step (V)
+
+// Peripheral state the registers don't hold
+bool simComparatorHigh = false;   // Comparator result before the inversion
+bool simComparatorOutput = false; // After the inversion
+bool simChannel0 = false;         // Level of event channel 0
+bool simLatch = false;            // CCL sequencer output
+uint16_t simPWMCount = 0;         // TCA0's low counter, counting down
+bool simPWMOn = false;            // High sides are on in this part of the period
+bool simTCB1Counting = false;     // Single shot started and not yet reached CCMP
+byte simLastTCB1Mode = 0;
+byte simLastHigh = 0;             // Phase states, to spot commutations
+byte simLastLow = 0;
+double simSpikeLeft = 0;          // Seconds of spike left
+double simPWMEdgeLeft = 0;        // Seconds of switching noise left
+double simPWMEdgeSign = 1;
+unsigned long simLoopTicks = 0;   // Counts to the next loop()
+byte simMicroTicks = 0;           // Counts towards the next whole microsecond
+
+uint32_t simRandomState = 1;
+
+// Repeatable noise, -1 to 1
+double simRandom() {
+  simRandomState ^= simRandomState << 13;
+  simRandomState ^= simRandomState >> 17;
+  simRandomState ^= simRandomState << 5;
+  return (simRandomState / 2147483648.0) - 1.0;
+}
+
+// Trapezoidal back EMF shape for an electrical angle, crossing zero rising at 0
+double simTrapezoid(double angle) {
+  double degrees = fmod(angle * 180.0 / simPi, 360.0);
+  if (degrees < 0) degrees += 360.0;
+
+  if (degrees < 30) return degrees / 30.0;
+  if (degrees < 150) return 1.0;
+  if (degrees < 210) return (180.0 - degrees) / 30.0;
+  if (degrees < 330) return -1.0;
+  return (degrees - 360.0) / 30.0;
+}
+
+void simReset(const simMotorParameters &motor, double angle) {
+  simMotor = motor;
+  for (byte i = 0; i < 3; i++) {
+    simCurrents[i] = 0;
+    simTerminals[i] = 0;
+  }
+  simSpeed = 0;
+  simAngle = angle * simPi / 180.0;
+  simSpikeLeft = 0;
+  simPWMEdgeLeft = 0;
+  simRandomState = 1;
+
+  simDisturb = simDisturbances();
+  simClearStatistics();
+}
+
+void simClearStatistics() {
+  simStats = simStatistics();
+}
+
+double simERPM() {
+  return simSpeed * simMotor.polePairs * 60.0 / (2 * simPi);
+}
+
+double simPhaseCurrent(byte phase) {
+  return simCurrents[phase];
+}
+
+// Moves the currents and rotor on by a step
+void simMotorStep() {
+  double backEMF[3];
+  double shape[3];
+  for (byte i = 0; i < 3; i++) {
+    shape[i] = simTrapezoid(simAngle - i * 2 * simPi / 3);
+    backEMF[i] = simMotor.backEMFConstant * simSpeed * shape[i];
+  }
+
+  // Phase voltages, driven or clamped by a diode while current is still flowing
+  byte highs = TCA0.SPLIT.CTRLB;
+  byte lows = PORTB.OUT;
+  bool pwmRunning = TCA0.SPLIT.CTRLA & TCA_SPLIT_ENABLE_bm;
+  double voltage[3];
+  bool conducting[3];
+  byte conductingCount = 0;
+
+  for (byte i = 0; i < 3; i++) {
+    bool high = pwmRunning && (highs & simHighPWM[i]);
+    bool low = lows & simLowPin[i];
+    if (high && low) simStats.shootThroughs++;
+
+    conducting[i] = true;
+    if (low) voltage[i] = 0;
+    else if (high) {
+      // Averaged over the PWM period, the drop of the freewheeling diode while off is ignored
+      byte compare[3] = {TCA0.SPLIT.HCMP2, TCA0.SPLIT.HCMP0, TCA0.SPLIT.HCMP1};
+      voltage[i] = min(double(compare[i]) / (TCA0.SPLIT.HPER + 1), 1.0) * simMotor.supplyVoltage;
+    }
+    else if (simCurrents[i] > 0) voltage[i] = -simMotor.diodeDrop;
+    else if (simCurrents[i] < 0) voltage[i] = simMotor.supplyVoltage + simMotor.diodeDrop;
+    else conducting[i] = false;
+
+    if (conducting[i]) conductingCount++;
+  }
+
+  // Star point, from the phases carrying current
+  double neutral = 0;
+  if (conductingCount >= 2) {
+    for (byte i = 0; i < 3; i++) {
+      if (conducting[i]) neutral += voltage[i] - backEMF[i];
+    }
+    neutral /= conductingCount;
+  }
+  else if (conductingCount == 1) {
+    for (byte i = 0; i < 3; i++) {
+      if (conducting[i]) neutral = voltage[i] - backEMF[i];
+    }
+  }
+
+  double torque = 0;
+  for (byte i = 0; i < 3; i++) {
+    if (conducting[i] && (conductingCount >= 2)) {
+      double previous = simCurrents[i];
+      simCurrents[i] += (voltage[i] - (simMotor.resistance * simCurrents[i]) - backEMF[i] - neutral) * simStepSeconds / simMotor.inductance;
+
+      // Diode stops conducting once the current has died out
+      bool driven = (lows & simLowPin[i]) || (pwmRunning && (highs & simHighPWM[i]));
+      if (!driven && ((previous > 0) != (simCurrents[i] > 0))) simCurrents[i] = 0;
+    }
+    else {
+      simCurrents[i] = 0;
+      voltage[i] = neutral + backEMF[i];
+    }
+
+    simTerminals[i] = voltage[i];
+    torque += simMotor.backEMFConstant * shape[i] * simCurrents[i];
+  }
+
+  // Rotor, loads always act against the rotation and can't start it turning backwards
+  double drag = (simMotor.propCoefficient * simSpeed * fabs(simSpeed)) + (simMotor.friction * simSpeed);
+  double load = simDisturb.loadTorque;
+  if (simSpeed > 0) drag += load;
+  else if (simSpeed < 0) drag -= load;
+  else if (fabs(torque) <= load) torque = 0;
+  else torque -= (torque > 0) ? load : -load;
+
+  double newSpeed = simSpeed + ((torque - drag) * simStepSeconds / simMotor.inertia);
+  if ((simSpeed != 0) && ((newSpeed > 0) != (simSpeed > 0)) && (fabs(torque) <= load)) newSpeed = 0; // Stalled by the load
+  simSpeed = newSpeed;
+  simAngle += simSpeed * simMotor.polePairs * simStepSeconds;
+
+  double erpm = fabs(simERPM());
+  if (erpm > simStats.peakERPM) simStats.peakERPM = erpm;
+}
+
+// Checks for a change in the driven phases, noting the timing of commutations
+void simCheckCommutation() {
+  byte highs = TCA0.SPLIT.CTRLB & (simHighPWM[0] | simHighPWM[1] | simHighPWM[2]);
+  byte lows = PORTB.OUT & (simLowPin[0] | simLowPin[1] | simLowPin[2]);
+  if ((highs == simLastHigh) && (lows == simLastLow)) return;
+  simLastHigh = highs;
+  simLastLow = lows;
+
+  simSpikeLeft = simDisturb.spikeMicros * 1e-6;
+  if (spinUpState != spinUpStateEnum::RUNNING) return;
+
+  byte high = 3;
+  byte low = 3;
+  for (byte i = 0; i < 3; i++) {
+    if (highs & simHighPWM[i]) high = i;
+    if (lows & simLowPin[i]) low = i;
+  }
+  if ((high == 3) || (low == 3) || (high == low)) return; // Not a normal step
+
+  /* Commutation timing
+    Each pair of driven phases gives the most torque over a 60 electrical degree window,
+    found from where the back EMF of the two is flat and opposite. Turning forwards the
+    ideal commutation is at the start of the window for the pair just switched on, backwards
+    it is at the end. The error is how far past that point the rotor is in the direction it
+    is turning, so a commutation a whole step late shows up as 60 degrees rather than 0.
+  */
+  double windowStart = simWindowStart[high][low];
+  double degrees = (simAngle * 180.0 / simPi) - windowStart;
+  if (simSpeed < 0) degrees = (windowStart + 60.0) - (simAngle * 180.0 / simPi);
+  degrees = fmod(degrees, 360.0);
+  if (degrees < -180) degrees += 360;
+  if (degrees >= 180) degrees -= 360;
+
+  simStats.commutations++;
+  simStats.timingErrorSum += degrees;
+  simStats.timingErrorSquares += degrees * degrees;
+  if (fabs(degrees) > simStats.timingErrorMax) simStats.timingErrorMax = fabs(degrees);
+}
+
+// Counts TCA0 on (20 counts a microsecond), starting the switching noise as the high sides turn on or off
+void simPWMStep() {
+  if ((TCA0.SPLIT.CTRLA & TCA_SPLIT_ENABLE_bm) == 0) return;
+
+  const byte counts = simStepTicks * 2;
+  if (simPWMCount < counts) simPWMCount += TCA0.SPLIT.LPER + 1;
+  simPWMCount -= counts;
+
+  // All the high sides run at the same duty, on from the compare match down to BOTTOM
+  bool on = simPWMCount <= TCA0.SPLIT.HCMP0;
+  bool driven = TCA0.SPLIT.CTRLB & (simHighPWM[0] | simHighPWM[1] | simHighPWM[2]);
+  if (driven && (on != simPWMOn)) {
+    simPWMEdgeLeft = simDisturb.pwmEdgeMicros * 1e-6;
+    simPWMEdgeSign = (simRandom() < 0) ? -1 : 1;
+  }
+  simPWMOn = on;
+}
+
+// AC1 on the watched phase against the virtual neutral
+void simComparatorStep() {
+  if ((AC1.CTRLA & AC_ENABLE_bm) == 0) {
+    simComparatorOutput = false;
+    return;
+  }
+
+  byte mux = AC1.MUXCTRLA & ~AC_INVERT_bm;
+  double watched = 0;
+  for (byte i = 0; i < 3; i++) {
+    if (mux == simBEMFMux[i]) watched = simTerminals[i];
+  }
+  double virtualNeutral = (simTerminals[0] + simTerminals[1] + simTerminals[2]) / 3;
+
+  double difference = watched - virtualNeutral + (simDisturb.noiseVolts * simRandom());
+  if (simSpikeLeft > 0) {
+    difference += simDisturb.spikeVolts;
+    simSpikeLeft -= simStepSeconds;
+  }
+  if (simPWMEdgeLeft > 0) {
+    difference += simDisturb.pwmEdgeVolts * simPWMEdgeSign;
+    simPWMEdgeLeft -= simStepSeconds;
+  }
+
+  double hysteresis = 0;
+  switch (AC1.CTRLA & AC_HYSMODE_50mV_gc) {
+  case AC_HYSMODE_10mV_gc: hysteresis = 0.010; break;
+  case AC_HYSMODE_25mV_gc: hysteresis = 0.025; break;
+  case AC_HYSMODE_50mV_gc: hysteresis = 0.050; break;
+  }
+  if (difference > hysteresis / 2) simComparatorHigh = true;
+  else if (difference < -hysteresis / 2) simComparatorHigh = false;
+
+  bool output = simComparatorHigh != bool(AC1.MUXCTRLA & AC_INVERT_bm);
+  if (output) AC1.STATUS |= AC_STATE_bm;
+  else AC1.STATUS &= ~AC_STATE_bm;
+  simComparatorOutput = output;
+}
+
+// A LUT input, only the sources the firmware uses are modelled
+bool simLUTInput(byte source, byte input) {
+  byte compare[3] = {TCA0.SPLIT.LCMP0, TCA0.SPLIT.LCMP1, TCA0.SPLIT.LCMP2};
+
+  switch (source) {
+  case CCL_INSEL0_TCA0_gc: return (TCA0.SPLIT.CTRLA & TCA_SPLIT_ENABLE_bm) && (simPWMCount <= compare[input]); // WOn
+  case CCL_INSEL0_AC1_gc: return simComparatorOutput;
+  }
+  return false;
+}
+
+bool simLUTOutput(byte ctrlA, byte ctrlB, byte ctrlC, byte truth) {
+  if ((ctrlA & CCL_ENABLE_bm) == 0) return false;
+
+  byte index = simLUTInput(ctrlB & CCL_INSEL0_gm, 0);
+  index |= simLUTInput((ctrlB & CCL_INSEL1_gm) >> 4, 1) << 1;
+  index |= simLUTInput(ctrlC & CCL_INSEL2_gm, 2) << 2;
+  return truth & (1 << index);
+}
+
+// Event channel 0 from its source, returns true on a rising edge
+bool simChannel0Step() {
+  bool level = false;
+
+  if (EVSYS.ASYNCCH0 == EVSYS_ASYNCCH0_AC1_OUT_gc) level = simComparatorOutput;
+  else if ((EVSYS.ASYNCCH0 == EVSYS_ASYNCCH0_CCL_LUT0_gc) && (CCL.CTRLA & CCL_ENABLE_bm)) {
+    bool lut0 = simLUTOutput(CCL.LUT0CTRLA, CCL.LUT0CTRLB, CCL.LUT0CTRLC, CCL.TRUTH0);
+    bool lut1 = simLUTOutput(CCL.LUT1CTRLA, CCL.LUT1CTRLB, CCL.LUT1CTRLC, CCL.TRUTH1);
+
+    if ((CCL.SEQCTRL0 & CCL_SEQSEL_gm) == CCL_SEQSEL_LATCH_gc) {
+      // D latch, LUT0 is the data and LUT1 the gate
+      if (lut1) simLatch = lut0;
+      level = simLatch;
+    }
+    else level = lut0;
+  }
+
+  bool rising = level && !simChannel0;
+  simChannel0 = level;
+  return rising;
+}
+
+// Comparator event reaching the timers through the event system
+void simComparatorEvent() {
+  simStats.comparatorEdges++;
+
+  // TCB1 single shot is started by the event
+  if ((EVSYS.ASYNCUSER11 == EVSYS_ASYNCUSER11_ASYNCCH0_gc) && (TCB1.CTRLA & TCB_ENABLE_bm) &&
+      (TCB1.CTRLB == TCB_CNTMODE_SINGLE_gc) && (TCB1.EVCTRL & TCB_CAPTEI_bm)) {
+    TCB1.CNT = 0;
+    simTCB1Counting = true;
+  }
+
+  // TCB0 captures its count and starts again from zero
+  if ((EVSYS.ASYNCUSER0 == EVSYS_ASYNCUSER0_ASYNCCH0_gc) && (TCB0.CTRLA & TCB_ENABLE_bm) && (TCB0.EVCTRL & TCB_CAPTEI_bm)) {
+    uint16_t captured = TCB0.CNT;
+    TCB0.CNT = 0;
+    nativeComparatorEdge(captured);
+  }
+}
+
+// Counts TCB1 on, returns true if it reached its compare value
+bool simTCB1Step() {
+  byte mode = TCB1.CTRLB & 0x07;
+  if ((mode == TCB_CNTMODE_SINGLE_gc) && (simLastTCB1Mode != TCB_CNTMODE_SINGLE_gc)) simTCB1Counting = false; // Waits for an event
+  simLastTCB1Mode = mode;
+
+  if ((TCB1.CTRLA & TCB_ENABLE_bm) == 0) return false;
+
+  uint32_t count = uint32_t(TCB1.CNT) + simStepTicks;
+  if (mode == TCB_CNTMODE_INT_gc) {
+    // Periodic
+    if (count >= TCB1.CCMP) {
+      TCB1.CNT = count - TCB1.CCMP;
+      return true;
+    }
+    TCB1.CNT = count;
+  }
+  else if ((mode == TCB_CNTMODE_SINGLE_gc) && simTCB1Counting) {
+    // Stops once it gets there
+    if (count >= TCB1.CCMP) {
+      TCB1.CNT = TCB1.CCMP;
+      simTCB1Counting = false;
+      return true;
+    }
+    TCB1.CNT = count;
+  }
+  return false;
+}
+
+void simRun(unsigned long micros) {
+  unsigned long steps = (micros * 10) / simStepTicks;
+
+  for (unsigned long i = 0; i < steps; i++) {
+    simMotorStep();
+    simPWMStep();
+    simComparatorStep();
+    bool edge = simChannel0Step();
+
+    if (TCB0.CTRLA & TCB_ENABLE_bm) TCB0.CNT = TCB0.CNT + simStepTicks;
+    bool commutationDue = simTCB1Step();
+
+    // Crossing interrupt has priority
+    if (edge) simComparatorEvent();
+    if (commutationDue) {
+      TCB1.INTFLAGS.raise(TCB_CAPT_bm);
+      if (TCB1.INTCTRL & TCB_CAPT_bm) TCB1_INT_vect();
+    }
+    simCheckCommutation();
+
+    simMicroTicks += simStepTicks;
+    if (simMicroTicks >= 10) {
+      simMicroTicks -= 10;
+      nativeAdvanceMicros(1);
+    }
+
+    simLoopTicks += simStepTicks;
+    if (simLoopTicks >= (simLoopMicros * 10UL)) {
+      simLoopTicks = 0;
+      loop();
+      simCheckCommutation();
+    }
+  }
+}
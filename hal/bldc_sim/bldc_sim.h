@@ -0,0 +1,105 @@
+#ifndef ESC_BLDC_SIM_HEADER
+#define ESC_BLDC_SIM_HEADER
+
+/* Simulated BLDC motor for the host build
+
+  A three phase, star wound motor with trapezoidal back EMF, run against the register
+  stand-ins of native_hal so the firmware's own spin up and commutation code drive it.
+
+  Every step (simStepTicks of TCB's 0.1 us counts) the model:
+    1. Reads the phase states the firmware set, high side from the PWM overrides in
+       TCA0.SPLIT.CTRLB (at the duty in HCMPn) and low side from PORTB.OUT.
+    2. Moves the phase currents (R, L and back EMF, with the PWM averaged over its
+       period) and the rotor (torque against inertia, prop load, friction and any extra
+       load). A phase left floating with current in it conducts through a body diode
+       until the current dies out, which is where demagnetisation spikes come from.
+    3. Counts TCA0 through its PWM period, only to know where in it the high sides
+       switch (and the noise that comes with it) and what WO0 is doing.
+    4. Runs AC1 on the phase it is set to watch against the virtual neutral, with any
+       noise and spikes added. Its output goes to event channel 0 either directly or
+       through the CCL latch, and rising edges of the channel go to TCB0 (capture) and
+       TCB1 (single shot start) like on the chip.
+    5. Counts TCB0 and TCB1 and runs their interrupts when due.
+
+  The firmware's loop() is run every simLoopMicros. Interrupts take no time, and time
+  spent in the firmware's delay() calls is skipped rather than simulated.
+
+  This is for reproducible comparisons between builds (start up time, top speed,
+  commutation timing, desyncs), not for predicting a particular motor exactly.
+*/
+
+#include <native_hal.h>
+
+struct simMotorParameters {
+  double resistance;      // Phase resistance (ohm)
+  double inductance;      // Phase inductance (H)
+  double backEMFConstant; // Phase back EMF on the flat top per mechanical rad/s (V s), also torque per amp (N m/A)
+  byte polePairs;
+  double inertia;         // Rotor and prop (kg m^2)
+  double propCoefficient; // Prop torque per (rad/s)^2 (N m s^2)
+  double friction;        // Viscous friction (N m s)
+  double supplyVoltage;   // (V)
+  double diodeDrop;       // Body diode forward voltage (V)
+};
+
+extern const simMotorParameters simDefaultMotor; // Roughly a 500 Kv, 14 pole motor with a small prop on 3S
+
+// Things to make life harder, can be changed at any point in a run
+struct simDisturbances {
+  double noiseVolts;      // Peak random noise added to the comparator input (V)
+  double spikeVolts;      // Added to the comparator input after each commutation (V)
+  double spikeMicros;     // How long the spike lasts (us)
+  double pwmEdgeVolts;    // Added to the comparator input, either way, each time the high sides switch (V)
+  double pwmEdgeMicros;   // How long the switching noise lasts (us)
+  double loadTorque;      // Extra load against the rotation, e.g. for load steps (N m)
+};
+
+extern simDisturbances simDisturb;
+
+struct simStatistics {
+  unsigned long commutations;   // Steps commutated while running off BEMF
+  double timingErrorSum;        // Electrical degrees late (negative is early) of each commutation
+  double timingErrorSquares;
+  double timingErrorMax;        // Largest magnitude
+  double peakERPM;
+  unsigned long comparatorEdges; // Events sent to the timers
+  unsigned long shootThroughs;  // Steps with both switches of a phase on
+};
+
+extern simStatistics simStats;
+
+const byte simStepTicks = 2;          // Model step in 0.1 us, also how finely TCB events are timed
+const unsigned int simLoopMicros = 20; // Time between runs of loop()
+
+/** @name simReset
+   *  @brief Puts the motor at rest with no current, clears the disturbances and statistics
+   *  @param motor Parameters of the motor to simulate
+   *  @param angle Starting electrical angle (degrees)
+   */
+void simReset(const simMotorParameters &motor, double angle = 0);
+
+/** @name simRun
+   *  @brief Runs the motor and firmware together
+   *  @param micros Time to run for
+   */
+void simRun(unsigned long micros);
+
+/** @name simClearStatistics
+   *  @brief Clears simStats, e.g. to measure only the steady part of a run
+   */
+void simClearStatistics();
+
+/** @name simERPM
+   *  @brief Electrical RPM of the rotor
+   *  @return Electrical RPM, negative when turning backwards
+   */
+double simERPM();
+
+/** @name simPhaseCurrent
+   *  @brief Current in a phase
+   *  @param phase 0 to 2 for A to C
+   *  @return Current into the motor (A)
+   */
+double simPhaseCurrent(byte phase);
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef ESC_NATIVE_ARDUINO_HEADER
+#define ESC_NATIVE_ARDUINO_HEADER
+
+/* Host stand-in for the parts of the Arduino (megaTinyCore) API the firmware uses
+
+  Time is simulated. It only moves forward when the firmware delays or when the host
+  driver advances it (nativeAdvanceMicros()), so runs are repeatable.
+
+  NOTE: int is 32 bits on the host but 16 bits on the ATtiny, keep this in mind when
+  looking at anything that relies on an int overflowing.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "avr/io.h"
+#include "avr/interrupt.h"
+
+#ifndef F_CPU
+#define F_CPU 20000000UL
+#endif
+
+typedef uint8_t byte;
+typedef uint16_t word;
+typedef bool boolean;
+
+#define HIGH 0x1
+#define LOW 0x0
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+#define PIN_PA3 3
+#define PIN_PA4 4
+#define PIN_PB6 13
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+long map(long x, long inMin, long inMax, long outMin, long outMax);
+
+// No millis() or micros(), the core is built without them (see lib/clock)
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+////////////////////////////////////////////////////////////
+// Printing and streams, output goes to stdout
+
+class Print {
+public:
+  virtual size_t write(uint8_t value) = 0;
+  size_t write(const char *str);
+
+  size_t print(const char *str);
+  size_t print(char value);
+  size_t print(unsigned char value, int base = DEC);
+  size_t print(int value, int base = DEC);
+  size_t print(unsigned int value, int base = DEC);
+  size_t print(long value, int base = DEC);
+  size_t print(unsigned long value, int base = DEC);
+  size_t print(double value, int digits = 2);
+
+  size_t println();
+  size_t println(const char *str);
+  size_t println(char value);
+  size_t println(unsigned char value, int base = DEC);
+  size_t println(int value, int base = DEC);
+  size_t println(unsigned int value, int base = DEC);
+  size_t println(long value, int base = DEC);
+  size_t println(unsigned long value, int base = DEC);
+  size_t println(double value, int digits = 2);
+
+  size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+private:
+  size_t printNumber(unsigned long value, int base);
+};
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+
+  long parseInt();
+};
+
+class HardwareSerial : public Stream {
+public:
+  void begin(unsigned long baud) { (void)baud; }
+  size_t write(uint8_t value) override;
+  using Print::write;
+
+  int available() override;
+  int read() override;
+  int peek() override;
+
+  void nativeInject(const char *text); // Host driver queues text as if it arrived over UART
+
+private:
+  static const int bufferSize = 128;
+  uint8_t rxBuffer[bufferSize];
+  int rxHead = 0;
+  int rxTail = 0;
+};
+
+extern HardwareSerial Serial;
+
+// Provided by the sketch
+void setup();
+void loop();
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef ESC_NATIVE_EEPROM_HEADER
+#define ESC_NATIVE_EEPROM_HEADER
+
+/* Host stand-in for the EEPROM library
+
+  Backed by memory that starts erased (0xFF) every run, so nothing persists between runs
+  unless the host driver loads it through nativeEEPROM.
+*/
+
+#include <Arduino.h>
+
+#define EEPROM_SIZE 256 // Same as the ATtiny1617
+
+extern uint8_t nativeEEPROM[EEPROM_SIZE];
+
+class EEPROMClass {
+public:
+  uint8_t read(int index) { return nativeEEPROM[index % EEPROM_SIZE]; }
+  void write(int index, uint8_t value) { nativeEEPROM[index % EEPROM_SIZE] = value; }
+  void update(int index, uint8_t value) { write(index, value); }
+  uint16_t length() { return EEPROM_SIZE; }
+
+  template <typename T> T &get(int index, T &value) {
+    uint8_t *bytes = (uint8_t *)&value;
+    for (size_t i = 0; i < sizeof(T); i++) bytes[i] = read(index + i);
+    return value;
+  }
+
+  template <typename T> const T &put(int index, const T &value) {
+    const uint8_t *bytes = (const uint8_t *)&value;
+    for (size_t i = 0; i < sizeof(T); i++) update(index + i, bytes[i]);
+    return value;
+  }
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef ESC_NATIVE_WIRE_HEADER
+#define ESC_NATIVE_WIRE_HEADER
+
+/* Host stand-in for the Wire (TWI) library in slave mode
+
+  The host driver plays the bus master through nativeMasterWrite() and
+  nativeMasterRead(), these call the registered handlers the same way the TWI
+  interrupt would.
+*/
+
+#include <Arduino.h>
+
+class TwoWire : public Stream {
+public:
+  void begin(uint8_t address, bool receiveBroadcast = false) {
+    slaveAddress = address;
+    generalCall = receiveBroadcast;
+  }
+  void onReceive(void (*handler)(int)) { receiveHandler = handler; }
+  void onRequest(void (*handler)()) { requestHandler = handler; }
+
+  size_t write(uint8_t value) override;
+  using Print::write;
+
+  int available() override;
+  int read() override;
+  int peek() override;
+  uint8_t getIncomingAddress() { return incomingAddress; } // Address byte of the last write, R/W bit included
+
+  uint8_t nativeAddress() const { return slaveAddress; }
+  void nativeMasterWrite(const uint8_t *data, uint8_t length); // Master writes to the ESC
+  bool nativeGeneralCall(const uint8_t *data, uint8_t length); // Master writes to address 0, returns false if ignored
+  uint8_t nativeMasterRead(uint8_t *data, uint8_t length);     // Master reads from the ESC, returns bytes sent
+
+private:
+  static const uint8_t bufferSize = 32; // Matches the Arduino TWI buffer
+
+  uint8_t slaveAddress = 0;
+  bool generalCall = false;
+  void (*receiveHandler)(int) = nullptr;
+  void (*requestHandler)() = nullptr;
+
+  uint8_t incomingAddress = 0;
+  void receive(uint8_t address, const uint8_t *data, uint8_t length);
+
+  uint8_t rxBuffer[bufferSize];
+  uint8_t rxLength = 0;
+  uint8_t rxIndex = 0;
+
+  uint8_t txBuffer[bufferSize];
+  uint8_t txLength = 0;
+};
+
+extern TwoWire Wire;
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef ESC_NATIVE_AVR_INTERRUPT_HEADER
+#define ESC_NATIVE_AVR_INTERRUPT_HEADER
+
+/* Host stand-in for <avr/interrupt.h>
+
+  Interrupt service routines become plain C functions named after their vector so the
+  host driver (see native_hal.h) can call them directly once it has set up the registers
+  the routine expects to read.
+*/
+
+#include "io.h"
+
+#define ISR(vector, ...) extern "C" void vector(void); void vector(void)
+
+extern volatile bool nativeInterruptsEnabled; // Global interrupt flag (I bit in SREG)
+
+inline void cli() { nativeInterruptsEnabled = false; }
+inline void sei() { nativeInterruptsEnabled = true; }
+
+#endif
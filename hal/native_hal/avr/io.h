@@ -0,0 +1,446 @@
+#ifndef ESC_NATIVE_AVR_IO_HEADER
+#define ESC_NATIVE_AVR_IO_HEADER
+
+/* Host stand-in for <avr/io.h>
+
+  Only the peripherals (and bit definitions) the ESC firmware touches on the ATtiny1617
+  are modelled. Registers are plain memory so the host driver can read and write them
+  freely. The strobe registers (OUTSET, OUTCLR, DIRSET, etc.) act on their parent
+  register like the hardware does so the phase states can be read back from OUT.
+
+  Values for the group configurations and bit masks are copied from the ATtiny1617
+  device header so that anything logged matches what the real part would see.
+*/
+
+#include <stdint.h>
+
+typedef volatile uint8_t register8_t;
+typedef volatile uint16_t register16_t;
+
+// Used for the strobe style registers (e.g. PORTx.OUTSET) that modify another register
+class nativeStrobeRegister {
+public:
+  enum strobeType : uint8_t {SET, CLEAR, TOGGLE};
+
+  nativeStrobeRegister(register8_t &target, strobeType type) : target(target), type(type) {}
+
+  nativeStrobeRegister &operator=(uint8_t value) {
+    if (type == SET) target |= value;
+    else if (type == CLEAR) target &= ~value;
+    else target ^= value;
+    return *this;
+  }
+
+  operator uint8_t() const { return target; } // Reading back returns the parent register
+
+private:
+  register8_t &target;
+  const strobeType type;
+};
+
+// Used for the flag registers that are cleared by writing a one to the bit
+class nativeFlagRegister {
+public:
+  nativeFlagRegister &operator=(uint8_t value) {
+    flags &= ~value;
+    return *this;
+  }
+
+  operator uint8_t() const { return flags; }
+
+  void raise(uint8_t mask) { flags |= mask; } // Used by the host driver to set flags
+
+private:
+  register8_t flags = 0;
+};
+
+////////////////////////////////////////////////////////////
+// Bit positions for pins
+#define PIN0_bm 0x01
+#define PIN1_bm 0x02
+#define PIN2_bm 0x04
+#define PIN3_bm 0x08
+#define PIN4_bm 0x10
+#define PIN5_bm 0x20
+#define PIN6_bm 0x40
+#define PIN7_bm 0x80
+
+////////////////////////////////////////////////////////////
+// I/O Ports
+struct PORT_t {
+  register8_t DIR = 0;
+  nativeStrobeRegister DIRSET{DIR, nativeStrobeRegister::SET};
+  nativeStrobeRegister DIRCLR{DIR, nativeStrobeRegister::CLEAR};
+  nativeStrobeRegister DIRTGL{DIR, nativeStrobeRegister::TOGGLE};
+  register8_t OUT = 0;
+  nativeStrobeRegister OUTSET{OUT, nativeStrobeRegister::SET};
+  nativeStrobeRegister OUTCLR{OUT, nativeStrobeRegister::CLEAR};
+  nativeStrobeRegister OUTTGL{OUT, nativeStrobeRegister::TOGGLE};
+  register8_t IN = 0;
+  nativeFlagRegister INTFLAGS;
+  register8_t PIN0CTRL = 0;
+  register8_t PIN1CTRL = 0;
+  register8_t PIN2CTRL = 0;
+  register8_t PIN3CTRL = 0;
+  register8_t PIN4CTRL = 0;
+  register8_t PIN5CTRL = 0;
+  register8_t PIN6CTRL = 0;
+  register8_t PIN7CTRL = 0;
+
+  PORT_t() = default;
+  PORT_t(const PORT_t &) = delete;
+};
+
+#define PORT_ISC_gm 0x07
+#define PORT_ISC_INTDISABLE_gc 0x00
+#define PORT_ISC_BOTHEDGES_gc 0x01
+#define PORT_ISC_RISING_gc 0x02
+#define PORT_ISC_FALLING_gc 0x03
+#define PORT_ISC_INPUT_DISABLE_gc 0x04
+#define PORT_ISC_LEVEL_gc 0x05
+#define PORT_PULLUPEN_bm 0x08
+#define PORT_INVEN_bm 0x80
+
+////////////////////////////////////////////////////////////
+// Port Multiplexer
+struct PORTMUX_t {
+  register8_t CTRLA = 0;
+  register8_t CTRLB = 0;
+  register8_t CTRLC = 0;
+  register8_t CTRLD = 0;
+};
+
+#define PORTMUX_TWI0_bm 0x10
+#define PORTMUX_TCA00_bm 0x01
+#define PORTMUX_TCA01_bm 0x02
+#define PORTMUX_TCA02_bm 0x04
+#define PORTMUX_TCA03_bm 0x08
+#define PORTMUX_TCA04_bm 0x10
+#define PORTMUX_TCA05_bm 0x20
+
+////////////////////////////////////////////////////////////
+// 16-bit Timer/Counter Type A (only split mode is used)
+struct TCA_SPLIT_t {
+  register8_t CTRLA = 0;
+  register8_t CTRLB = 0;
+  register8_t CTRLC = 0;
+  register8_t CTRLD = 0;
+  register8_t CTRLECLR = 0;
+  register8_t CTRLESET = 0;
+  register8_t DBGCTRL = 0;
+  register8_t INTCTRL = 0;
+  register8_t INTFLAGS = 0;
+  register8_t LCNT = 0;
+  register8_t HCNT = 0;
+  register8_t LPER = 0;
+  register8_t HPER = 0;
+  register8_t LCMP0 = 0;
+  register8_t HCMP0 = 0;
+  register8_t LCMP1 = 0;
+  register8_t HCMP1 = 0;
+  register8_t LCMP2 = 0;
+  register8_t HCMP2 = 0;
+};
+
+struct TCA_t {
+  TCA_SPLIT_t SPLIT;
+};
+
+#define TCA_SPLIT_ENABLE_bm 0x01
+#define TCA_SPLIT_CLKSEL_DIV1_gc 0x00
+#define TCA_SPLIT_CLKSEL_DIV2_gc 0x02
+#define TCA_SPLIT_CLKSEL_DIV4_gc 0x04
+#define TCA_SPLIT_CLKSEL_DIV8_gc 0x06
+#define TCA_SPLIT_CLKSEL_DIV16_gc 0x08
+#define TCA_SPLIT_CLKSEL_DIV64_gc 0x0A
+#define TCA_SPLIT_CLKSEL_DIV256_gc 0x0C
+#define TCA_SPLIT_CLKSEL_DIV1024_gc 0x0E
+#define TCA_SPLIT_LCMP0EN_bm 0x01
+#define TCA_SPLIT_LCMP1EN_bm 0x02
+#define TCA_SPLIT_LCMP2EN_bm 0x04
+#define TCA_SPLIT_HCMP0EN_bm 0x10
+#define TCA_SPLIT_HCMP1EN_bm 0x20
+#define TCA_SPLIT_HCMP2EN_bm 0x40
+#define TCA_SPLIT_CMD_NONE_gc 0x00
+#define TCA_SPLIT_CMD_UPDATE_gc 0x04
+#define TCA_SPLIT_CMD_RESTART_gc 0x08
+#define TCA_SPLIT_CMD_RESET_gc 0x0C
+#define TCA_SPLIT_LUNF_bm 0x01
+#define TCA_SPLIT_HUNF_bm 0x02
+#define TCA_SPLIT_LCMP0_bm 0x10
+#define TCA_SPLIT_LCMP1_bm 0x20
+#define TCA_SPLIT_LCMP2_bm 0x40
+
+////////////////////////////////////////////////////////////
+// 16-bit Timer/Counter Type B
+struct TCB_t {
+  register8_t CTRLA = 0;
+  register8_t CTRLB = 0;
+  register8_t EVCTRL = 0;
+  register8_t INTCTRL = 0;
+  nativeFlagRegister INTFLAGS;
+  register8_t STATUS = 0;
+  register8_t DBGCTRL = 0;
+  register8_t TEMP = 0;
+  register16_t CNT = 0;
+  register16_t CCMP = 0;
+
+  TCB_t() = default;
+  TCB_t(const TCB_t &) = delete;
+};
+
+#define TCB_ENABLE_bm 0x01
+#define TCB_CLKSEL_CLKDIV1_gc 0x00
+#define TCB_CLKSEL_CLKDIV2_gc 0x02
+#define TCB_CLKSEL_CLKTCA_gc 0x04
+#define TCB_CNTMODE_INT_gc 0x00
+#define TCB_CNTMODE_TIMEOUT_gc 0x01
+#define TCB_CNTMODE_CAPT_gc 0x02
+#define TCB_CNTMODE_FRQ_gc 0x03
+#define TCB_CNTMODE_PW_gc 0x04
+#define TCB_CNTMODE_FRQPW_gc 0x05
+#define TCB_CNTMODE_SINGLE_gc 0x06
+#define TCB_CNTMODE_PWM8_gc 0x07
+#define TCB_CAPTEI_bm 0x01
+#define TCB_EDGE_bm 0x10
+#define TCB_FILTER_bm 0x40
+#define TCB_CAPT_bm 0x01
+#define TCB_RUN_bm 0x01
+
+////////////////////////////////////////////////////////////
+// 12-bit Timer/Counter Type D (only used to capture input events)
+struct TCD_t {
+  register8_t CTRLA = 0;
+  register8_t CTRLB = 0;
+  register8_t CTRLC = 0;
+  register8_t CTRLD = 0;
+  register8_t CTRLE = 0;
+  register8_t EVCTRLA = 0;
+  register8_t EVCTRLB = 0;
+  register8_t INTCTRL = 0;
+  nativeFlagRegister INTFLAGS;
+  register8_t STATUS = 0x01; // Always ready to be enabled
+  register8_t INPUTCTRLA = 0;
+  register8_t INPUTCTRLB = 0;
+  register8_t FAULTCTRL = 0;
+  register8_t DLYCTRL = 0;
+  register8_t DLYVAL = 0;
+  register8_t DITCTRL = 0;
+  register8_t DITVAL = 0;
+  register8_t DBGCTRL = 0;
+  register16_t CAPTUREA = 0;
+  register16_t CAPTUREB = 0;
+  register16_t CMPASET = 0;
+  register16_t CMPACLR = 0;
+  register16_t CMPBSET = 0;
+  register16_t CMPBCLR = 0;
+
+  TCD_t() = default;
+  TCD_t(const TCD_t &) = delete;
+};
+
+#define TCD_ENABLE_bm 0x01
+#define TCD_SYNCPRES_gm 0x06
+#define TCD_SYNCPRES_DIV1_gc 0x00
+#define TCD_SYNCPRES_DIV2_gc 0x02
+#define TCD_SYNCPRES_DIV4_gc 0x04
+#define TCD_SYNCPRES_DIV8_gc 0x06
+#define TCD_CNTPRES_gm 0x18
+#define TCD_CNTPRES_DIV1_gc 0x00
+#define TCD_CNTPRES_DIV4_gc 0x08
+#define TCD_CNTPRES_DIV32_gc 0x10
+#define TCD_CLKSEL_20MHZ_gc 0x00
+#define TCD_CLKSEL_EXTCLK_gc 0x40
+#define TCD_CLKSEL_SYSCLK_gc 0x60
+#define TCD_WGMODE_ONERAMP_gc 0x00
+#define TCD_TRIGEI_bm 0x01
+#define TCD_ACTION_FAULT_gc 0x00
+#define TCD_ACTION_CAPTURE_gc 0x04
+#define TCD_EDGE_FALL_LOW_gc 0x00
+#define TCD_EDGE_RISE_HIGH_gc 0x10
+#define TCD_CFG_NEITHER_gc 0x00
+#define TCD_CFG_FILTER_gc 0x40
+#define TCD_CFG_ASYNC_gc 0x80
+#define TCD_INPUTMODE_NONE_gc 0x00
+#define TCD_OVF_bm 0x01
+#define TCD_TRIGA_bm 0x04
+#define TCD_TRIGB_bm 0x08
+#define TCD_ENRDY_bm 0x01
+
+////////////////////////////////////////////////////////////
+// Real-Time Counter (only the counter, the periodic interrupt timer isn't used)
+struct RTC_t {
+  register8_t CTRLA = 0;
+  register8_t STATUS = 0; // Writes take effect straight away, never busy
+  register8_t INTCTRL = 0;
+  nativeFlagRegister INTFLAGS;
+  register8_t TEMP = 0;
+  register8_t DBGCTRL = 0;
+  register8_t reserved_0x06 = 0;
+  register8_t CLKSEL = 0;
+  register16_t CNT = 0;
+  register16_t PER = 0xFFFF;
+  register16_t CMP = 0;
+
+  RTC_t() = default;
+  RTC_t(const RTC_t &) = delete;
+};
+
+#define RTC_RTCEN_bm 0x01
+#define RTC_PRESCALER_DIV1_gc 0x00
+#define RTC_RUNSTDBY_bm 0x80
+#define RTC_CTRLABUSY_bm 0x01
+#define RTC_CNTBUSY_bm 0x02
+#define RTC_PERBUSY_bm 0x04
+#define RTC_CMPBUSY_bm 0x08
+#define RTC_OVF_bm 0x01
+#define RTC_CMP_bm 0x02
+#define RTC_CLKSEL_INT32K_gc 0x00
+#define RTC_CLKSEL_INT1K_gc 0x01
+
+////////////////////////////////////////////////////////////
+// Analog Comparator
+struct AC_t {
+  register8_t CTRLA = 0;
+  register8_t MUXCTRLA = 0;
+  register8_t INTCTRL = 0;
+  register8_t INTFLAGS = 0;
+  register8_t STATUS = 0;
+};
+
+#define AC_ENABLE_bm 0x01
+#define AC_HYSMODE_OFF_gc 0x00
+#define AC_HYSMODE_10mV_gc 0x02
+#define AC_HYSMODE_25mV_gc 0x04
+#define AC_HYSMODE_50mV_gc 0x06
+#define AC_OUTEN_bm 0x40
+#define AC_MUXNEG_PIN0_gc 0x00
+#define AC_MUXNEG_PIN1_gc 0x01
+#define AC_MUXNEG_VREF_gc 0x02
+#define AC_MUXNEG_DAC_gc 0x03
+#define AC_MUXPOS_PIN0_gc 0x00
+#define AC_MUXPOS_PIN1_gc 0x08
+#define AC_MUXPOS_PIN2_gc 0x10
+#define AC_MUXPOS_PIN3_gc 0x18
+#define AC_INVERT_bm 0x80
+#define AC_STATE_bm 0x10
+
+////////////////////////////////////////////////////////////
+// Event System
+struct EVSYS_t {
+  register8_t ASYNCSTROBE = 0;
+  register8_t SYNCSTROBE = 0;
+  register8_t ASYNCCH0 = 0;
+  register8_t ASYNCCH1 = 0;
+  register8_t ASYNCCH2 = 0;
+  register8_t ASYNCCH3 = 0;
+  register8_t SYNCCH0 = 0;
+  register8_t SYNCCH1 = 0;
+  register8_t ASYNCUSER0 = 0;
+  register8_t ASYNCUSER1 = 0;
+  register8_t ASYNCUSER2 = 0;
+  register8_t ASYNCUSER3 = 0;
+  register8_t ASYNCUSER4 = 0;
+  register8_t ASYNCUSER5 = 0;
+  register8_t ASYNCUSER6 = 0;
+  register8_t ASYNCUSER7 = 0;
+  register8_t ASYNCUSER8 = 0;
+  register8_t ASYNCUSER9 = 0;
+  register8_t ASYNCUSER10 = 0;
+  register8_t ASYNCUSER11 = 0;
+  register8_t ASYNCUSER12 = 0;
+  register8_t SYNCUSER0 = 0;
+  register8_t SYNCUSER1 = 0;
+};
+
+#define EVSYS_ASYNCCH0_OFF_gc 0x00
+#define EVSYS_ASYNCCH0_CCL_LUT0_gc 0x01
+#define EVSYS_ASYNCCH0_AC1_OUT_gc 0x13
+#define EVSYS_ASYNCCH3_PORTA_PIN3_gc 0x0D
+#define EVSYS_ASYNCUSER0_ASYNCCH0_gc 0x03
+#define EVSYS_ASYNCUSER6_ASYNCCH3_gc 0x06
+#define EVSYS_ASYNCUSER7_ASYNCCH3_gc 0x06
+#define EVSYS_ASYNCUSER11_ASYNCCH0_gc 0x03
+
+////////////////////////////////////////////////////////////
+// Configurable Custom Logic
+struct CCL_t {
+  register8_t CTRLA = 0;
+  register8_t SEQCTRL0 = 0;
+  register8_t reserved_0x02 = 0;
+  register8_t reserved_0x03 = 0;
+  register8_t reserved_0x04 = 0;
+  register8_t LUT0CTRLA = 0;
+  register8_t LUT0CTRLB = 0;
+  register8_t LUT0CTRLC = 0;
+  register8_t TRUTH0 = 0;
+  register8_t LUT1CTRLA = 0;
+  register8_t LUT1CTRLB = 0;
+  register8_t LUT1CTRLC = 0;
+  register8_t TRUTH1 = 0;
+};
+
+#define CCL_ENABLE_bm 0x01
+#define CCL_SEQSEL_gm 0x07
+#define CCL_SEQSEL_DISABLE_gc 0x00
+#define CCL_SEQSEL_LATCH_gc 0x03
+#define CCL_INSEL0_gm 0x0F
+#define CCL_INSEL0_MASK_gc 0x00
+#define CCL_INSEL0_TCA0_gc 0x08
+#define CCL_INSEL0_AC1_gc 0x0C
+#define CCL_INSEL1_gm 0xF0
+#define CCL_INSEL1_MASK_gc 0x00
+#define CCL_INSEL1_AC1_gc 0xC0
+#define CCL_INSEL2_gm 0x0F
+#define CCL_INSEL2_MASK_gc 0x00
+
+////////////////////////////////////////////////////////////
+// CPU Interrupt Controller
+struct CPUINT_t {
+  register8_t CTRLA = 0;
+  register8_t STATUS = 0;
+  register8_t LVL0PRI = 0;
+  register8_t LVL1VEC = 0;
+};
+
+////////////////////////////////////////////////////////////
+// Interrupt vector numbers
+#define PORTA_PORT_vect_num 3
+#define RTC_CNT_vect_num 6
+#define TCD0_OVF_vect_num 9
+#define TCD0_TRIG_vect_num 10
+#define TCB0_INT_vect_num 13
+#define TCB1_INT_vect_num 14
+#define TWI0_TWIS_vect_num 24
+
+////////////////////////////////////////////////////////////
+// Peripheral instances
+extern PORT_t nativePORTA;
+extern PORT_t nativePORTB;
+extern PORT_t nativePORTC;
+extern PORTMUX_t nativePORTMUX;
+extern TCA_t nativeTCA0;
+extern TCB_t nativeTCB0;
+extern TCB_t nativeTCB1;
+extern TCD_t nativeTCD0;
+extern RTC_t nativeRTC;
+extern AC_t nativeAC1;
+extern EVSYS_t nativeEVSYS;
+extern CCL_t nativeCCL;
+extern CPUINT_t nativeCPUINT;
+
+#define PORTA nativePORTA
+#define PORTB nativePORTB
+#define PORTC nativePORTC
+#define PORTMUX nativePORTMUX
+#define TCA0 nativeTCA0
+#define TCB0 nativeTCB0
+#define TCB1 nativeTCB1
+#define TCD0 nativeTCD0
+#define RTC nativeRTC
+#define AC1 nativeAC1
+#define EVSYS nativeEVSYS
+#define CCL nativeCCL
+#define CPUINT nativeCPUINT
+
+#endif
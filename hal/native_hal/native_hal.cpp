@@ -0,0 +1,348 @@
+#include "native_hal.h"
+#include <Wire.h>
+#include <EEPROM.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+////////////////////////////////////////////////////////////
+// Peripheral instances
+
+PORT_t nativePORTA;
+PORT_t nativePORTB;
+PORT_t nativePORTC;
+PORTMUX_t nativePORTMUX;
+TCA_t nativeTCA0;
+TCB_t nativeTCB0;
+TCB_t nativeTCB1;
+TCD_t nativeTCD0;
+RTC_t nativeRTC;
+AC_t nativeAC1;
+EVSYS_t nativeEVSYS;
+CCL_t nativeCCL;
+CPUINT_t nativeCPUINT;
+
+volatile bool nativeInterruptsEnabled = true; // Arduino core enables interrupts before setup()
+
+HardwareSerial Serial;
+TwoWire Wire;
+EEPROMClass EEPROM;
+uint8_t nativeEEPROM[EEPROM_SIZE];
+
+// Unconnected pins read high because of the pull ups, except the PWM input which idles low
+// The EEPROM starts erased
+static struct nativePinDefaults {
+  nativePinDefaults() {
+    nativePORTA.IN = 0xFF & ~PIN3_bm;
+    nativePORTB.IN = 0xFF;
+    nativePORTC.IN = 0xFF;
+    memset(nativeEEPROM, 0xFF, sizeof(nativeEEPROM)); // Erased
+  }
+} pinDefaults;
+
+////////////////////////////////////////////////////////////
+// Default (empty) interrupt routines in case the firmware doesn't define them
+
+extern "C" __attribute__((weak)) void TCB0_INT_vect(void) {}
+extern "C" __attribute__((weak)) void TCB1_INT_vect(void) {}
+extern "C" __attribute__((weak)) void PORTA_PORT_vect(void) {}
+extern "C" __attribute__((weak)) void TCD0_TRIG_vect(void) {}
+extern "C" __attribute__((weak)) void RTC_CNT_vect(void) {}
+
+////////////////////////////////////////////////////////////
+// Simulated time
+
+static unsigned long long nativeMicros = 0;
+static unsigned long long nativeRTCTicks = 0; // Periods of the RTC's 32.768 kHz clock so far
+
+void nativeResetTime() {
+  nativeMicros = 0;
+  nativeRTCTicks = 0;
+}
+
+void nativeAdvanceMicros(unsigned long us) {
+  nativeMicros += us;
+
+  // RTC counts whole periods of its clock, overflowing every 65536
+  unsigned long long ticks = (nativeMicros * 32768) / 1000000;
+  unsigned long long elapsed = ticks - nativeRTCTicks;
+  nativeRTCTicks = ticks;
+  if ((RTC.CTRLA & RTC_RTCEN_bm) == 0) return;
+
+  unsigned long long count = RTC.CNT + elapsed;
+  RTC.CNT = count & 0xFFFF;
+  for (unsigned long long overflows = count >> 16; overflows > 0; overflows--) {
+    RTC.INTFLAGS.raise(RTC_OVF_bm);
+    if ((RTC.INTCTRL & RTC_OVF_bm) && nativeInterruptsEnabled) RTC_CNT_vect();
+  }
+}
+
+void delay(unsigned long ms) {
+  nativeAdvanceMicros(ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+  nativeAdvanceMicros(us);
+}
+
+long map(long x, long inMin, long inMax, long outMin, long outMax) {
+  return (x - inMin) * (outMax - outMin) / (inMax - inMin) + outMin;
+}
+
+////////////////////////////////////////////////////////////
+// Host driver
+
+bool nativeComparatorEdge(uint16_t capturedCount) {
+  // Capture happens regardless of interrupts, as does the single shot trigger of TCB1
+  TCB0.CCMP = capturedCount;
+  TCB0.INTFLAGS.raise(TCB_CAPT_bm);
+
+  if (((AC1.CTRLA & AC_ENABLE_bm) == 0) || ((TCB0.INTCTRL & TCB_CAPT_bm) == 0) || !nativeInterruptsEnabled) return false;
+
+  TCB0_INT_vect();
+  TCB0.INTFLAGS = TCB_CAPT_bm; // Reading CCMP clears the flag on the hardware
+  return true;
+}
+
+bool nativeCommutationTimer(uint16_t tcb0Count) {
+  TCB0.CNT = tcb0Count;
+  TCB1.CNT = TCB1.CCMP;
+  TCB1.INTFLAGS.raise(TCB_CAPT_bm);
+
+  if (((TCB1.INTCTRL & TCB_CAPT_bm) == 0) || !nativeInterruptsEnabled) return false;
+
+  TCB1_INT_vect();
+  return true;
+}
+
+bool nativePWMInputEdge(bool level, unsigned long afterMicros) {
+  nativeAdvanceMicros(afterMicros);
+
+  uint8_t previous = PORTA.IN & PIN3_bm;
+  nativeSetPin(PORTA, PIN3_bm, level);
+  if (previous == (PORTA.IN & PIN3_bm)) return false; // No edge
+
+  // Routed to TCD0 through the event system, its counter runs off the simulated clock at 20 MHz over the prescalers
+  if (EVSYS.ASYNCCH3 == EVSYS_ASYNCCH3_PORTA_PIN3_gc) {
+    uint8_t syncShift = (TCD0.CTRLA & TCD_SYNCPRES_gm) >> 1;     // Divides by 1, 2, 4 or 8
+    static const uint8_t countShifts[4] = {0, 2, 5, 0};           // Divides by 1, 4 or 32
+    uint8_t countShift = countShifts[(TCD0.CTRLA & TCD_CNTPRES_gm) >> 3];
+    bool inputB = !level;
+    uint8_t user = inputB ? EVSYS.ASYNCUSER7 : EVSYS.ASYNCUSER6;
+    uint8_t evctrl = inputB ? TCD0.EVCTRLB : TCD0.EVCTRLA;
+    bool risingEdge = (evctrl & TCD_EDGE_RISE_HIGH_gc) != 0;
+    if ((user == EVSYS_ASYNCUSER6_ASYNCCH3_gc) && (risingEdge == level)) {
+      return nativeTCDCapture(inputB, (uint16_t)((nativeMicros * 20) >> (syncShift + countShift)));
+    }
+  }
+
+  uint8_t sense = PORTA.PIN3CTRL & PORT_ISC_gm;
+  bool triggered = (sense == PORT_ISC_BOTHEDGES_gc) ||
+                   ((sense == PORT_ISC_RISING_gc) && level) ||
+                   ((sense == PORT_ISC_FALLING_gc) && !level);
+  if (!triggered) return false;
+
+  PORTA.INTFLAGS.raise(PIN3_bm);
+  if (!nativeInterruptsEnabled) return false;
+
+  PORTA_PORT_vect();
+  return true;
+}
+
+bool nativeTCDCapture(bool inputB, uint16_t capturedCount) {
+  volatile uint8_t &evctrl = inputB ? TCD0.EVCTRLB : TCD0.EVCTRLA;
+  if (((TCD0.CTRLA & TCD_ENABLE_bm) == 0) || ((evctrl & TCD_TRIGEI_bm) == 0)) return false;
+
+  uint8_t flag = inputB ? TCD_TRIGB_bm : TCD_TRIGA_bm;
+  if (inputB) TCD0.CAPTUREB = capturedCount & 0x0FFF;
+  else TCD0.CAPTUREA = capturedCount & 0x0FFF;
+  TCD0.INTFLAGS.raise(flag);
+
+  if (((TCD0.INTCTRL & flag) == 0) || !nativeInterruptsEnabled) return false;
+
+  TCD0_TRIG_vect();
+  return true;
+}
+
+void nativeSetPin(PORT_t &port, uint8_t pinMask, bool level) {
+  if (level) port.IN |= pinMask;
+  else port.IN &= ~pinMask;
+}
+
+////////////////////////////////////////////////////////////
+// Print and Stream
+
+size_t Print::write(const char *str) {
+  size_t count = 0;
+  while (*str) count += write((uint8_t)*str++);
+  return count;
+}
+
+size_t Print::printNumber(unsigned long value, int base) {
+  char buffer[8 * sizeof(long) + 1];
+  char *text = &buffer[sizeof(buffer) - 1];
+  *text = '\0';
+
+  if (base < 2) base = DEC;
+  do {
+    char digit = value % base;
+    value /= base;
+    *--text = digit < 10 ? digit + '0' : digit + 'A' - 10;
+  } while (value);
+
+  return write(text);
+}
+
+size_t Print::print(const char *str) { return write(str); }
+size_t Print::print(char value) { return write((uint8_t)value); }
+size_t Print::print(unsigned char value, int base) { return printNumber(value, base); }
+size_t Print::print(unsigned int value, int base) { return printNumber(value, base); }
+size_t Print::print(unsigned long value, int base) { return printNumber(value, base); }
+size_t Print::print(int value, int base) { return print((long)value, base); }
+
+size_t Print::print(long value, int base) {
+  if ((base == DEC) && (value < 0)) return write('-') + printNumber(-value, DEC);
+  return printNumber(value, base);
+}
+
+size_t Print::print(double value, int digits) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%.*f", digits, value);
+  return write(buffer);
+}
+
+size_t Print::println() { return write("\r\n"); }
+size_t Print::println(const char *str) { return print(str) + println(); }
+size_t Print::println(char value) { return print(value) + println(); }
+size_t Print::println(unsigned char value, int base) { return print(value, base) + println(); }
+size_t Print::println(int value, int base) { return print(value, base) + println(); }
+size_t Print::println(unsigned int value, int base) { return print(value, base) + println(); }
+size_t Print::println(long value, int base) { return print(value, base) + println(); }
+size_t Print::println(unsigned long value, int base) { return print(value, base) + println(); }
+size_t Print::println(double value, int digits) { return print(value, digits) + println(); }
+
+size_t Print::printf(const char *format, ...) {
+  char buffer[128];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  return write(buffer);
+}
+
+long Stream::parseInt() {
+  // Skip anything that isn't part of a number, like the Arduino version
+  while (available() && (peek() != '-') && ((peek() < '0') || (peek() > '9'))) read();
+
+  bool negative = false;
+  if (available() && (peek() == '-')) {
+    negative = true;
+    read();
+  }
+
+  long value = 0;
+  while (available() && (peek() >= '0') && (peek() <= '9')) value = (value * 10) + (read() - '0');
+
+  return negative ? -value : value;
+}
+
+size_t HardwareSerial::write(uint8_t value) {
+  putchar(value);
+  return 1;
+}
+
+int HardwareSerial::available() {
+  return (rxHead - rxTail + bufferSize) % bufferSize;
+}
+
+int HardwareSerial::read() {
+  if (rxHead == rxTail) return -1;
+  uint8_t value = rxBuffer[rxTail];
+  rxTail = (rxTail + 1) % bufferSize;
+  return value;
+}
+
+int HardwareSerial::peek() {
+  if (rxHead == rxTail) return -1;
+  return rxBuffer[rxTail];
+}
+
+void HardwareSerial::nativeInject(const char *text) {
+  while (*text) {
+    int next = (rxHead + 1) % bufferSize;
+    if (next == rxTail) return; // Full, drop like the hardware would
+    rxBuffer[rxHead] = *text++;
+    rxHead = next;
+  }
+}
+
+////////////////////////////////////////////////////////////
+// Wire (slave side)
+
+size_t TwoWire::write(uint8_t value) {
+  if (txLength >= bufferSize) return 0;
+  txBuffer[txLength++] = value;
+  return 1;
+}
+
+int TwoWire::available() {
+  return rxLength - rxIndex;
+}
+
+int TwoWire::read() {
+  if (rxIndex >= rxLength) return -1;
+  return rxBuffer[rxIndex++];
+}
+
+int TwoWire::peek() {
+  if (rxIndex >= rxLength) return -1;
+  return rxBuffer[rxIndex];
+}
+
+void TwoWire::receive(uint8_t address, const uint8_t *data, uint8_t length) {
+  if (length > bufferSize) length = bufferSize;
+  memcpy(rxBuffer, data, length);
+  rxLength = length;
+  rxIndex = 0;
+  incomingAddress = address << 1; // As the master sent it, with the write bit (0)
+
+  if ((receiveHandler != nullptr) && nativeInterruptsEnabled) receiveHandler(length);
+}
+
+void TwoWire::nativeMasterWrite(const uint8_t *data, uint8_t length) {
+  receive(slaveAddress, data, length);
+}
+
+bool TwoWire::nativeGeneralCall(const uint8_t *data, uint8_t length) {
+  if (!generalCall) return false; // Not acknowledged
+  receive(0, data, length);
+  return true;
+}
+
+uint8_t TwoWire::nativeMasterRead(uint8_t *data, uint8_t length) {
+  txLength = 0;
+  if ((requestHandler != nullptr) && nativeInterruptsEnabled) requestHandler();
+
+  if (length > txLength) length = txLength;
+  memcpy(data, txBuffer, length);
+  return length;
+}
+
+////////////////////////////////////////////////////////////
+// Entry point for running the sketch by itself
+
+// Unit tests (pio test) bring their own
+#if !defined(NATIVE_HAL_NO_MAIN) && !defined(PIO_UNIT_TESTING)
+int main(int argc, char **argv) {
+  // Number of passes through loop() can be passed as the first argument
+  long passes = 1000;
+  if (argc > 1) passes = strtol(argv[1], nullptr, 10);
+
+  setup();
+  for (long i = 0; i < passes; i++) {
+    loop();
+    nativeAdvanceMicros(100); // Treat each pass as taking some time so timeouts can elapse
+  }
+
+  return 0;
+}
+#endif
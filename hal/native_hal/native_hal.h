@@ -0,0 +1,74 @@
+#ifndef ESC_NATIVE_HAL_HEADER
+#define ESC_NATIVE_HAL_HEADER
+
+/* Host driver for running the firmware natively
+
+  The peripherals are only registers in memory, so anything the hardware would do on its
+  own (timer captures, pin changes, TWI transactions) is done by calling these functions.
+  Each one loads the registers the way the hardware would, then runs the matching ISR if
+  that interrupt is enabled.
+
+  Unless NATIVE_HAL_NO_MAIN is defined (or unit tests are being built) a main() is
+  provided that runs setup() followed by a number of passes of loop(), so the sketch can
+  be exercised as-is.
+*/
+
+#include <Arduino.h>
+
+// The firmware's interrupt service routines
+extern "C" void TCB0_INT_vect(void);
+extern "C" void TCB1_INT_vect(void);
+extern "C" void PORTA_PORT_vect(void);
+extern "C" void TCD0_TRIG_vect(void);
+extern "C" void RTC_CNT_vect(void);
+
+/** @name nativeResetTime
+   *  @brief Resets the simulated clock to zero
+   */
+void nativeResetTime();
+
+/** @name nativeAdvanceMicros
+   *  @brief Moves the simulated clock forward
+   *  @param us Microseconds to advance by
+   */
+void nativeAdvanceMicros(unsigned long us);
+
+/** @name nativeComparatorEdge
+   *  @brief Simulates a zero crossing detected by AC1, captured by TCB0
+   *  @param capturedCount Value of TCB0's counter when the edge happened (what lands in TCB0.CCMP)
+   *  @return Returns true if TCB0_INT_vect was run
+   */
+bool nativeComparatorEdge(uint16_t capturedCount);
+
+/** @name nativeCommutationTimer
+   *  @brief Simulates TCB1 reaching its compare value (time to commutate)
+   *  @param tcb0Count Value of TCB0's counter at that moment
+   *  @return Returns true if TCB1_INT_vect was run
+   */
+bool nativeCommutationTimer(uint16_t tcb0Count);
+
+/** @name nativePWMInputEdge
+   *  @brief Changes the level of the PWM input pin (PA3) after advancing time. Captured by TCD0 if routed there by the event system.
+   *  @param level New level of the pin
+   *  @param afterMicros Microseconds to advance before the edge happens
+   *  @return Returns true if PORTA_PORT_vect or TCD0_TRIG_vect was run
+   */
+bool nativePWMInputEdge(bool level, unsigned long afterMicros);
+
+/** @name nativeTCDCapture
+   *  @brief Simulates an event on one of TCD0's inputs capturing its counter
+   *  @param inputB True for input B (CAPTUREB, TRIGB), false for input A
+   *  @param capturedCount Value of TCD0's 12-bit counter when the event happened
+   *  @return Returns true if TCD0_TRIG_vect was run
+   */
+bool nativeTCDCapture(bool inputB, uint16_t capturedCount);
+
+/** @name nativeSetPin
+   *  @brief Sets the input level of a pin without raising any interrupt (e.g. strapping pads)
+   *  @param port Port the pin is on
+   *  @param pinMask Bit mask of the pin
+   *  @param level Level to read back
+   */
+void nativeSetPin(PORT_t &port, uint8_t pinMask, bool level);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef ESC_NATIVE_UTIL_ATOMIC_HEADER
+#define ESC_NATIVE_UTIL_ATOMIC_HEADER
+
+/* Host stand-in for <util/atomic.h>
+
+  Interrupts are only ever run by the host driver, so the block just needs to mirror the
+  global interrupt flag the same way the AVR version does.
+*/
+
+#include "../avr/interrupt.h"
+
+#define ATOMIC_RESTORESTATE 1
+#define ATOMIC_FORCEON 0
+
+#define ATOMIC_BLOCK(type) \
+  for (bool nativeAtomicRestore = nativeInterruptsEnabled, nativeAtomicRun = (cli(), true); nativeAtomicRun; \
+       nativeAtomicRun = false, nativeInterruptsEnabled = ((type) == ATOMIC_RESTORESTATE) ? nativeAtomicRestore : true)
+
+#endif
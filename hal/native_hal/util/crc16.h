@@ -0,0 +1,18 @@
+#ifndef ESC_NATIVE_UTIL_CRC16_HEADER
+#define ESC_NATIVE_UTIL_CRC16_HEADER
+
+/* Host stand-in for <util/crc16.h>, same results as the avr-libc versions */
+
+#include <stdint.h>
+
+// CRC-8 with polynomial 0x07, no reflection
+static inline uint8_t _crc8_ccitt_update(uint8_t crc, uint8_t data) {
+  crc ^= data;
+  for (uint8_t i = 0; i < 8; i++) {
+    if (crc & 0x80) crc = (crc << 1) ^ 0x07;
+    else crc <<= 1;
+  }
+  return crc;
+}
+
+#endif
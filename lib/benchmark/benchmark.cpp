@@ -0,0 +1,232 @@
+#include "benchmark.h"
+
+#ifdef BENCHMARK
+#include <avr/interrupt.h>
+#include "motor.h"
+#include "pwmin.h"
+#include "i2c.h"
+#include "uartcomms.h"
+#include "tones.h"
+
+// Ends of the sections, placed by the linker
+extern char __data_start;
+extern char __bss_end;
+extern char __data_load_end;
+
+const byte benchmarkRepeats = 16;             // Runs of each measurement, the quickest is kept
+const uint16_t benchmarkCounterMask = 0x0FFF; // TCD0 is 12 bits
+const uint16_t benchmarkHalfStep = 1000;      // Half step the motor code acts as if it is running at (0.1 us)
+const byte benchmarkInputPin = PIN3_bm;       // Throttle input on PORTA
+const unsigned int benchmarkPulseWidth = 20;  // Width of the input pulse made for the falling edge (us)
+
+uint16_t interruptOverhead = 0; // Cycles measured around nothing, taken off each result
+uint16_t functionOverhead = 0;
+volatile unsigned int benchmarkSink; // Keeps results of timed calls from being optimised out
+
+// Software capture of TCD0. Uses CAPTUREA, which a rising edge interrupt being timed reads
+// after the starting stamp, but that only changes what it stores and not how long it takes
+inline uint16_t cycleStamp() {
+  TCD0.CTRLE = TCD_SCAPTUREA_bm;
+  while ((TCD0.STATUS & TCD_CMDRDY_bm) == 0) {
+    // Wait for the capture to be taken in TCD0's clock domain
+  }
+  return TCD0.CAPTUREA;
+}
+
+// Cycles for an interrupt that is already waiting, from letting it in to it returning
+uint16_t timeInterrupt() {
+  uint16_t start = cycleStamp();
+  sei();
+  __asm__ __volatile__ ("nop"); // The instruction after sei always runs, the interrupt is taken after it
+  cli();
+  return ((cycleStamp() - start) & benchmarkCounterMask) - interruptOverhead;
+}
+
+// Cycles for a call, with interrupts off
+uint16_t timeFunction(void (*function)()) {
+  uint16_t start = cycleStamp();
+  function();
+  return ((cycleStamp() - start) & benchmarkCounterMask) - functionOverhead;
+}
+
+// Quickest of a number of runs. prepare() sets up each run and returns with interrupts off,
+// leaving the interrupt being timed waiting if function is nullptr
+uint16_t benchmark(void (*prepare)(), void (*function)()) {
+  uint16_t best = 0xFFFF;
+  for (byte i = 0; i < benchmarkRepeats; i++) {
+    prepare();
+    uint16_t cycles = (function == nullptr) ? timeInterrupt() : timeFunction(function);
+    sei();
+
+    if (cycles < best) best = cycles;
+  }
+  return best;
+}
+
+void prepareNothing() {
+  cli();
+}
+
+void runNothing() {
+}
+
+// Motor running with a zero crossing waiting
+void prepareCrossing() {
+  cli();
+  benchmarkRunningState(benchmarkHalfStep);
+  EVSYS.ASYNCSTROBE = 0x01; // Event on channel 0 (the comparator's), captured by TCB0 and starting TCB1
+  while ((TCB0.INTFLAGS & TCB_CAPT_bm) == 0) {
+    // Wait for the capture
+  }
+}
+
+// Zero crossing handled and its commutation due
+void prepareCommutation() {
+  prepareCrossing();
+  sei();
+  __asm__ __volatile__ ("nop"); // Crossing interrupt runs here, scheduling the commutation on TCB1
+  cli();
+  while ((TCB1.INTFLAGS & TCB_CAPT_bm) == 0) {
+    // Wait out the commutation delay
+  }
+}
+
+// Motor running, for functions that act differently when it is
+void prepareRunning() {
+  cli();
+  benchmarkRunningState(benchmarkHalfStep);
+  TCB0.INTCTRL = 0; // No crossing is coming, just keep the state
+  TCB1.INTCTRL = 0;
+}
+
+// Motor running with the duty to ramp up
+void prepareRamping() {
+  prepareRunning();
+  setPWMDuty(maxDuty / 2);
+}
+
+// Rising edge on the input waiting
+void prepareInputRise() {
+  cli();
+  if (PORTA.OUT & benchmarkInputPin) {
+    // Still high from the last run, bring it down first
+    PORTA.OUTCLR = benchmarkInputPin;
+    while ((TCD0.INTFLAGS & TCD_TRIGB_bm) == 0) {
+      // Wait for the capture
+    }
+  }
+  TCD0.INTFLAGS = TCD_TRIGA_bm | TCD_TRIGB_bm;
+
+  PORTA.OUTSET = benchmarkInputPin;
+  while ((TCD0.INTFLAGS & TCD_TRIGA_bm) == 0) {
+    // Wait for the capture
+  }
+}
+
+// Falling edge ending a pulse waiting
+void prepareInputFall() {
+  prepareInputRise();
+  sei(); // Rising edge is handled
+  delayMicroseconds(benchmarkPulseWidth);
+  cli();
+
+  PORTA.OUTCLR = benchmarkInputPin;
+  while ((TCD0.INTFLAGS & TCD_TRIGB_bm) == 0) {
+    // Wait for the capture
+  }
+}
+
+// Read of the whole register map
+void prepareRegisterRead() {
+  cli();
+  i2cRegisterAddress = 0;
+}
+
+// Register write the I2C handlers are timed with, the target RPM (not used while stopped)
+const byte benchmarkWrite[] = {REG_TARGET_RPM_H, 0x27, 0x10};
+
+// Write queue empty, ready for the write to be recieved
+void prepareRecieve() {
+  i2cCommands(); // Applies anything left from the last run
+  cli();
+}
+
+// Write queued for loop() to apply
+void prepareRegisterWrite() {
+  prepareRecieve();
+  benchmarkRecieve(benchmarkWrite, sizeof(benchmarkWrite));
+}
+
+void runRecieve() {
+  benchmarkRecieve(benchmarkWrite, sizeof(benchmarkWrite));
+}
+
+void runSetPWMDuty() {
+  setPWMDuty(maxDuty / 2);
+}
+
+void runGetCurrentRPM() {
+  benchmarkSink = getCurrentRPM();
+}
+
+void printBenchmark(const char *name, uint16_t cycles) {
+  Serial.printf("%-28s %5u\n", name, cycles);
+}
+
+void runBenchmarks() {
+#ifndef ALLOW_UART_COMMS
+  Serial.begin(UART_BAUDRATE); // Not started by setup() in builds without UART commands
+#endif
+
+  stopTones(); // Startup melody would still be using TCB1
+  disableMotor();
+
+  // Input pin is driven by the ESC from here on, starting low
+  PORTA.OUTCLR = benchmarkInputPin;
+  PORTA.DIRSET = benchmarkInputPin;
+  inputCaptureSetup(inputCaptureFullSpeed); // PWM input may have it slowed down
+  delay(1);
+
+  Serial.flush(); // Nothing going out while timing
+
+  interruptOverhead = benchmark(prepareNothing, nullptr);
+  functionOverhead = benchmark(prepareNothing, runNothing);
+
+  uint16_t crossing = benchmark(prepareCrossing, nullptr);
+  uint16_t commutation = benchmark(prepareCommutation, nullptr);
+  uint16_t inputRise = benchmark(prepareInputRise, nullptr);
+  uint16_t inputFall = benchmark(prepareInputFall, nullptr);
+  uint16_t dutyChange = benchmark(prepareRunning, runSetPWMDuty);
+  uint16_t dutyRamp = benchmark(prepareRamping, runDutyRamp);
+  uint16_t rpm = benchmark(prepareRunning, runGetCurrentRPM);
+  uint16_t registerRead = benchmark(prepareRegisterRead, i2cRequest);
+  uint16_t registerQueue = benchmark(prepareRecieve, runRecieve);
+  uint16_t registerApply = benchmark(prepareRegisterWrite, i2cCommands);
+  i2cCommands(); // Leave the queue empty
+
+  disableMotor();
+  PORTA.OUTCLR = benchmarkInputPin;
+  PORTA.DIRCLR = benchmarkInputPin;
+
+  Serial.printf("\nBenchmark, CPU cycles (20 MHz), best of %u\n", benchmarkRepeats);
+  printBenchmark("Zero crossing (TCB0)", crossing);
+  printBenchmark("Commutation (TCB1)", commutation);
+  printBenchmark("Per commutation", crossing + commutation);
+  printBenchmark("Input rising edge (TCD0)", inputRise);
+  printBenchmark("Input falling edge (TCD0)", inputFall);
+  printBenchmark("setPWMDuty()", dutyChange);
+  printBenchmark("runDutyRamp() a step", dutyRamp);
+  printBenchmark("getCurrentRPM()", rpm);
+  printBenchmark("i2cRequest() whole map", registerRead);
+  printBenchmark("i2cRecieve() register write", registerQueue);
+  printBenchmark("i2cCommands() register write", registerApply);
+  Serial.printf("Overhead taken off %u (interrupts), %u (calls)\n", interruptOverhead, functionOverhead);
+
+  // Flash holds the code and constants then the initial values of variables, RAM the variables then the stack
+  uint16_t flashUsed = (uint16_t)&__data_load_end;
+  uint16_t ramUsed = &__bss_end - &__data_start;
+  uint16_t stackFree = SP - (uint16_t)&__bss_end;
+  Serial.printf("Flash used %u of %u bytes\n", flashUsed, FLASHEND + 1);
+  Serial.printf("RAM used %u of %u bytes, %u left for the stack\n", ramUsed, INTERNAL_SRAM_SIZE, stackFree);
+}
+#endif
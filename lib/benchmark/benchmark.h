@@ -0,0 +1,45 @@
+#ifndef ESC_BENCHMARK_HEADER
+#define ESC_BENCHMARK_HEADER
+
+#include <Arduino.h>
+
+/* Benchmarks
+
+  Built with BENCHMARK defined (the "bench" environment), the firmware times its hot paths
+  on the chip itself in CPU cycles once set up, then prints a report over UART along with
+  the flash and RAM used. Run it with the motor supply off and nothing on the signal pad,
+  the input pin is driven by the ESC to make its own edges.
+
+  TCD0 is set to count the 20 MHz oscillator undivided (as it does for DShot and
+  Multishot input), so a software capture of it gives exact cycles. Each measurement is
+  taken a number of times and the quickest kept, so runs held up by the clock or UART
+  interrupts drop out. The cost of taking the measurement itself (found with nothing to
+  time) is taken off.
+
+  To compare builds, flash each in turn and compare the "Per commutation" lines, the
+  readme has the steps.
+
+  Interrupts are made to happen by the real hardware rather than called, so the figures
+  include their entry, prologue, epilogue and return:
+    - Zero crossing (TCB0) - The comparator's event channel is strobed with the motor code
+      set up as if running, the same event also starts TCB1 like a real crossing.
+    - Commutation (TCB1) - Left to fire after the crossing above.
+    The two are summed as the cost of one commutation, the figure to compare builds of the
+    commutation path by. Both directions run the same code, only the table differs.
+    - Input edges (TCD0) - The input pin is driven as an output, rising then falling 20 us
+      later so the PWM decoder sees a whole (Multishot) pulse (DShot sees a bad frame).
+  Functions are called directly. The I2C request handler is run for a read of the whole
+  register map. A register write is timed on both sides: queueing it as the receive
+  handler does, and applying it in i2cCommands() (including the refresh after it). Only
+  a master can fill the Wire buffer, so the write is queued from RAM by
+  benchmarkRecieve(), the same code without Wire's buffer reads.
+
+  Each measurement must be under 4096 cycles (TCD0's range), about 200 us.
+*/
+
+/** @name runBenchmarks
+   *  @brief Times the hot paths and prints the report over UART. Leaves the motor disabled with its timers changed, so the ESC needs a reset afterwards.
+   */
+void runBenchmarks();
+
+#endif
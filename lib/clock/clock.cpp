@@ -0,0 +1,57 @@
+#include "clock.h"
+#include <util/atomic.h>
+
+volatile unsigned long clockOverflows = 0; // Each is 2 s (65536 counts at 32.768 kHz)
+
+void clockSetup() {
+  while (RTC.STATUS != 0) {
+    // Wait for any earlier writes to reach the RTC's clock domain
+  }
+  RTC.CLKSEL = RTC_CLKSEL_INT32K_gc;
+  RTC.PER = 0xFFFF; // Count through all 16 bits
+  RTC.CNT = 0;
+  RTC.INTFLAGS = RTC_OVF_bm;
+  RTC.INTCTRL = RTC_OVF_bm;
+
+  while (RTC.STATUS != 0) {
+    // Wait for the period and count to be taken
+  }
+  RTC.CTRLA = RTC_PRESCALER_DIV1_gc | RTC_RUNSTDBY_bm | RTC_RTCEN_bm;
+}
+
+ISR(RTC_CNT_vect) {
+  RTC.INTFLAGS = RTC_OVF_bm;
+  clockOverflows++;
+}
+
+// Reads the count and the overflows that go with it
+inline void clockRead(unsigned long &overflows, uint16_t &count) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    count = RTC.CNT;
+    overflows = clockOverflows;
+
+    if (RTC.INTFLAGS & RTC_OVF_bm) {
+      // Overflowed but not counted yet (interrupts are off), the count might be from before it
+      count = RTC.CNT;
+      overflows++;
+    }
+  }
+}
+
+unsigned long clockMicros() {
+  unsigned long overflows;
+  uint16_t count;
+  clockRead(overflows, count);
+
+  // 1000000 / 32768 = 15625 / 512, the overflows are left to wrap the total
+  return (overflows * 2000000UL) + ((uint32_t(count) * 15625) >> 9);
+}
+
+unsigned long clockMillis() {
+  unsigned long overflows;
+  uint16_t count;
+  clockRead(overflows, count);
+
+  // 1000 / 32768 = 125 / 4096
+  return (overflows * 2000UL) + ((uint32_t(count) * 125) >> 12);
+}
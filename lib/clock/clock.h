@@ -0,0 +1,41 @@
+#ifndef ESC_CLOCK_HEADER
+#define ESC_CLOCK_HEADER
+
+#include <Arduino.h>
+
+/* Clock
+
+  megaTinyCore keeps millis() and micros() with TCD0 on the 1-series, but here TCD0
+  captures the throttle input and the motor has TCA0 and both TCBs. So the core's
+  timekeeping is turned off (MILLIS_USE_TIMERNONE in platformio.ini) and the RTC, which
+  nothing else uses, keeps time instead. delay() and delayMicroseconds() still work
+  without it, as busy waits.
+
+  The RTC counts the internal 32.768 kHz oscillator, so readings move in steps of about
+  30.5 us and are only good to a few percent. That is plenty for time outs, the
+  scheduler and picking how many times TCB0 rolled over in a long step, anything that
+  needs to be exact is measured with a timer's own count. The 16-bit counter overflows
+  every 2 s exactly, which its interrupt counts.
+
+  Like millis() and micros(), readings wrap and should only be compared as the
+  difference from an earlier one.
+*/
+
+/** @name clockSetup
+   *  @brief Starts the RTC counting. Must be done before anything uses the clock.
+   */
+void clockSetup();
+
+/** @name clockMicros
+   *  @brief Time since clockSetup(), stands in for micros(). Safe to use from interrupts.
+   *  @return Microseconds, in steps of about 30.5
+   */
+unsigned long clockMicros();
+
+/** @name clockMillis
+   *  @brief Time since clockSetup(), stands in for millis(). Safe to use from interrupts.
+   *  @return Milliseconds
+   */
+unsigned long clockMillis();
+
+#endif
@@ -0,0 +1,280 @@
+#include "dshot.h"
+#include <util/atomic.h>
+#include "motor.h"
+#include "pwmin.h"
+#include "settings.h"
+#include "uartcomms.h"
+#include "isrprofile.h"
+#include "tones.h"
+#include "clock.h"
+
+/* Decoding
+
+  Edges are captured by TCD0 the same way as for PWM (see inputCaptureSetup()), so the
+  edge times are exact even if the interrupt is late. The counter is free running at 20 MHz
+  and wraps every 4096 counts, a whole frame is shorter than that.
+
+  The high time of each bit is kept until all 16 are in, then compared to half the bit
+  period (found from the rising edges of the whole frame). Anything that upsets the timing,
+  like the interrupt being held off too long, ends up failing the CRC and is dropped.
+
+  There is an interrupt for every edge, and TCD0 only holds one capture of each kind, so
+  the interrupt has to be done with a bit before the next one's rising edge. A DShot150
+  bit is 6.7 us (133 cycles), which it manages unless the commutation interrupts hold it
+  off. A DShot300 bit is half that, no longer than the interrupt's own entry and exit, so
+  DShot150 is the fastest rate supported. Frames at any other rate are rejected.
+*/
+
+const uint16_t dshotCounterMask = 0x0FFF;   // TCD0 is 12 bits
+const uint16_t dshotFrameGap = 300;         // Rising edges this far apart (15 us) start a new frame
+const uint16_t dshot150SpanMin = 1700;      // Span of the 15 bit periods in a frame, +/-15% of nominal
+const uint16_t dshot150SpanMax = 2300;
+
+const byte dshotArmFrames = 100;            // Consecutive zero throttle frames needed to arm
+const byte dshotMaxBadFrames = 20;          // Consecutive invalid frames before failsafe
+const unsigned int dshotTimeOutPeriod = 100; // Tolerated time without a valid frame in ms
+const byte dshotSettingRepeats = 6;         // Times a setting command must arrive in a row to be used
+
+volatile bool dshotArmed = false;
+volatile byte dshotDuty = 0;
+volatile unsigned int dshotBadFrames = 0;
+
+// Frame being recieved
+volatile byte dshotBitCount = 0;
+byte dshotHighTimes[16];
+uint16_t dshotFirstRise = 0;
+uint16_t dshotLastRise = 0;
+
+// Frame handling
+uint16_t dshotDutyScale = 0;        // Throttle to duty (Q12)
+volatile byte dshotZeroFrames = 0;  // Consecutive zero throttle frames, for arming
+volatile byte dshotInvalidRun = 0;  // Consecutive invalid frames
+volatile unsigned long dshotLastValid = 0; // clockMillis() of the last valid frame
+volatile byte dshotLastCommand = 0;
+volatile byte dshotCommandCount = 0;
+volatile byte dshotPendingCommand = 0;
+bool dshotWasArmed = false;         // Armed state last seen by dshotCommands(), for the arming tone
+
+// Spin direction
+bool dshotPadReverse = false;       // Direction set by the pad, commands are relative to this
+
+void dshotFrame(uint16_t frame);
+void dshotBadFrame();
+
+void dshotSetup() {
+  inputCaptureSetup(inputCaptureFullSpeed);
+
+  // Rounded up so full throttle reaches maxDuty, clamped when used
+  uint16_t throttleRange = dshotThrottleMax - dshotThrottleMin;
+  dshotDutyScale = ((uint32_t(maxDuty - minDuty) << 12) + throttleRange - 1) / throttleRange;
+
+  // Apply the saved direction on top of the pad
+  dshotPadReverse = reverse;
+  setDirection(dshotPadReverse ^ settings.dshotReversed);
+
+#ifdef UART_COMMS_DEBUG
+  Serial.printf("DShot input set up, saved direction %s\n", settings.dshotReversed ? "reversed" : "normal");
+#endif
+}
+
+// Rising edge of a bit
+inline void dshotRise(uint16_t capture) {
+  if ((dshotBitCount != 0) && (((capture - dshotLastRise) & dshotCounterMask) > dshotFrameGap)) {
+    // Gap in the middle of a frame, lost some edges
+    dshotBadFrame();
+    dshotBitCount = 0;
+  }
+
+  if (dshotBitCount == 0) dshotFirstRise = capture;
+  dshotLastRise = capture;
+}
+
+// Falling edge of a bit, decodes once all bits are in
+inline void dshotFall(uint16_t capture) {
+  uint16_t highTime = (capture - dshotLastRise) & dshotCounterMask;
+  dshotHighTimes[dshotBitCount] = min(highTime, 255);
+  dshotBitCount++;
+
+  if (dshotBitCount < 16) return;
+  dshotBitCount = 0;
+
+  // Bits are a 1 if high for more than half the bit period, 15 periods between first and last rise
+  uint16_t span = (dshotLastRise - dshotFirstRise) & dshotCounterMask;
+  if ((span < dshot150SpanMin) || (span > dshot150SpanMax)) {
+    dshotBadFrame(); // Not DShot150
+    return;
+  }
+  byte threshold = (span * 17) >> 9; // span / 30
+
+  uint16_t frame = 0;
+  for (byte i = 0; i < 16; i++) {
+    frame <<= 1;
+    if (dshotHighTimes[i] > threshold) frame |= 1;
+  }
+
+  dshotFrame(frame);
+}
+
+#ifdef USE_DSHOT_CONTROL
+ISR(TCD0_TRIG_vect) {
+#ifdef PROFILE_ISRS
+  isrProfileScope profile(isrProfileEnum::ISR_INPUT);
+#endif
+  byte flags = TCD0.INTFLAGS & (TCD_TRIGA_bm | TCD_TRIGB_bm);
+  uint16_t rise = TCD0.CAPTUREA;
+  uint16_t fall = TCD0.CAPTUREB;
+  TCD0.INTFLAGS = flags;
+
+  if (flags == (TCD_TRIGA_bm | TCD_TRIGB_bm)) {
+    // Held off long enough for both edges, handle them in the order they happened
+    if (((fall - dshotLastRise) & dshotCounterMask) < ((rise - dshotLastRise) & dshotCounterMask)) {
+      dshotFall(fall);
+      dshotRise(rise);
+    }
+    else {
+      dshotRise(rise);
+      dshotFall(fall);
+    }
+  }
+  else if (flags == TCD_TRIGA_bm) dshotRise(rise);
+  else if (flags == TCD_TRIGB_bm) dshotFall(fall);
+}
+#endif
+
+bool dshotDecodeFrame(uint16_t frame, uint16_t &value, bool &telemetry) {
+  // CRC is the XOR of the three nibbles above it
+  uint16_t data = frame >> 4;
+  byte crc = (data ^ (data >> 4) ^ (data >> 8)) & 0x0F;
+
+  value = data >> 1;
+  telemetry = data & 0x01;
+  return (crc == (frame & 0x0F));
+}
+
+void dshotFrame(uint16_t frame) {
+  uint16_t value;
+  bool telemetry;
+  if (dshotDecodeFrame(frame, value, telemetry) == false) {
+    dshotBadFrame();
+    return;
+  }
+
+  dshotInvalidRun = 0;
+  dshotLastValid = clockMillis();
+
+  if (value == 0) {
+    // Zero throttle, counts towards arming
+    if (dshotZeroFrames < dshotArmFrames) dshotZeroFrames++;
+    else dshotArmed = true;
+
+    dshotDuty = 0;
+    dshotCommandCount = 0;
+    if (motorStatus && (controlScheme == ctrlSchemeEnum::PWM)) setPWMDuty(0);
+  }
+  else if (value < dshotThrottleMin) {
+    // Commands, only while stopped. Settings need to be repeated (with telemetry set) to count
+    if (motorStatus) return;
+
+    if (value == dshotLastCommand) {
+      if (dshotCommandCount < 255) dshotCommandCount++;
+    }
+    else {
+      dshotLastCommand = value;
+      dshotCommandCount = 1;
+    }
+
+    byte repeatsNeeded = (value <= DSHOT_CMD_BEEP5) ? 1 : dshotSettingRepeats;
+    if ((value > DSHOT_CMD_BEEP5) && (telemetry == false)) return;
+    if (dshotCommandCount == repeatsNeeded) dshotPendingCommand = value;
+  }
+  else {
+    // Throttle, only used once armed
+    dshotZeroFrames = 0;
+    dshotCommandCount = 0;
+    if (dshotArmed == false) return;
+
+    dshotDuty = min(minDuty + ((uint32_t(value - dshotThrottleMin) * dshotDutyScale) >> 12), maxDuty);
+    if (motorStatus && (controlScheme == ctrlSchemeEnum::PWM)) setPWMDuty(dshotDuty);
+  }
+}
+
+void dshotBadFrame() {
+  dshotBadFrames++;
+  if (dshotInvalidRun < 255) dshotInvalidRun++;
+}
+
+void dshotCommands() {
+  // Let the user know when it arms
+  bool armed = dshotArmed;
+  if (armed != dshotWasArmed) {
+    dshotWasArmed = armed;
+    if (armed) playMelody(MELODY_ARMED);
+  }
+
+  byte command = dshotPendingCommand;
+  if (command == 0) return;
+  dshotPendingCommand = 0;
+
+#ifdef UART_COMMS_DEBUG
+  Serial.printf("DShot command %d\n", command);
+#endif
+
+  if (motorStatus) return; // Only act while stopped
+
+  switch (command) {
+  case DSHOT_CMD_BEEP1:
+  case DSHOT_CMD_BEEP2:
+  case DSHOT_CMD_BEEP3:
+  case DSHOT_CMD_BEEP4:
+  case DSHOT_CMD_BEEP5:
+    queueTone(1200 - (command * 150), 260); // Higher pitch for each beep number
+    break;
+
+  case DSHOT_CMD_SPIN_DIRECTION_1:
+  case DSHOT_CMD_SPIN_DIRECTION_NORMAL:
+    settings.dshotReversed = false;
+    setDirection(dshotPadReverse);
+    break;
+
+  case DSHOT_CMD_SPIN_DIRECTION_2:
+  case DSHOT_CMD_SPIN_DIRECTION_REVERSED:
+    settings.dshotReversed = true;
+    setDirection(!dshotPadReverse);
+    break;
+
+  case DSHOT_CMD_SAVE_SETTINGS:
+    saveSettings();
+    break;
+  }
+}
+
+void dshotDisarm() {
+  // Need to see zero throttle again before running
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    dshotArmed = false;
+    dshotZeroFrames = 0;
+    dshotDuty = 0;
+  }
+}
+
+bool checkDShotFailsafe() {
+  if (dshotArmed == false) return false;
+
+  unsigned long lastValid;
+  byte invalidRun;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    lastValid = dshotLastValid;
+    invalidRun = dshotInvalidRun;
+  }
+
+  if (((clockMillis() - lastValid) > dshotTimeOutPeriod) || (invalidRun >= dshotMaxBadFrames)) {
+    dshotDisarm();
+
+#ifdef UART_COMMS_DEBUG
+    Serial.println("DShot failsafe, disarmed.");
+#endif
+    return true;
+  }
+
+  return false;
+}
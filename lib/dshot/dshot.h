@@ -0,0 +1,70 @@
+#ifndef ESC_DSHOT_HEADER
+#define ESC_DSHOT_HEADER
+
+#include <Arduino.h>
+
+/* DShot input
+
+  Uses the same input pin as PWM (PA3). Each frame is 16 bits, MSB first: an 11 bit value,
+  a telemetry request bit, then a 4 bit CRC. A "1" is high for 75% of the bit, a "0" for
+  37.5%. Only DShot150 is accepted, faster rates have edges closer together than the
+  interrupt can keep up with (see dshot.cpp).
+
+  Values 1 to 47 are commands, 48 to 2047 are throttle. Throttle is only used once armed
+  by receiving zero throttle for a while, invalid or missing frames disarm the ESC.
+*/
+
+enum dshotCommandEnum: byte {
+  DSHOT_CMD_MOTOR_STOP = 0,
+  DSHOT_CMD_BEEP1 = 1,
+  DSHOT_CMD_BEEP2 = 2,
+  DSHOT_CMD_BEEP3 = 3,
+  DSHOT_CMD_BEEP4 = 4,
+  DSHOT_CMD_BEEP5 = 5,
+  DSHOT_CMD_SPIN_DIRECTION_1 = 7,
+  DSHOT_CMD_SPIN_DIRECTION_2 = 8,
+  DSHOT_CMD_SAVE_SETTINGS = 12,
+  DSHOT_CMD_SPIN_DIRECTION_NORMAL = 20,
+  DSHOT_CMD_SPIN_DIRECTION_REVERSED = 21
+};
+
+const uint16_t dshotThrottleMin = 48;   // Lowest throttle value, below are commands
+const uint16_t dshotThrottleMax = 2047;
+
+extern volatile bool dshotArmed;            // Set once enough zero throttle frames arrive
+extern volatile byte dshotDuty;             // Duty for the last valid throttle, 0 if stopped or disarmed
+extern volatile unsigned int dshotBadFrames; // Frames rejected for their CRC or timing
+
+/** @name dshotSetup
+   *  @brief Sets up the DShot input, edges are captured by TCD0 through the event system
+   *  @note Applies the saved spin direction, so must be after setupMotor() and loading the settings
+   */
+void dshotSetup();
+
+/** @name dshotDecodeFrame
+   *  @brief Checks and splits a 16 bit DShot frame
+   *  @param frame Frame as recieved, MSB first
+   *  @param value Returns the 11 bit value (throttle or command)
+   *  @param telemetry Returns the telemetry request bit
+   *  @return Returns true if the CRC matched
+   */
+bool dshotDecodeFrame(uint16_t frame, uint16_t &value, bool &telemetry);
+
+/** @name dshotCommands
+   *  @brief Carries out DShot commands (beeps, spin direction, saving) once recieved enough times, and plays the arming tone
+   *  @note Should be called every pass of the main control loop
+   */
+void dshotCommands();
+
+/** @name dshotDisarm
+   *  @brief Disarms, zero throttle has to be recieved for a while again before throttle is used
+   */
+void dshotDisarm();
+
+/** @name checkDShotFailsafe
+  * @brief Checks for missing or repeatedly invalid DShot frames, disarming if so
+  * @return Returns true if armed and frames stopped being valid
+  * */
+bool checkDShotFailsafe();
+
+#endif
@@ -0,0 +1,78 @@
+#include "eventlog.h"
+
+volatile logEntry eventLogBuffer[eventLogLength];
+volatile byte eventLogHead = 0;
+volatile byte eventLogTail = 0;
+volatile byte eventLogDropped = 0;
+
+/* Step summaries
+  Three characters (one for each phase), ordered A-B-C.
+    H - Driven high
+    L - Driven low
+    R - Looking for rising edge (floating)
+    F - Looking for falling edge (floating)
+*/
+const char stepSummaries[2][6][4] = {
+  {"HLF", "HRL", "FHL", "LHR", "LFH", "RLH"},   // Normal
+  {"HLR", "FLH", "LRH", "LHF", "RHL", "HFL"}    // Reversed
+};
+
+void eventLogDrain() {
+#ifdef UART_COMMS_DEBUG
+  // Only what was queued on entry, and only a few of those, since interrupts can add steps
+  // faster than they print. Anything that doesn't fit in the ring meanwhile is counted as dropped
+  byte head = eventLogHead;
+  for (byte printed = 0; (eventLogTail != head) && (printed < eventLogDrainLimit); printed++) {
+    byte event = eventLogBuffer[eventLogTail].event;
+    byte value = eventLogBuffer[eventLogTail].value;
+    eventLogTail = (eventLogTail + 1) & (eventLogLength - 1); // Free it before the slow part
+
+    byte dropped = eventLogDropped;
+    if (dropped != 0) {
+      eventLogDropped = 0;
+      Serial.printf("(%d events dropped)\n", dropped);
+    }
+
+    switch (event) {
+    case LOG_STEP:
+      Serial.println(stepSummaries[(value >> 3) & 0x01][(value & 0x07) % 6]);
+      break;
+    case LOG_SPINUP_START:
+      Serial.println("Motor spin-up starting...");
+      break;
+    case LOG_SPINUP_FAILED:
+      Serial.printf("Spin-up failed to lock (attempt %d).\n", value);
+      break;
+    case LOG_SPINUP_DONE:
+      Serial.println("Spin-up DONE!");
+      break;
+    case LOG_DUTY:
+      Serial.print("ESC duty: ");
+      Serial.println(value);
+      break;
+    case LOG_DUTY_CLAMPED:
+      Serial.println("Duty specified over maximum, clamping it to max.");
+      break;
+    case LOG_DUTY_TOO_LOW:
+      Serial.println("Duty too low, disabling.");
+      break;
+    case LOG_ENABLE_TOO_LOW:
+      Serial.println("Duty too low to enable.");
+      break;
+    case LOG_ALREADY_SPINNING:
+      Serial.println("Motor already spinning.");
+      break;
+    case LOG_ENABLED:
+      Serial.println("\n! MOTOR ENABLED !\n");
+      break;
+    case LOG_DISABLED:
+      Serial.println("\n! MOTOR DISABLED !\n");
+      break;
+    case LOG_DESYNC:
+      Serial.print("Desync detected, cause: ");
+      Serial.println(value);
+      break;
+    }
+  }
+#endif
+}
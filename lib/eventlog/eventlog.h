@@ -0,0 +1,82 @@
+#ifndef ESC_EVENTLOG_HEADER
+#define ESC_EVENTLOG_HEADER
+
+#include <Arduino.h>
+#include <util/atomic.h>
+#include "uartcomms.h"
+
+/* Debug event log
+
+  Printing over UART takes close to 100 us a character at 115200 baud, far too long to
+  do in an interrupt (or anything an interrupt calls) without upsetting commutation. So
+  debug messages that could come from an interrupt are queued as a two byte event (code
+  and a value) instead, and eventLogDrain() prints them from loop().
+
+  The queue is a ring with the interrupts (and loop()) adding to the head and only
+  eventLogDrain() taking from the tail. Adding is done with interrupts held off so an
+  interrupt can't add in the middle of loop() adding, it only takes a few cycles. If the
+  ring is full the event is dropped and counted, the count is printed with the next event.
+  Each call of eventLogDrain() prints at most a few events, so a motor stepping faster
+  than lines can be printed drops steps rather than holding up the rest of loop().
+
+  Without UART_COMMS_DEBUG all of this compiles to nothing.
+*/
+
+enum logEventEnum: byte {
+  LOG_STEP,               // Value: step, bit 3 set if reversed
+  LOG_SPINUP_START,
+  LOG_SPINUP_FAILED,      // Value: attempt number
+  LOG_SPINUP_DONE,
+  LOG_DUTY,               // Value: duty
+  LOG_DUTY_CLAMPED,
+  LOG_DUTY_TOO_LOW,       // Disabled because of it
+  LOG_ENABLE_TOO_LOW,
+  LOG_ALREADY_SPINNING,
+  LOG_ENABLED,
+  LOG_DISABLED,
+  LOG_DESYNC              // Value: cause
+};
+
+struct logEntry {
+  byte event;
+  byte value;
+};
+
+const byte eventLogLength = 32; // Must be a power of two
+const byte eventLogDrainLimit = 4; // Most events printed per eventLogDrain(), each line takes up to about 1 ms
+
+extern volatile logEntry eventLogBuffer[eventLogLength];
+extern volatile byte eventLogHead;    // Next entry to be added
+extern volatile byte eventLogTail;    // Next entry to be printed
+extern volatile byte eventLogDropped; // Events lost to a full ring since the last print
+
+/** @name logEvent
+   *  @brief Queues a debug event to be printed from loop(). Safe to use from interrupts.
+   *  @param event Event code
+   *  @param value Value to go with it, meaning depends on the event
+   */
+inline void logEvent(logEventEnum event, byte value = 0) {
+#ifdef UART_COMMS_DEBUG
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    byte nextHead = (eventLogHead + 1) & (eventLogLength - 1);
+    if (nextHead == eventLogTail) {
+      if (eventLogDropped < 255) eventLogDropped++;
+    }
+    else {
+      eventLogBuffer[eventLogHead].event = event;
+      eventLogBuffer[eventLogHead].value = value;
+      eventLogHead = nextHead;
+    }
+  }
+#else
+  (void)event;
+  (void)value;
+#endif
+}
+
+/** @name eventLogDrain
+   *  @brief Prints queued events over UART, at most eventLogDrainLimit of them a call. To be called from loop().
+   */
+void eventLogDrain();
+
+#endif
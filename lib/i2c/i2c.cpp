@@ -1,11 +1,54 @@
 #include "i2c.h"
 #include <Wire.h>
+#include <util/atomic.h>
 #include "led.h"
 #include "motor.h"
+#include "trace.h"
+#include "isrprofile.h"
+#include "tones.h"
 #include "uartcomms.h"
+#include "clock.h"
 
 byte i2cAddress = 10;      // I2C address. Starts with a default, then adds offset according to soldering pads
-byte currentI2CInstruction = 0;
+byte i2cSlot = 0;          // Offset set by the soldering pads, picks this ESC's throttle in broadcasts
+volatile byte i2cRegisterAddress = 0;
+volatile byte i2cRegisters[I2C_REGISTER_COUNT]; // Image of the register map that transfers are made from
+const byte i2cRefreshPeriod = 10;  // Most time between refreshes of the image and page while nothing is written (ms)
+unsigned long i2cLastRefresh = 0;  // clockMillis() at the last refresh
+
+// Trace or interrupt statistics page being read, prepared in loop() so the request interrupt only copies it out
+const byte i2cPageSize = (i2cTracePageSize > isrProfilePageSize) ? i2cTracePageSize : isrProfilePageSize;
+volatile byte i2cPage[i2cPageSize];
+volatile byte i2cPageLength = 0;
+volatile byte i2cPageAddress = 0; // Register address the page was prepared for, 0 while there isn't one
+
+// Queue of written frames (register address then data) from the TWI interrupt to loop()
+// Single producer (interrupt) and single consumer (loop), so the indices need no locking
+struct i2cFrame {
+  bool broadcast; // Came to the general call address
+  byte length;
+  byte data[I2C_REGISTER_COUNT + 1];
+};
+const byte i2cQueueLength = 4; // Must be a power of two
+volatile i2cFrame i2cQueue[i2cQueueLength];
+volatile byte i2cQueueHead = 0;   // Next frame to be filled by the interrupt
+volatile byte i2cQueueTail = 0;   // Next frame to be applied by loop()
+volatile byte i2cDroppedFrames = 0;
+
+// Broadcast throttle latched for this ESC, waiting for an apply
+word latchedThrottle = 0;
+bool throttleLatched = false;
+
+// Register image handling
+void handleBroadcast(volatile i2cFrame &frame);
+void applyThrottle(word throttle);
+void updateRegisters();
+void preparePage();
+void applyRegisters(byte first, byte last);
+bool registersWritten(byte first, byte last, byte low, byte high);
+bool registersWhole(byte first, byte last, byte low, byte high);
+word registerWord(byte high);
+void setRegisterWord(byte high, word value);
 
 void i2cSetup() {
 
@@ -27,11 +70,12 @@ void i2cSetup() {
   byte temp = PORTC.IN & 0x07;  // Extract the 3 bits for setting
   temp ^= 0x07;       // Flips the bits (since I am shorting the pads I want to set as "1")
   i2cAddress += temp; // Add offest to default value
+  i2cSlot = temp;
 
   PORTMUX.CTRLB = PORTMUX_TWI0_bm; // Multiplex the I2C/TWI to use the alternate pins
 
   // Start the I2C interface 
-  Wire.begin(i2cAddress);
+  Wire.begin(i2cAddress, true); // Also listen to the general call address for broadcasts
   Wire.onRequest(i2cRequest);
   Wire.onReceive(i2cRecieve);
 
@@ -41,153 +85,358 @@ void i2cSetup() {
 #endif
 }
 
-void i2cRecieve(int howMany) {
-  currentI2CInstruction = Wire.read();
+/* Queueing writes
 
-#ifdef UART_COMMS_DEBUG
-  Serial.print("Recieved I2C command type: ");
-  Serial.println(currentI2CInstruction);
-#endif
+  The interrupt's work is done by queueWrite(), which takes its bytes from anything that
+  reads like Wire. The firmware only hands it Wire, the benchmark build also a write held
+  in RAM so it can be timed without a master on the bus.
+*/
+template <class byteSource>
+inline void queueWrite(byteSource &source, bool broadcast) {
+  if (broadcast && (source.peek() != i2cBroadcastThrottle)) {
+    // General call meant for some other kind of device, not ours to act on
+    while (source.available()) source.read();
+    return;
+  }
 
-  // Check for KILL ORDER
-  if (currentI2CInstruction == 0) {
-    disableMotor();
+  // Set now so a read straight after uses it. Broadcasts are for everyone so they leave it be
+  if (broadcast == false) i2cRegisterAddress = source.peek();
 
-    while (true) {
-      // Trap ESC in loop until reboot
-    }
+  byte nextHead = (i2cQueueHead + 1) & (i2cQueueLength - 1);
+  if ((source.available() == 1) || (nextHead == i2cQueueTail)) {
+    // Just setting the address for a read, or no room to queue it
+    if (source.available() > 1) i2cDroppedFrames++;
+    while (source.available()) source.read();
+    return;
   }
 
-  if (currentI2CInstruction == 1) {
-    // Reverse, read only
+  volatile i2cFrame &frame = i2cQueue[i2cQueueHead];
+  frame.broadcast = broadcast;
+  byte length = 0;
+  while (source.available() && (length < sizeof(frame.data))) {
+    frame.data[length] = source.read();
+    length++;
   }
-  else if (currentI2CInstruction == 2) {
-    // Duty, set if another byte present
-    if (Wire.available()) {
-      enableMotor(Wire.read());
-    }
+  frame.length = length;
+  i2cQueueHead = nextHead; // Frame only becomes visible to loop() once filled
+
+  // Clear buffer of any other fluff
+  while (source.available()) {
+    source.read();
   }
-  else if (currentI2CInstruction == 3) {
-    // Current RPM, read only
+}
+
+void i2cRecieve(int howMany) {
+#ifdef PROFILE_ISRS
+  isrProfileScope profile(isrProfileEnum::ISR_TWI);
+#endif
+
+  // Only queue the frame here, applying it can take a while (e.g. starting the motor)
+  if (howMany <= 0) return;
+
+  // Broadcasts come to the general call address (0), the address byte includes the R/W bit
+  queueWrite(Wire, (Wire.getIncomingAddress() >> 1) == 0);
+}
+
+#ifdef BENCHMARK
+// Reads a write held in RAM the way Wire reads its buffer
+struct ramSource {
+  const byte *data;
+  byte length;
+
+  int available() {
+    return length;
   }
-  else if (currentI2CInstruction == 4) {
-    // Control scheme
-    if (Wire.available()) {
-      controlScheme = ctrlSchemeEnum(Wire.read());
-    }
+  int peek() {
+    return *data;
   }
-  else if (currentI2CInstruction == 5) {
-    // Target RPM
-    if (Wire.available()) {
-      targetRPM = readWordWire(); // Read
-    }
+  int read() {
+    length--;
+    return *data++;
   }
-  else if (currentI2CInstruction == 6) {
-    // Number of cycles in a rotation
-    if (Wire.available()) {
-      cyclesPerRotation = Wire.read();
+};
+
+void benchmarkRecieve(const byte *data, byte length) {
+  ramSource source = {data, length};
+  if (length > 0) queueWrite(source, false);
+}
+#endif
+
+void i2cCommands() {
+  bool written = false;
+
+  while (i2cQueueTail != i2cQueueHead) {
+    volatile i2cFrame &frame = i2cQueue[i2cQueueTail];
+    byte first = frame.data[0];
+
+    if (frame.broadcast) {
+      handleBroadcast(frame);
+      i2cQueueTail = (i2cQueueTail + 1) & (i2cQueueLength - 1);
+      continue;
+    }
+
+#ifdef UART_COMMS_DEBUG
+    Serial.print("Recieved I2C write to register: ");
+    Serial.println(first);
+#endif
+
+    // Bring the image up to date so registers only partly written keep their current bytes
+    updateRegisters();
+
+    // Write consecutive registers with whatever follows the address
+    byte address = first;
+    for (byte i = 1; (i < frame.length) && (address < I2C_REGISTER_COUNT); i++) {
+      i2cRegisters[address] = frame.data[i];
+      address++;
     }
+
+    i2cQueueTail = (i2cQueueTail + 1) & (i2cQueueLength - 1); // Free the slot before the (possibly slow) actions
+    if (address > first) applyRegisters(first, address - 1);
+    written = true;
   }
-  else if (currentI2CInstruction == 7) {
-    if (Wire.available()) motorStatus = Wire.read();
 
-    // Enable or disable motor
-    if (motorStatus) enableMotor(minDuty + 1); // Set motor to minimum
-    else disableMotor();
+  /* Keep the image and the page being read current, the request interrupt only copies 
+    them out. Working them out costs divisions and atomic copies, so it is done every 
+    i2cRefreshPeriod rather than every pass, and straight away after a write or when a 
+    new page is addressed.
+  */
+  byte address = i2cRegisterAddress;
+  bool newPage = (address >= i2cTracePage) && (address != i2cPageAddress);
+  unsigned long now = clockMillis();
+
+  if (written || newPage || ((now - i2cLastRefresh) >= i2cRefreshPeriod)) {
+    i2cLastRefresh = now;
+    updateRegisters();
+    preparePage();
+  }
+}
+
+void handleBroadcast(volatile i2cFrame &frame) {
+  // Frame is the command, flags, then a throttle word for each slot in order
+  // Slots past the end of the frame are left out, so a frame with just the flags is only a strobe
+  byte slotIndex = 2 + 2 * i2cSlot;
+  if (frame.length >= slotIndex + 2) {
+    latchedThrottle = (frame.data[slotIndex] << 8) | frame.data[slotIndex + 1];
+    throttleLatched = true;
   }
-  else if (currentI2CInstruction == 8) {
-    // Blink LED
-    while (Wire.available() < 4) {
-      // Wait until we recieve the four bytes we need
-    }
-    
-    unsigned int blinkPeriod = int(readWordWire());    
-    unsigned int blinkCount = readWordWire();
 
 #ifdef UART_COMMS_DEBUG
-    Serial.printf("Blinking LED for %d ms, %d times.\n", blinkPeriod, blinkCount);
+  Serial.printf("Broadcast throttle, flags %d, latched %u\n", frame.data[1], latchedThrottle);
 #endif
 
-    setNonBlockingBlink(blinkPeriod, blinkCount); // Needs to be non-blocking since this is in an interrupt
-    
+  if ((frame.length >= 2) && (frame.data[1] & i2cBroadcastApply_bm) && throttleLatched) {
+    throttleLatched = false;
+    applyThrottle(latchedThrottle);
   }
-  else if (currentI2CInstruction == 9) {
-    // Buzzing
-    
-    while (Wire.available() < 4) {
-      // Wait until we recieve the four bytes we need
-    }
+}
 
-    unsigned int buzzPeriod = readWordWire();
-    unsigned int buzzDuration = readWordWire();
+void applyThrottle(word throttle) {
+  // Throttle is a duty or a target RPM depending on the control scheme, zero stops the motor
+  if (controlScheme == ctrlSchemeEnum::RPM) {
+    targetRPM = throttle;
+    if (throttle == 0) disableMotor();
+    else if (motorStatus == false) enableMotor(minDuty + 1); // Governor takes it from there
+  }
+  else {
+    byte throttleDuty = min(throttle, maxDuty);
+    if (motorStatus) setPWMDuty(throttleDuty);
+    else enableMotor(throttleDuty);
+  }
+}
 
-#ifdef UART_COMMS_DEBUG    
-    Serial.printf("Buzzing with period of %d us for %d ms.\n", buzzPeriod, buzzDuration);
+void i2cRequest() {
+#ifdef PROFILE_ISRS
+  isrProfileScope profile(isrProfileEnum::ISR_TWI);
 #endif
 
-    setToBuzz(buzzPeriod, buzzDuration);
+  if (i2cRegisterAddress >= i2cTracePage) {
+    // Trace or interrupt statistics, only once i2cCommands() has prepared the page for this address
+    if (i2cPageAddress == i2cRegisterAddress) {
+      for (byte i = 0; i < i2cPageLength; i++) Wire.write(i2cPage[i]);
+    }
+    return;
   }
 
-  // Clear buffer of any other fluff
-  while (Wire.available()) {
-    Wire.read();
+  // Send everything from the current address, the master stops reading when it has what it wants
+  // The image is kept up to date by i2cCommands() so this stays short
+  for (byte address = i2cRegisterAddress; address < I2C_REGISTER_COUNT; address++) {
+    Wire.write(i2cRegisters[address]);
   }
 }
 
-void i2cRequest() {
+void updateRegisters() {
+  // Loads the current values of everything readable into the register image
+  // Action registers (blink, buzz) are left as they are, so they read back what was last written
+  i2cRegisters[REG_STATUS] = spinUpState | (reverse << 3) | (motorStatus << 4);
+  i2cRegisters[REG_DUTY] = duty;
+  setRegisterWord(REG_RPM_H, getCurrentRPM());
+  i2cRegisters[REG_CONTROL_SCHEME] = controlScheme;
 
-#ifdef UART_COMMS_DEBUG
-  Serial.print("Recieved I2C request type: ");
-  Serial.println(currentI2CInstruction);
-#endif
+  byte errorFlags = 0;
+  for (byte i = 0; i < desyncCauseCount; i++) {
+    if (desyncCounts[i]) errorFlags |= 1 << i;
+  }
+  i2cRegisters[REG_ERROR_FLAGS] = errorFlags;
+  setRegisterWord(REG_TARGET_RPM_H, targetRPM);
+
+  i2cRegisters[REG_CYCLES_PER_ROTATION] = cyclesPerRotation;
+  i2cRegisters[REG_TIMING_ADVANCE] = timingAdvance;
+  i2cRegisters[REG_PERIOD_FILTER] = periodFilter;
+  i2cRegisters[REG_MOTOR_ENABLE] = motorStatus;
+
+  for (byte i = 0; i < desyncCauseCount; i++) {
+    setRegisterWord(REG_DESYNC_INTERVAL_H + 2 * i, desyncCounts[i]);
+  }
+  i2cRegisters[REG_DESYNC_CLEAR] = 0;
+
+  uint16_t pointRPM;
+  byte pointAdvance;
+  if (i2cRegisters[REG_ADVANCE_INDEX] >= advanceCurvePoints) i2cRegisters[REG_ADVANCE_INDEX] = advanceCurvePoints - 1;
+  getAdvanceCurvePoint(i2cRegisters[REG_ADVANCE_INDEX], pointRPM, pointAdvance);
+  setRegisterWord(REG_ADVANCE_RPM_H, pointRPM);
+  i2cRegisters[REG_ADVANCE_VALUE] = pointAdvance;
+
+  i2cRegisters[REG_KILL] = 0;
+
+  i2cRegisters[REG_TRACE_CONTROL] = traceState;
+  i2cRegisters[REG_TRACE_COUNT] = traceCount();
+  i2cRegisters[REG_ISR_PROFILE_CLEAR] = 0;
+
+  i2cRegisters[REG_RAMP_UP] = dutyRampUp;
+  i2cRegisters[REG_RAMP_DOWN] = dutyRampDown;
+  i2cRegisters[REG_DUTY_IMMEDIATE] = 0;
+
+  setRegisterWord(REG_GAIN_P_H, rpmGainP);
+  setRegisterWord(REG_GAIN_I_H, rpmGainI);
+}
+
+void preparePage() {
+  byte address = i2cRegisterAddress;
+  if (address < i2cTracePage) return; // Reading the register image
+
+  // Marked as not ready while it is filled, the request interrupt can come at any point
+  i2cPageAddress = 0;
+
+  byte page[i2cPageSize];
+  byte length;
+  if ((address >= i2cISRPage) && (address < (i2cISRPage + isrProfileCount))) {
+    length = isrProfileRead(isrProfileEnum(address - i2cISRPage), page);
+  }
+  else length = traceRead(page, (address - i2cTracePage) * i2cTracePageSize, i2cTracePageSize);
+
+  for (byte i = 0; i < length; i++) i2cPage[i] = page[i];
+  i2cPageLength = length;
+  i2cPageAddress = address;
+}
+
+void applyRegisters(byte first, byte last) {
+  // Acts on the registers written in a transaction (first to last inclusive)
+  // Settings are applied before the duty and enable so those start the motor with the new settings
+
+  // Check for KILL ORDER
+  if (registersWritten(first, last, REG_KILL, REG_KILL) && (i2cRegisters[REG_KILL] == i2cKillKey)) {
+    disableMotor();
+    cli(); // Nothing else is to run, including I2C and PWM input
+
+    while (true) {
+      // Trap ESC in loop until reboot
+    }
+  }
 
-  // Returns a variable based on the previous command
-  
-  if (currentI2CInstruction == 0) {
-    Wire.write(motorStatus);
+  if (registersWritten(first, last, REG_CONTROL_SCHEME, REG_CONTROL_SCHEME) && (i2cRegisters[REG_CONTROL_SCHEME] <= ctrlSchemeEnum::RPM)) {
+    controlScheme = ctrlSchemeEnum(i2cRegisters[REG_CONTROL_SCHEME]); // Anything else is ignored, the refresh puts back the current one
   }
-  else if (currentI2CInstruction == 1) {
-    Wire.write(reverse);
+  if (registersWritten(first, last, REG_TARGET_RPM_H, REG_TARGET_RPM_L)) {
+    targetRPM = registerWord(REG_TARGET_RPM_H);
   }
-  else if (currentI2CInstruction == 2) {
-    Wire.write(duty);
+  if (registersWritten(first, last, REG_CYCLES_PER_ROTATION, REG_CYCLES_PER_ROTATION)) {
+    setCyclesPerRotation(i2cRegisters[REG_CYCLES_PER_ROTATION]);
   }
-  else if (currentI2CInstruction == 3) {
-    // RPM
-    sendWordWire(getCurrentRPM());
+  if (registersWritten(first, last, REG_TIMING_ADVANCE, REG_TIMING_ADVANCE)) {
+    setTimingAdvance(i2cRegisters[REG_TIMING_ADVANCE]);
   }
-  else if (currentI2CInstruction == 4) {
-    // Control scheme
-    Wire.write(controlScheme);
+  if (registersWritten(first, last, REG_PERIOD_FILTER, REG_PERIOD_FILTER)) {
+    setPeriodFilter(periodFilterEnum(i2cRegisters[REG_PERIOD_FILTER]));
   }
-  else if (currentI2CInstruction == 5) {
-    // Target RPM
-    sendWordWire(targetRPM);
+  if (registersWritten(first, last, REG_DESYNC_CLEAR, REG_DESYNC_CLEAR)) {
+    clearDesyncCounts();
   }
-  else if (currentI2CInstruction == 6) {
-    // Cycles in a rotation
-    Wire.write(cyclesPerRotation);
+  if (registersWritten(first, last, REG_ADVANCE_RPM_H, REG_ADVANCE_VALUE)) {
+    setAdvanceCurvePoint(i2cRegisters[REG_ADVANCE_INDEX], registerWord(REG_ADVANCE_RPM_H), i2cRegisters[REG_ADVANCE_VALUE]);
   }
-  else if (currentI2CInstruction == 7) {
-    // Cycles in a rotation
-    Wire.write(motorStatus);
+  if (registersWritten(first, last, REG_TRACE_CONTROL, REG_TRACE_CONTROL)) {
+    if (i2cRegisters[REG_TRACE_CONTROL] == 0) traceStop();
+    else if (i2cRegisters[REG_TRACE_CONTROL] == 1) traceArm();
+    else traceTrigger();
   }
+  if (registersWritten(first, last, REG_ISR_PROFILE_CLEAR, REG_ISR_PROFILE_CLEAR)) {
+    resetISRProfiles();
+  }
+  if (registersWritten(first, last, REG_RAMP_UP, REG_RAMP_DOWN)) {
+    setDutyRamp(i2cRegisters[REG_RAMP_UP], i2cRegisters[REG_RAMP_DOWN]);
+  }
+  if (registersWritten(first, last, REG_GAIN_P_H, REG_GAIN_I_L)) {
+    setRPMGains(registerWord(REG_GAIN_P_H), registerWord(REG_GAIN_I_H));
+  }
+
+  bool enableWritten = registersWritten(first, last, REG_MOTOR_ENABLE, REG_MOTOR_ENABLE);
+  if (enableWritten && (i2cRegisters[REG_MOTOR_ENABLE] == 0)) {
+    disableMotor();
+  }
+  else if (registersWritten(first, last, REG_DUTY, REG_DUTY)) {
+    // Starts the motor if it is off, otherwise just a new duty
+    if (motorStatus) setPWMDuty(i2cRegisters[REG_DUTY]);
+    else enableMotor(i2cRegisters[REG_DUTY]);
+  }
+  else if (registersWritten(first, last, REG_DUTY_IMMEDIATE, REG_DUTY_IMMEDIATE)) {
+    if (motorStatus) setPWMDuty(i2cRegisters[REG_DUTY_IMMEDIATE], true);
+    else enableMotor(i2cRegisters[REG_DUTY_IMMEDIATE]);
+  }
+  else if (enableWritten && (motorStatus == false)) {
+    enableMotor(minDuty + 1); // Set motor to minimum
+  }
+
+  if (registersWhole(first, last, REG_BLINK_PERIOD_H, REG_BLINK_COUNT_L)) {
+    unsigned int blinkPeriod = registerWord(REG_BLINK_PERIOD_H);
+    unsigned int blinkCount = registerWord(REG_BLINK_COUNT_H);
+
+#ifdef UART_COMMS_DEBUG
+    Serial.printf("Blinking LED for %d ms, %d times.\n", blinkPeriod, blinkCount);
+#endif
+
+    setNonBlockingBlink(blinkPeriod, blinkCount);
+  }
+  if (registersWhole(first, last, REG_BUZZ_PERIOD_H, REG_BUZZ_DURATION_L)) {
+    unsigned int buzzPeriod = registerWord(REG_BUZZ_PERIOD_H);
+    unsigned int buzzDuration = registerWord(REG_BUZZ_DURATION_H);
+
+#ifdef UART_COMMS_DEBUG    
+    Serial.printf("Buzzing with period of %d us for %d ms.\n", buzzPeriod, buzzDuration);
+#endif
+
+    queueTone(buzzPeriod, buzzDuration);
+  }
+}
+
+bool registersWritten(byte first, byte last, byte low, byte high) {
+  // True if any register from low to high was in the range written
+  return (first <= high) && (last >= low);
 }
 
-void sendWordWire(word dataValue) {
-  // Writes a word to wire interface
-  // High byte first
-  byte part1 = dataValue % 256;
-  byte part2 = dataValue / 256;
-  Wire.write(part2);
-  Wire.write(part1);
+bool registersWhole(byte first, byte last, byte low, byte high) {
+  // True if every register from low to high was in the range written
+  return (first <= low) && (last >= high);
 }
 
-word readWordWire() {
-  byte part1 = Wire.read();
-  byte part2 = Wire.read();
-  word dataRecieved;
-  dataRecieved = part1 * 256;
-  dataRecieved += part2;
-  return (dataRecieved);
-}
\ No newline at end of file
+word registerWord(byte high) {
+  // Words are stored high byte first
+  return (i2cRegisters[high] << 8) | i2cRegisters[high + 1];
+}
+
+void setRegisterWord(byte high, word value) {
+  // Both bytes at once so a read can't get half an old value
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    i2cRegisters[high] = value >> 8;
+    i2cRegisters[high + 1] = value & 0xFF;
+  }
+}
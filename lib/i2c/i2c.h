@@ -3,8 +3,120 @@
 
 #include <Arduino.h>
 
+/* I2C register map
+
+  The first byte of a write sets the register address, any bytes after it are written to
+  consecutive registers (auto-increment). A read returns the registers from the last set
+  address onwards, so a read from 0 gets the whole telemetry block in one transaction.
+  Words are sent high byte first. Writes to read only registers are ignored, as are
+  values a register can't take (e.g. an unknown control scheme).
+
+  Writes are queued by the TWI interrupt and applied in loop() by i2cCommands(), reads
+  are served from an image of the registers that i2cCommands() keeps up to date. The
+  image is refreshed straight after a write and otherwise every 10 ms, so telemetry can
+  be up to that old.
+*/
+enum i2cRegisterEnum: byte {
+  // Telemetry block (read only unless noted)
+  REG_STATUS = 0x00,          // Bits 0-2: spin up state, bit 3: reverse, bit 4: motor enabled
+  REG_DUTY = 0x01,            // Read/write. Writing starts the motor at that duty if disabled
+  REG_RPM_H = 0x02,
+  REG_RPM_L = 0x03,
+  REG_CONTROL_SCHEME = 0x04,  // Read/write. 0 for PWM (duty), 1 for RPM (governor)
+  REG_ERROR_FLAGS = 0x05,     // Bit n set if any desyncs of cause n were counted
+  REG_TARGET_RPM_H = 0x06,    // Read/write
+  REG_TARGET_RPM_L = 0x07,
+
+  // Settings
+  REG_CYCLES_PER_ROTATION = 0x08,
+  REG_TIMING_ADVANCE = 0x09,  // Quarter degrees, writing sets a fixed advance
+  REG_PERIOD_FILTER = 0x0A,
+  REG_MOTOR_ENABLE = 0x0B,    // Non-zero enables the motor at minimum duty, zero disables it
+
+  // Desyncs
+  REG_DESYNC_INTERVAL_H = 0x0C, // Desync counts by cause, read only
+  REG_DESYNC_INTERVAL_L = 0x0D,
+  REG_DESYNC_TIMEOUT_H = 0x0E,
+  REG_DESYNC_TIMEOUT_L = 0x0F,
+  REG_DESYNC_MISSED_H = 0x10,
+  REG_DESYNC_MISSED_L = 0x11,
+  REG_DESYNC_CLEAR = 0x12,      // Any write clears the desync counts
+
+  // Timing advance curve
+  REG_ADVANCE_INDEX = 0x13,     // Selects the point the next two registers refer to
+  REG_ADVANCE_RPM_H = 0x14,     // Writing the RPM and/or advance sets the point
+  REG_ADVANCE_RPM_L = 0x15,
+  REG_ADVANCE_VALUE = 0x16,
+
+  // Actions, applied once all their bytes are written in a transaction
+  REG_BLINK_PERIOD_H = 0x17,    // Blink the LED, period in ms and number of blinks
+  REG_BLINK_PERIOD_L = 0x18,
+  REG_BLINK_COUNT_H = 0x19,
+  REG_BLINK_COUNT_L = 0x1A,
+  REG_BUZZ_PERIOD_H = 0x1B,     // Buzz, period in us and duration in ms
+  REG_BUZZ_PERIOD_L = 0x1C,
+  REG_BUZZ_DURATION_H = 0x1D,
+  REG_BUZZ_DURATION_L = 0x1E,
+  REG_KILL = 0x1F,              // Writing i2cKillKey disables the motor and traps the ESC until reset
+
+  // Commutation trace
+  REG_TRACE_CONTROL = 0x20,     // Reads the trace state. Write 0 to stop, 1 to arm, 2 to trigger
+  REG_TRACE_COUNT = 0x21,       // Entries recorded, read only
+
+  // Interrupt profiling (only with PROFILE_ISRS)
+  REG_ISR_PROFILE_CLEAR = 0x22, // Any write clears the statistics
+
+  // Duty ramp
+  REG_RAMP_UP = 0x23,           // Most the duty rises each millisecond while running, 0 for no limit
+  REG_RAMP_DOWN = 0x24,         // Most the duty falls each millisecond while running, 0 for no limit
+  REG_DUTY_IMMEDIATE = 0x25,    // Writing sets the duty like REG_DUTY but skips the ramp (e.g. to cut throttle). Reads 0
+
+  // RPM governor
+  REG_GAIN_P_H = 0x26,          // Proportional gain (Q16 duty counts per RPM of error)
+  REG_GAIN_P_L = 0x27,
+  REG_GAIN_I_H = 0x28,          // Integral gain (Q16 duty counts per RPM of error, per electrical cycle)
+  REG_GAIN_I_L = 0x29,
+
+  I2C_REGISTER_COUNT
+};
+
+/* Trace dump
+
+  Reads starting from i2cTracePage + n return page n of the trace, i2cTracePageSize bytes
+  of raw entries (oldest first, see trace.h) with nothing after the end of the trace. The
+  whole trace is read out with a page at a time, so stop it or wait for it to be done first.
+
+  Pages (these and the interrupt statistics) are prepared by i2cCommands() once their
+  address is written, a read before then returns nothing. So leave a couple of
+  milliseconds between writing a page's address and reading it, rather than reading
+  straight after with a repeated start.
+*/
+const byte i2cTracePage = 0x40;
+const byte i2cTracePageSize = 32; // Wire buffer size
+
+// Reads starting from i2cISRPage + n return the statistics of interrupt n (see isrProfileRead())
+const byte i2cISRPage = 0x60;
+
+const byte i2cKillKey = 0x4B; // Needed to kill, so a runaway burst write can't do it by accident
+
+/* Broadcast throttle
+
+  Sent to the general call address (0) so every ESC gets it in one transaction:
+  i2cBroadcastThrottle, flags, then a throttle word (high byte first) for slot 0, 1, ... 7.
+  Each ESC latches the word for its slot (the offset set by its soldering pads), the
+  throttle is a duty or target RPM depending on its control scheme. Latched throttles
+  are only used once a frame with i2cBroadcastApply_bm set arrives, either the same
+  frame or a later one with just the command and flags, so all ESCs change together.
+  Other general calls are ignored, and a write to the ESC's own address is always a
+  register write whatever its first byte.
+*/
+const byte i2cBroadcastThrottle = 0xB0;   // Command byte for a broadcast throttle frame
+const byte i2cBroadcastApply_bm = 0x01;   // Flag to apply the latched throttle
+
 extern byte i2cAddress; // I2C address. Starts with a default, then adds offset according to soldering pads
-extern byte currentI2CInstruction; // Current instruction recieved by ESC from controller
+extern byte i2cSlot;    // Offset set by the soldering pads, picks this ESC's throttle in broadcasts
+extern volatile byte i2cRegisterAddress; // Register the next read or write starts at
+extern volatile byte i2cDroppedFrames;   // Writes lost because the queue was full
 
 /** @name i2cSetup
    *  @brief Sets up I2C interface
@@ -12,26 +124,30 @@ extern byte currentI2CInstruction; // Current instruction recieved by ESC from c
 void i2cSetup(); // Initialize the device's I2C interface
 
 /** @name i2cRecieve
-   *  @brief Handles data recieved over I2C
+   *  @brief Handles data recieved over I2C. Sets the register address and queues any register writes for i2cCommands().
    *  @param howMany Number of bytes recieved over I2C to handle
    */
 void i2cRecieve(int howMany);
 
-/** @name i2cRequest
-   *  @brief Function to handle I2C requests
+/** @name i2cCommands
+   *  @brief Applies queued register writes and refreshes the register image and page for reads
+   *  @note Should be called every pass of the main control loop
    */
-void i2cRequest();
+void i2cCommands();
 
-/** @name sendWordWire
-   *  @brief Sends a word over I2C
-   *  @param dataValue Word to send over I2C
+/** @name i2cRequest
+   *  @brief Function to handle I2C requests, sends the registers from the current register address onwards,
+   *  or the prepared page. Only copies bytes out, everything is worked out beforehand by i2cCommands().
    */
-void sendWordWire(word dataValue);
+void i2cRequest();
 
-/** @name readWordWire
-   *  @brief Read a word from I2C
-   *  @return Returns a word recieved over word
+#ifdef BENCHMARK
+/** @name benchmarkRecieve
+   *  @brief Queues a register write held in RAM the same way i2cRecieve() does from the Wire buffer. Only for timing it (see benchmark.h).
+   *  @param data Register address then the bytes to write
+   *  @param length Number of bytes in data
    */
-word readWordWire();
+void benchmarkRecieve(const byte *data, byte length);
+#endif
 
-#endif
\ No newline at end of file
+#endif
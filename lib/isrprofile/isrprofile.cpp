@@ -0,0 +1,111 @@
+#include "isrprofile.h"
+#include <util/atomic.h>
+
+#ifdef PROFILE_ISRS
+isrStats isrProfiles[isrProfileCount];
+volatile byte isrTimerResets = 0;
+volatile uint16_t isrCommutationDue = 0;
+volatile byte isrCommutationResets = 0;
+
+isrProfileScope::isrProfileScope(isrProfileEnum id, uint16_t entryLatency) {
+  start = TCB0.CNT;
+  resets = isrTimerResets;
+  profile = id;
+  latency = entryLatency;
+}
+
+isrProfileScope::~isrProfileScope() {
+  uint16_t end = TCB0.CNT;
+
+  // Capture flag is cleared by the crossing interrupt, so if set TCB0 may have been reset unseen
+  if ((resets != isrTimerResets) || (TCB0.INTFLAGS & TCB_CAPT_bm)) return;
+
+  uint16_t runTime = end - start;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    isrStats &stats = isrProfiles[profile];
+
+    if (stats.count < 0xFFFF) {
+      if ((stats.count == 0) || (runTime < stats.minTime)) stats.minTime = runTime;
+      if (runTime > stats.maxTime) stats.maxTime = runTime;
+      stats.totalTime += runTime;
+      stats.count++;
+    }
+
+    if ((latency != isrNoLatency) && (stats.latencyCount < 0xFFFF)) {
+      if ((stats.latencyCount == 0) || (latency < stats.minLatency)) stats.minLatency = latency;
+      if (latency > stats.maxLatency) stats.maxLatency = latency;
+      stats.totalLatency += latency;
+      stats.latencyCount++;
+
+      // Bins double in width from 1 us (10 counts)
+      byte bin = 0;
+      uint16_t binTop = 10;
+      while ((bin < (isrLatencyBins - 1)) && (latency >= binTop)) {
+        bin++;
+        binTop <<= 1;
+      }
+      stats.latencyBins[bin]++;
+    }
+  }
+}
+#endif
+
+void resetISRProfiles() {
+#ifdef PROFILE_ISRS
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    memset(isrProfiles, 0, sizeof(isrProfiles));
+  }
+#endif
+}
+
+byte isrProfileRead(isrProfileEnum id, byte *dest) {
+#ifdef PROFILE_ISRS
+  if (id >= isrProfileCount) return 0;
+
+  isrStats stats;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    stats = isrProfiles[id];
+  }
+
+  uint16_t words[isrProfilePageSize / 2] = {
+    stats.count, stats.minTime, stats.maxTime, uint16_t(stats.count ? (stats.totalTime / stats.count) : 0),
+    stats.latencyCount, stats.minLatency, stats.maxLatency, uint16_t(stats.latencyCount ? (stats.totalLatency / stats.latencyCount) : 0)
+  };
+  for (byte i = 0; i < isrLatencyBins; i++) words[8 + i] = stats.latencyBins[i];
+
+  for (byte i = 0; i < (isrProfilePageSize / 2); i++) {
+    dest[2 * i] = words[i] >> 8;
+    dest[2 * i + 1] = words[i] & 0xFF;
+  }
+  return isrProfilePageSize;
+#else
+  (void)id;
+  (void)dest;
+  return 0;
+#endif
+}
+
+void printISRProfiles() {
+#ifdef PROFILE_ISRS
+  const char *names[isrProfileCount] = {"Crossing", "Commutation", "Input", "TWI"};
+
+  for (byte i = 0; i < isrProfileCount; i++) {
+    byte page[isrProfilePageSize];
+    isrProfileRead(isrProfileEnum(i), page);
+
+    uint16_t words[isrProfilePageSize / 2];
+    for (byte j = 0; j < (isrProfilePageSize / 2); j++) words[j] = (page[2 * j] << 8) | page[2 * j + 1];
+
+    // Times in 0.1 us
+    Serial.printf("%s - runs: %u, time min/max/mean: %u/%u/%u", names[i], words[0], words[1], words[2], words[3]);
+    if (words[4] != 0) {
+      Serial.printf(", latency min/max/mean: %u/%u/%u, bins:", words[5], words[6], words[7]);
+      for (byte j = 0; j < isrLatencyBins; j++) Serial.printf(" %u", words[8 + j]);
+    }
+    Serial.println();
+  }
+#else
+  Serial.println("Interrupt profiling not enabled.");
+#endif
+}
@@ -0,0 +1,102 @@
+#ifndef ESC_ISRPROFILE_HEADER
+#define ESC_ISRPROFILE_HEADER
+
+//#define PROFILE_ISRS  // Time the interrupts? Costs a couple of microseconds per interrupt
+
+#include <Arduino.h>
+
+/* Interrupt profiling
+
+  Times how long each interrupt takes to run, and for the motor interrupts how long after
+  their event they started (entry latency), so the headroom of a build can be measured.
+
+  TCB0 is used as the clock (0.1 us counts) since it always runs, and while the motor is
+  running it is reset by each zero crossing. That makes the crossing interrupt's latency
+  simply TCB0's count on entry, and the commutation interrupt's latency its count past
+  when the commutation was due. No hardware timestamp exists for the input (TCD0) and TWI
+  events so only their run time is kept. The TWI is timed around the Wire handlers, the
+  library's own interrupt code around them isn't included.
+
+  A sample is thrown away if TCB0's count was changed part way through (by a crossing or
+  the crossing interrupt rewriting it), including any rejected (debounced) crossing. Counts
+  stop once they reach their maximum.
+*/
+
+enum isrProfileEnum: byte {ISR_CROSSING = 0, ISR_COMMUTATION = 1, ISR_INPUT = 2, ISR_TWI = 3};
+const byte isrProfileCount = 4;
+
+const uint16_t isrNoLatency = 0xFFFF;   // Latency unknown
+const byte isrLatencyBins = 8;          // Under 1 us, 2 us, 4 us, ... 64 us, then the rest
+const byte isrProfilePageSize = 32;     // Bytes from isrProfileRead()
+
+struct isrStats {
+  uint16_t count;         // Samples of run time
+  uint16_t minTime;       // Run times in 0.1 us
+  uint16_t maxTime;
+  uint32_t totalTime;
+  uint16_t latencyCount;  // Samples of latency
+  uint16_t minLatency;    // Latencies in 0.1 us
+  uint16_t maxLatency;
+  uint32_t totalLatency;
+  uint16_t latencyBins[isrLatencyBins];
+};
+
+#ifdef PROFILE_ISRS
+extern isrStats isrProfiles[isrProfileCount];
+extern volatile byte isrTimerResets;          // Times TCB0's count was reset or rewritten
+extern volatile uint16_t isrCommutationDue;   // TCB0 count the next commutation is due at
+extern volatile byte isrCommutationResets;    // isrTimerResets when it was scheduled
+
+/** @name isrCommutationScheduled
+   *  @brief Notes when the commutation just scheduled is due, for its latency
+   *  @param delay Commutation delay in TCB0 counts from now, must fit in TCB1
+   */
+inline void isrCommutationScheduled(uint16_t delay) {
+  isrCommutationDue = TCB0.CNT + delay;
+  isrCommutationResets = isrTimerResets;
+}
+
+/** @name isrCommutationLatency
+   *  @brief Time since the commutation was due, for use at the start of the commutation interrupt
+   *  @return Latency in TCB0 counts, isrNoLatency if TCB0 was changed since it was scheduled
+   */
+inline uint16_t isrCommutationLatency() {
+  if (isrCommutationResets != isrTimerResets) return isrNoLatency;
+  return TCB0.CNT - isrCommutationDue;
+}
+
+/* Times an interrupt from when it is made until it goes out of scope, so it only
+  needs to be made at the top of the interrupt (or handler) to cover every return */
+class isrProfileScope {
+public:
+  isrProfileScope(isrProfileEnum id, uint16_t latency = isrNoLatency);
+  ~isrProfileScope();
+
+private:
+  isrProfileEnum profile;
+  uint16_t latency;
+  uint16_t start;
+  byte resets;
+};
+#endif
+
+/** @name resetISRProfiles
+   *  @brief Clears all the interrupt statistics
+   */
+void resetISRProfiles();
+
+/** @name isrProfileRead
+   *  @brief Gets the statistics of an interrupt in the form sent over I2C
+   *  @param id Interrupt to read
+   *  @param dest Where to put the isrProfilePageSize bytes. Words high byte first: run time 
+   *  count, min, max, mean, then latency count, min, max, mean, then the latency bins.
+   *  @return Bytes written, zero if profiling is not enabled
+   */
+byte isrProfileRead(isrProfileEnum id, byte *dest);
+
+/** @name printISRProfiles
+   *  @brief Prints the statistics of all the interrupts over UART
+   */
+void printISRProfiles();
+
+#endif
@@ -1,8 +1,9 @@
 #include "led.h"
+#include "clock.h"
 
 const byte LEDpin = PIN_PB6; // LED pin number, primarily used for testing
 
-unsigned long nonBlockToggleTime = 0;
+unsigned long nonBlockLastToggle = 0; // clockMillis() of the last toggle
 unsigned int nonBlockTogglePeriod = 0;
 unsigned int nonBlockTogglesLeft = 0;
 
@@ -63,11 +64,11 @@ void nonBlockingLEDBlink() {
   // Check if we are even blinking
   if (nonBlockTogglesLeft > 0) {
 
-    // See if we have passed a point to blink
-    if (nonBlockToggleTime < millis()) {
+    // See if we have passed a point to blink (as a difference so it works when the clock wraps)
+    if ((clockMillis() - nonBlockLastToggle) > nonBlockTogglePeriod) {
 
       LEDToggle();
-      nonBlockToggleTime = millis() + nonBlockTogglePeriod;
+      nonBlockLastToggle = clockMillis();
       nonBlockTogglesLeft--;
 
       if (nonBlockTogglesLeft == 0) LEDOn(); // Turn on LED at finish
@@ -81,5 +82,5 @@ void setNonBlockingBlink (unsigned int period, unsigned int count) {
   nonBlockTogglesLeft = (count * 2) - 1; // Two toggles per count, exclude staring one
   nonBlockTogglePeriod = period;
 
-  nonBlockToggleTime = millis() + period; // Record next toggle time
+  nonBlockLastToggle = clockMillis(); // Record when it was turned off
 }
\ No newline at end of file
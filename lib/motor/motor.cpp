@@ -1,20 +1,132 @@
 #include "motor.h"
+#include <util/atomic.h>
 #include "led.h"
+#include "trace.h"
+#include "eventlog.h"
+#include "isrprofile.h"
 #include "uartcomms.h"
+#include "tones.h"
+#include "clock.h"
 
-typedef void(*voidFunctionPointer)(); // Used for making commutation arrays
+/* Phase map
+
+  What each phase needs written to drive it high (PWM override enable in TCA0), drive it 
+  low (pin on PORTB) and to watch its BEMF with AC1.
+
+  NOTE: The high sides should never be set to HIGH.
+
+  They should always be LOW or overriden by PWM so the state doesn't matter.
+  I use this assumption to simplify this code, by using OUTSET or OUTCLR to adjust 
+  the lows but leave the highs to be enabled by the PWM override when needed.
+
+  This could prove to be an optimization in the future to put all the highs
+  on one PORT (probably PORTB) and leave the lows on the other (PORTC) so
+  they can be manipulated with simpler code. 
+  
+  This will need a hardware revision.
+*/
+struct phasePins {
+  byte highPWM;   // TCA0.SPLIT.CTRLB value to PWM the high side
+  byte lowPin;    // PORTB pin for the low side
+  byte bemfMux;   // AC1.MUXCTRLA value to compare this phase to the neutral point
+};
+
+constexpr phasePins phaseA = {TCA_SPLIT_HCMP2EN_bm, PIN5_bm, AC_MUXPOS_PIN1_gc | AC_MUXNEG_PIN1_gc};
+constexpr phasePins phaseB = {TCA_SPLIT_HCMP0EN_bm, PIN1_bm, AC_MUXPOS_PIN0_gc | AC_MUXNEG_PIN1_gc};
+constexpr phasePins phaseC = {TCA_SPLIT_HCMP1EN_bm, PIN0_bm, AC_MUXPOS_PIN3_gc | AC_MUXNEG_PIN1_gc};
+
+const byte lowSideMask = PIN0_bm | PIN1_bm | PIN5_bm; // All the low side pins on PORTB
+
+/* Commutation tables
+
+  Each step stores the register values needed so commutating is just a few indexed 
+  stores rather than a function call. They are built at compile time from the phase 
+  map, and being const they stay in flash (which is memory mapped on this chip).
+
+  Since the timers are always looking for rising edges the comparison result is 
+  inverted when we are watching for falling BEMF.
+*/
+struct commutationStep {
+  byte highPWM;   // TCA0.SPLIT.CTRLB
+  byte lowPin;    // PORTB.OUTSET, after clearing lowSideMask
+  byte bemfMux;   // AC1.MUXCTRLA
+};
+
+constexpr commutationStep makeStep(const phasePins &high, const phasePins &low, const phasePins &floating, bool rising) {
+  return {high.highPWM, low.lowPin, byte(floating.bemfMux | (rising ? 0 : AC_INVERT_bm))};
+}
+
+// AH_BL, AH_CL, BH_CL, BH_AL, CH_AL, CH_BL
+const commutationStep forwardSteps[6] = {
+  makeStep(phaseA, phaseB, phaseC, false),
+  makeStep(phaseA, phaseC, phaseB, true),
+  makeStep(phaseB, phaseC, phaseA, false),
+  makeStep(phaseB, phaseA, phaseC, true),
+  makeStep(phaseC, phaseA, phaseB, false),
+  makeStep(phaseC, phaseB, phaseA, true)
+};
+
+// AH_BL, CH_BL, CH_AL, BH_AL, BH_CL, AH_CL
+const commutationStep reverseSteps[6] = {
+  makeStep(phaseA, phaseB, phaseC, true),
+  makeStep(phaseC, phaseB, phaseA, false),
+  makeStep(phaseC, phaseA, phaseB, true),
+  makeStep(phaseB, phaseA, phaseC, false),
+  makeStep(phaseB, phaseC, phaseA, true),
+  makeStep(phaseA, phaseC, phaseB, false)
+};
 
 volatile byte sequenceStep = 0; // Stores step in spinning sequence
-volatile voidFunctionPointer motorSteps[6]; // Stores the functions to copmmute in the current commutation order
-volatile voidFunctionPointer bemfSteps[6]; // Stores the functions to set the BEMF in the current commutation order
+
+/* Direction
+
+  The direction only changes while stopped, so rather than the interrupts checking 
+  "reverse" each step, setDirection() copies that direction's table into "steps" and 
+  the commutation code always indexes it. Its address is known at compile time and 
+  reading it from RAM is a cycle quicker than from flash.
+*/
+commutationStep steps[6]; // Table for the direction in use
+
+// Drive the phases for a step
+inline void commutate(byte step) {
+  const commutationStep &current = steps[step];
+
+  // Set up PWM pin(s) for high side
+  TCA0.SPLIT.CTRLB = current.highPWM;
+
+  // Set pin for low side and leave others cleared
+  PORTB.OUTCLR = lowSideMask;
+  PORTB.OUTSET = current.lowPin;
+}
+
+// Set AC to watch the floating phase of a step
+inline void setBEMF(byte step) {
+  AC1.MUXCTRLA = steps[step].bemfMux;
+}
 
 // PWM variables
 const byte maxDuty = 249; // MUST be less than 256
 volatile byte duty = 100;
 const byte minDuty = maxDuty * 0.05;     // Stores minimum allowed duty
+const byte bemfBlanking = 20;            // Time after the high sides switch on before the BEMF is sampled, 20 TCA counts (50 ns each) = 1 us
+
+// Duty ramp, limits in duty counts per millisecond (0 for no limit)
+volatile byte dutyRampUp = 2;     // 10% to full in about 100ms
+volatile byte dutyRampDown = 4;
+volatile byte dutyTarget = 0;     // Duty the ramp is heading for
 
 // Other variables
 volatile byte cyclesPerRotation = 2;
+uint32_t rpmNumerator = 25000000UL; // Divided by a half step period (0.1us ticks) to get RPM, depends on cyclesPerRotation
+volatile uint32_t lastHalfStep = 0;  // Last valid half step period measured (filtered), 0 if there isn't one (stopped)
+
+// Period filter, keeps the last 12 half step periods with running sums of the last 6 and 12
+volatile periodFilterEnum periodFilter = periodFilterEnum::AVERAGE6;
+const byte periodHistoryLength = 12;
+uint32_t periodHistory[periodHistoryLength]; // Half step periods, oldest at periodIndex
+byte periodIndex = 0;                        // Where the next period goes
+uint32_t periodSum6 = 0;                     // Sum of the newest 6 periods
+uint32_t periodSum12 = 0;                    // Sum of all 12 periods
 
 // Control scheme
 volatile ctrlSchemeEnum controlScheme = ctrlSchemeEnum::PWM;
@@ -22,6 +134,24 @@ volatile ctrlSchemeEnum controlScheme = ctrlSchemeEnum::PWM;
 // RPM variables
 volatile unsigned int targetRPM = 0;
 
+// RPM governor (closed loop speed control)
+volatile uint16_t rpmGainP = 200;   // Proportional gain (Q16 duty counts per RPM of error)
+volatile uint16_t rpmGainI = 60;    // Integral gain (Q16 duty counts per RPM of error, per electrical cycle)
+int32_t rpmIntegral = 0;            // Integrated duty (Q16)
+bool governorPrimed = false;        // Set once the integral is seeded with the duty in use
+volatile uint32_t halfCycleCount = 0; // Sum of the half step periods over the current electrical cycle
+bool halfCycleWhole = false;        // Set once halfCycleCount started at the start of a cycle, the first after (re)starting is partial
+const int32_t maxRPMError = 32000;  // Error is clamped to this so the gain products and their sums fit in 32 bits
+
+// Timing advance, an RPM indexed curve interpolated once per electrical cycle
+const byte maxTimingAdvance = 120;          // 30 degrees (in quarter degrees)
+const byte advanceCurvePoints = 4;          // Number of points on the advance curve
+uint16_t advanceCurveRPM[advanceCurvePoints] = {0, 5000, 10000, 20000}; // RPM of each point (ascending)
+byte advanceCurve[advanceCurvePoints] = {0, 0, 0, 0};                   // Advance at each point (quarter degrees)
+bool advanceCurveFlat = true;               // All points have the same advance, so no need to interpolate
+volatile byte timingAdvance = 0;            // Advance currently applied (quarter degrees)
+volatile byte advanceFraction = 0;          // Advance currently applied as a fraction of 30 degrees (Q8)
+
 // Other motor configuration
 volatile bool reverse = false;
 volatile bool motorStatus = false; // Stores if the motor is disabled (false) or not
@@ -34,36 +164,49 @@ const unsigned int spinUpPeriodDecrement = 10;  // How much the period is decrem
 const int stepsNeeded = (spinUpStartPeriod - spinUpEndPeriod) / spinUpPeriodDecrement; // Spin up period steps
 
 const byte spinUpMaxDuty = maxDuty * 0.3;         // The PWM reached at the end of spin up
-const float spinUpPWMIncrement = float(spinUpMaxDuty - minDuty) / float(stepsNeeded); // How much PWM is raised with each spin up cycle
-
-// Buzzer period limits
-const unsigned int maxBuzzPeriod = 2000;
-const unsigned int minBuzzPeriod = 200;
-
-// Variables for buzzes summoned in interrupts (not globally scoped)
-volatile unsigned int interruptBuzzPeriod = 0;
-volatile unsigned int interruptBuzzDuration = 0;
+const uint16_t spinUpPWMIncrement = (uint16_t(spinUpMaxDuty - minDuty) << 8) / stepsNeeded; // How much PWM is raised with each spin up cycle (Q8)
+
+const unsigned int spinUpAlignPeriod = 50000;   // TCB1 period while aligning the rotor (5ms)
+const byte spinUpAlignCount = 20;               // Number of align periods to hold the first step (100ms)
+const byte recoveryAlignCount = 4;              // Number of align periods when recovering from a desync (20ms)
+const byte spinUpLockSteps = 12;                // Consecutive steps with a zero crossing needed to hand over to BEMF (two cycles)
+const byte spinUpMaxAttempts = 3;               // Times to try spinning up before giving up
+
+volatile spinUpStateEnum spinUpState = spinUpStateEnum::STOPPED;
+volatile byte spinUpTargetDuty = 0;   // Duty to use once spun up
+unsigned int spinUpPeriod = 0;        // Current step period in the ramp (TCB ticks)
+byte spinUpCounter = 0;               // Align periods left, or steps spent at the current ramp period
+int spinUpStep = 0;                   // Number of times the ramp period has been decremented
+byte spinUpValidSteps = 0;            // Consecutive ramp steps that had a zero crossing
+bool spinUpCrossingSeen = false;      // Set once a zero crossing is seen in the current ramp step
+byte spinUpAttempt = 0;               // Attempts made on the current spin up
+
+// Desync detection
+volatile unsigned int desyncCounts[desyncCauseCount]; // Number of desyncs detected of each cause
+byte badIntervals = 0;                    // Consecutive steps with an interval far from the last
+bool stepCommutated = false;              // Set once the current step is commutated, cleared by the next crossing
+const byte desyncIntervalLimit = 3;       // Consecutive bad intervals to call it a desync
+const unsigned long desyncMinTimeout = 5000; // Shortest time without a crossing to call it a desync (microseconds)
 
 // Commutation variables used to extend the possible step duration
-volatile unsigned int countAtCommutation; // Variable used to store TCB0 count when commutated (used to predict rollover)
+unsigned long lastCrossingMicros = 0;   // clockMicros() at the last valid zero crossing, used to count TCB0 rollovers
+uint32_t lastCommutationDelay = 0;      // Delay from the last zero crossing to its commutation (TCB ticks)
+uint32_t commutationDelayLeft = 0;      // Delay still to wait when it is too long for TCB1 in one go
+bool commutationExtended = false;       // Set while TCB1 is waiting out a long delay in chunks
 const unsigned int timerDebounce = 500; 
 
 // Function Prototypes
-void AHBL();      // Set A high, B low, C floating
-void AHCL();      // Set A high, C low, B floating
-void BHCL();      // Set B high, C low, A floating
-void BHAL();      // Set B high, A low, C floating
-void CHAL();      // Set C high, A low, B floating
-void CHBL();      // Set C high, B low, A floating
-
-// Comparator configuration functions 
-void aRisingBEMF();   // Set AC to interrupt on A rising edge 
-void aFallingBEMF();  // Set AC to interrupt on A falling edge 
-void bRisingBEMF();   // Set AC to interrupt on B rising edge 
-void bFallingBEMF();  // Set AC to interrupt on B falling edge 
-void cRisingBEMF();   // Set AC to interrupt on C rising edge 
-void cFallingBEMF();  // Set AC to interrupt on C falling edge 
-
+void runRPMGovernor(uint32_t rpm); // Adjusts duty to chase target RPM
+void updateTimingAdvance(uint32_t rpm); // Sets the timing advance for a speed from the curve
+void applyTimingAdvance(byte advance);  // Sets the timing advance used for commutation
+void resetPeriodFilter(uint32_t halfStep); // Fills the period filter with a single period
+void outputDuty(byte newDuty);    // Writes the duty to the PWM timer without any checks
+void beginAlignment(byte alignPeriods); // Starts (or restarts) a spin up attempt by aligning the rotor
+void desynced(desyncCauseEnum cause);   // Records a desync and starts recovering from it
+void spinUpTimer();               // Handles TCB1 during spin up
+void spinUpCrossing();            // Handles TCB0 during spin up
+void scheduleCommutation(uint32_t delay); // Sets TCB1 to commutate after a delay from the crossing
+bool extendCommutationDelay();    // Handles TCB1 when waiting out a long delay, returns true if still waiting
 
 
 void setupMotor() {
@@ -72,46 +215,12 @@ void setupMotor() {
   PORTA.DIRCLR = PIN4_bm;
   PORTA.PIN4CTRL = PORT_PULLUPEN_bm; // Set it have a pull up
   delayMicroseconds(100); // Allow outputs to settle before reading
-  reverse = ((PORTA.IN & PIN4_bm) == 0);
-
-  // Setup the commutation steps based on direction
-  if (reverse == false) {
-    // AH_BL, AH_ CL, BH_CL, BH_AL, CH_AL, CH_BL
-    motorSteps[0] = AHBL;
-    motorSteps[1] = AHCL;
-    motorSteps[2] = BHCL;
-    motorSteps[3] = BHAL;
-    motorSteps[4] = CHAL;
-    motorSteps[5] = CHBL;
-
-    bemfSteps[0] = cFallingBEMF;
-    bemfSteps[1] = bRisingBEMF;
-    bemfSteps[2] = aFallingBEMF;
-    bemfSteps[3] = cRisingBEMF;
-    bemfSteps[4] = bFallingBEMF;
-    bemfSteps[5] = aRisingBEMF;
-#ifdef UART_COMMS_DEBUG
-  Serial.println("Motor spinning set for normal direction.");
-#endif
-  }
-  else {
-    motorSteps[0] = AHBL;
-    motorSteps[1] = CHBL;
-    motorSteps[2] = CHAL;
-    motorSteps[3] = BHAL;
-    motorSteps[4] = BHCL;
-    motorSteps[5] = AHCL;
-
-    bemfSteps[0] = cRisingBEMF;
-    bemfSteps[1] = aFallingBEMF;
-    bemfSteps[2] = bRisingBEMF;
-    bemfSteps[3] = cFallingBEMF;
-    bemfSteps[4] = aRisingBEMF;
-    bemfSteps[5] = bFallingBEMF;
+  setDirection((PORTA.IN & PIN4_bm) == 0);
+
 #ifdef UART_COMMS_DEBUG
-  Serial.println("Motor spinning set for reverse direction.");
+  if (reverse == false) Serial.println("Motor spinning set for normal direction.");
+  else Serial.println("Motor spinning set for reverse direction.");
 #endif
-  }
 
   //==============================================
   // Set up output pins
@@ -151,14 +260,39 @@ void setupMotor() {
   TCB0.CTRLB = TCB_CNTMODE_FRQ_gc;
   TCB0.EVCTRL = TCB_CAPTEI_bm | TCB_FILTER_bm; // Enable event capture input, on rising edge
 
-  // Link TCB0 to analog comparator's output
-  EVSYS.ASYNCCH0 = EVSYS_ASYNCCH0_AC1_OUT_gc; // Use comparator as async channel 0 source
-  EVSYS.ASYNCUSER0 = EVSYS_ASYNCUSER0_ASYNCCH0_gc; // Use async channel 0 (AC) as input for TCB0
-
-  // Repeat all that was done for TCB0 for TCB1, except mode
-  TCB1.CTRLA = TCB0.CTRLA; // CLOCK MUST MATCH TCB0!
+  /* PWM synchronised BEMF sampling
+
+    Switching the high side on and off couples noise onto the floating phase, and while 
+    it is off the neutral point sits well away from where the BEMF is measured against. 
+    So rather than the comparator going straight to the timers, it goes through a D latch 
+    made from the CCL's first pair of LUTs that is only open during the PWM on time:
+      - LUT0 (D) passes AC1's output.
+      - LUT1 (G) passes TCA0's WO0. Its pin is never enabled, LCMP0 is only used to set 
+        when the latch opens, bemfBlanking after the high sides switch on (see outputDuty()).
+    The latch holds through the off time, so a crossing gives a single rising edge at its 
+    first sample rather than one every PWM period. Crossings are seen at most a PWM period 
+    (12.5us) late, small next to a step even at top speed (about 250us at 40000 eRPM).
+  */
+  CCL.CTRLA = 0; // Can only be set up while disabled
+  CCL.LUT0CTRLB = CCL_INSEL0_MASK_gc | CCL_INSEL1_AC1_gc;
+  CCL.LUT0CTRLC = CCL_INSEL2_MASK_gc;
+  CCL.TRUTH0 = 0x04; // Output is IN1
+  CCL.LUT1CTRLB = CCL_INSEL0_TCA0_gc | CCL_INSEL1_MASK_gc;
+  CCL.LUT1CTRLC = CCL_INSEL2_MASK_gc;
+  CCL.TRUTH1 = 0x02; // Output is IN0
+  CCL.SEQCTRL0 = CCL_SEQSEL_LATCH_gc; // Sequencer output replaces LUT0's
+  CCL.LUT0CTRLA = CCL_ENABLE_bm;
+  CCL.LUT1CTRLA = CCL_ENABLE_bm;
+  CCL.CTRLA = CCL_ENABLE_bm;
+
+  // Link TCB0 to the sampled comparator output
+  EVSYS.ASYNCCH0 = EVSYS_ASYNCCH0_CCL_LUT0_gc; // Use the latch as async channel 0 source
+  EVSYS.ASYNCUSER0 = EVSYS_ASYNCUSER0_ASYNCCH0_gc; // Use async channel 0 (sampled AC) as input for TCB0
+
+  // Repeat all that was done for TCB0 for TCB1, except mode (set before it is enabled)
   TCB1.CTRLB = TCB_CNTMODE_SINGLE_gc;
   TCB1.EVCTRL = TCB_CAPTEI_bm | TCB_FILTER_bm;
+  TCB1.CTRLA = TCB0.CTRLA; // CLOCK MUST MATCH TCB0!
 
   // Link TCB1 to AC as well
   EVSYS.ASYNCUSER11 = EVSYS_ASYNCUSER11_ASYNCCH0_gc;
@@ -172,85 +306,242 @@ void setupMotor() {
 #endif
 }
 
-void windUpMotor() {
-  // Forces the motor to spin up to a decent speed before running motor normally.
+/* Spin up
 
+  Spinning up is done in the background so nothing is blocked while it happens. TCB1 is 
+  put into periodic interrupt mode to step through it.
+  
+    1. Align - The first step is held at minimum duty to pull the rotor into a known spot.
+    2. Ramp - The motor is commutated open loop, the step period shortening and duty 
+      rising every electrical cycle. AC1 watches the floating phase like it would when 
+      running, and each step is checked for a zero crossing.
+    3. Handover - Once enough consecutive steps have a zero crossing the rotor must be 
+      following, so the next commutation is scheduled from that crossing like normal and 
+      TCB1 goes back to being triggered by the comparator.
+
+  If the ramp ends without the rotor following, the attempt is retried from alignment 
+  a few times before the motor is disabled.
+*/
+void windUpMotor() {
   if (motorStatus == true) return; // Not to be run when already spun up
 
-#ifdef UART_COMMS_DEBUG
-  Serial.print("Motor spin-up starting...");
-#endif
+  logEvent(LOG_SPINUP_START);
 
   // Reset motor to base state
+  stopTones(); // TCB1 is needed for spinning up
   allLow();
-  setPWMDuty(minDuty); // Start with minimum PWM for wind up
-
   LEDOff(); // Used to indicate wind up start
 
-  int period = spinUpStartPeriod;
+  // Enable analog comparator
+  AC1.CTRLA = AC_ENABLE_bm | AC_HYSMODE_50mV_gc; // Enable the AC with hysteresis
 
-  int spinUpStep = 0; 
-  
-  while (period > spinUpEndPeriod) {
+  // Start measuring speed from scratch for the governor
+  lastHalfStep = 0;
+  halfCycleCount = 0;
+  halfCycleWhole = false;
+  governorPrimed = false;
+
+  motorStatus = true;
+  spinUpAttempt = 0;
+  beginAlignment(spinUpAlignCount);
+}
+
+void beginAlignment(byte alignPeriods) {
+  TCB0.INTCTRL = 0; // Ignore the comparator until ramping
+  TCB1.INTCTRL = 0;
+
+  spinUpState = spinUpStateEnum::ALIGNING;
+  spinUpCounter = alignPeriods;
+
+  sequenceStep = 0;
+  outputDuty(minDuty);
+  commutate(sequenceStep);
 
-    for (byte i = 0; i < stepsPerIncrement; i++) {
-      motorSteps[sequenceStep]();
-      delayMicroseconds(period);
+  // Use TCB1 as a periodic timer, ignoring comparator events
+  setTCB1Mode(TCB_CNTMODE_INT_gc);
+  TCB1.EVCTRL = 0;
+  TCB1.CCMP = spinUpAlignPeriod;
+  TCB1.CNT = 0;
+  TCB1.INTFLAGS = TCB_CAPT_bm;
+  TCB1.INTCTRL = TCB_CAPT_bm;
+}
 
-      sequenceStep++;
-      sequenceStep %= 6;
+void spinUpTimer() {
+  if (spinUpState == spinUpStateEnum::ALIGNING) {
+    if (--spinUpCounter > 0) return;
+
+    // Aligned, start ramping
+    spinUpState = spinUpStateEnum::RAMPING;
+    spinUpPeriod = spinUpStartPeriod * 10; // Timer counts in 0.1us
+    spinUpCounter = 0;
+    spinUpStep = 0;
+    spinUpValidSteps = 0;
+    spinUpCrossingSeen = false;
+    TCB1.CCMP = spinUpPeriod;
+
+    TCB0.CNT = 0;
+    TCB0.INTCTRL = TCB_CAPT_bm;
+  }
+  else if (spinUpState == spinUpStateEnum::RAMPING) {
+    // Check the step just finished for a zero crossing
+    if (spinUpCrossingSeen) spinUpValidSteps++;
+    else spinUpValidSteps = 0;
+    spinUpCrossingSeen = false;
+
+    spinUpCounter++;
+    if (spinUpCounter >= stepsPerIncrement) {
+      spinUpCounter = 0;
+
+      if (spinUpPeriod <= (spinUpEndPeriod * 10)) {
+        // Ramp finished without the rotor following, try again
+        spinUpAttempt++;
+
+        logEvent(LOG_SPINUP_FAILED, spinUpAttempt);
+
+        if (spinUpAttempt >= spinUpMaxAttempts) {
+          traceTrigger(0);
+          disableMotor();
+          playMelody(MELODY_ERROR);
+        }
+        else beginAlignment(spinUpAlignCount);
+        return;
+      }
+
+      spinUpPeriod -= spinUpPeriodDecrement * 10;
+      TCB1.CCMP = spinUpPeriod;
+
+      // Raise PWM with rotational speed of motor
+      spinUpStep++;
+      outputDuty(minDuty + ((spinUpStep * spinUpPWMIncrement) >> 8));
     }
-    period -= spinUpPeriodDecrement;
+  }
+  else if (spinUpState == spinUpStateEnum::HANDOVER) {
+    // First commutation from BEMF, then leave TCB1 to the comparator
+    commutate(sequenceStep);
+    stepCommutated = true;
+    badIntervals = 0;
+
+    setTCB1Mode(TCB_CNTMODE_SINGLE_gc);
+    TCB1.EVCTRL = TCB_CAPTEI_bm | TCB_FILTER_bm;
+    TCB1.CCMP = 65535; // Set to max
+
+    spinUpState = spinUpStateEnum::RUNNING;
+    dutyTarget = spinUpTargetDuty; // Ramped to from the spin up's duty, a step here can lock on a step late
+    LEDOn();
 
-    // Raise PWM with rotational speed of motor
-    spinUpStep++;
-    byte newPWM = minDuty + (spinUpStep * spinUpPWMIncrement);
-    setPWMDuty(newPWM);
+    logEvent(LOG_SPINUP_DONE);
+    return;
   }
 
-#ifdef UART_COMMS_DEBUG
-  Serial.println("DONE!");
-#endif
+  // Next step of the open loop sequence, watching its floating phase
+  sequenceStep++;
+  sequenceStep %= 6;
+  commutate(sequenceStep);
+  setBEMF(sequenceStep);
+}
+
+void spinUpCrossing() {
+  unsigned int interval = TCB0.CCMP; // Reading clears the flag
 
-  LEDOn();
+  // Only the first crossing in a ramp step after commutation has settled counts
+  if ((spinUpState != spinUpStateEnum::RAMPING) || spinUpCrossingSeen || (TCB1.CNT < timerDebounce)) {
+    TCB0.CNT = interval; // Continue the count as if uninterrupted
+    return;
+  }
+
+  spinUpCrossingSeen = true;
+  if ((spinUpValidSteps + 1) < spinUpLockSteps) return;
+
+  // Rotor is following, schedule the next commutation from this crossing like normal
+  unsigned int halfStep = spinUpPeriod / 2;
+
+  spinUpState = spinUpStateEnum::HANDOVER;
+  TCB1.CNT = 0;
+  TCB1.CCMP = halfStep;
+  lastHalfStep = halfStep;
+  resetPeriodFilter(halfStep);
+  lastCommutationDelay = halfStep;
+  lastCrossingMicros = clockMicros();
+
+  sequenceStep++;
+  sequenceStep %= 6;
+  setBEMF(sequenceStep);
 }
 
-void setPWMDuty(byte deisredDuty) { // Set the duty of the motor PWM
+void setPWMDuty(byte deisredDuty, bool immediate) { // Set the duty of the motor PWM
+
+  // While spinning up the duty is managed by the spin up, so just record it for after
+  if ((spinUpState != spinUpStateEnum::STOPPED) && (spinUpState != spinUpStateEnum::RUNNING) && (deisredDuty >= minDuty)) {
+    spinUpTargetDuty = min(deisredDuty, maxDuty);
+    return;
+  }
   
   // Check provided duty
   if (deisredDuty < minDuty) {
-    duty = 0; // Checks if input is too low and prepares to disable
+    dutyTarget = 0; // Checks if input is too low and prepares to disable
   }
   else if (deisredDuty > maxDuty) {
-    duty = maxDuty;
-#ifdef UART_COMMS_DEBUG
-    Serial.println("Duty specified over maximum, clamping it to max.");
-#endif
+    dutyTarget = maxDuty;
+    logEvent(LOG_DUTY_CLAMPED);
   }
-  else duty = deisredDuty;
+  else dutyTarget = deisredDuty;
 
-  // Assign conditioned duty to all outputs
-  TCA0.SPLIT.LCMP0 = duty;
-  TCA0.SPLIT.LCMP1 = duty;
-  TCA0.SPLIT.LCMP2 = duty;
-  TCA0.SPLIT.HCMP0 = duty;
-  TCA0.SPLIT.HCMP1 = duty;
-  TCA0.SPLIT.HCMP2 = duty;
-  TCA0.SPLIT.CTRLESET = TCA_SPLIT_CMD_RESTART_gc | 0x03; // Reset both timers to syncronize them
+  // Stopping is never ramped, nor is anything while the motor isn't driven off BEMF
+  byte rampLimit = (dutyTarget > duty) ? dutyRampUp : dutyRampDown;
+  if (immediate || (dutyTarget == 0) || (spinUpState != spinUpStateEnum::RUNNING) || (rampLimit == 0)) outputDuty(dutyTarget);
 
   // Additionally disable motor if duty was too low
   if (deisredDuty < minDuty) {
     disableMotor();
-#ifdef UART_COMMS_DEBUG
-    Serial.println("Duty too low, disabling.");
-#endif
+    logEvent(LOG_DUTY_TOO_LOW);
     return;
   }
 
-#ifdef UART_COMMS_DEBUG
-  Serial.print("ESC duty: ");
-  Serial.println(duty);
-#endif
+  logEvent(LOG_DUTY, dutyTarget);
+}
+
+/* Duty Ramp
+
+  Stepping the duty straight to a much higher one (e.g. 10% to full throttle) spikes the
+  battery current and can leave the commutation a step behind the rotor, so changes
+  are limited to so many counts a millisecond up and down. setPWMDuty() only sets the
+  target, runDutyRamp() is called every millisecond to take one step towards it, so
+  each costs the same no matter how big the change. Stops and spin up aren't ramped.
+*/
+void runDutyRamp() {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    byte target = dutyTarget;
+
+    if ((spinUpState == spinUpStateEnum::RUNNING) && (target != duty)) {
+      if (target > duty) {
+        if ((dutyRampUp != 0) && ((target - duty) > dutyRampUp)) target = duty + dutyRampUp;
+      }
+      else {
+        if ((dutyRampDown != 0) && ((duty - target) > dutyRampDown)) target = duty - dutyRampDown;
+      }
+      outputDuty(target);
+    }
+  }
+}
+
+void setDutyRamp(byte up, byte down) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    dutyRampUp = up;
+    dutyRampDown = down;
+  }
+}
+
+void outputDuty(byte newDuty) {
+  duty = newDuty;
+
+  // Assign conditioned duty to all outputs, WO0 opens the BEMF sampling latch after the blanking time
+  TCA0.SPLIT.LCMP0 = (newDuty > (bemfBlanking * 2)) ? (newDuty - bemfBlanking) : (newDuty / 2);
+  TCA0.SPLIT.LCMP1 = newDuty;
+  TCA0.SPLIT.LCMP2 = newDuty;
+  TCA0.SPLIT.HCMP0 = newDuty;
+  TCA0.SPLIT.HCMP1 = newDuty;
+  TCA0.SPLIT.HCMP2 = newDuty;
+  TCA0.SPLIT.CTRLESET = TCA_SPLIT_CMD_RESTART_gc | 0x03; // Reset both timers to syncronize them
 }
 
 bool enableMotor(byte startDuty) { // Enable motor with specified starting duty, returns false if duty is too low or motor is already spinning
@@ -258,39 +549,20 @@ bool enableMotor(byte startDuty) { // Enable motor with specified starting duty,
   // Return false if duty too low, keep motor disabled
   if (startDuty < minDuty) {
     disableMotor();
-#ifdef UART_COMMS_DEBUG
-    Serial.println("Duty too low to enable.");
-#endif
+    logEvent(LOG_ENABLE_TOO_LOW);
     return (false);
   }
 
   if (motorStatus == true) {
-#ifdef UART_COMMS_DEBUG
-    Serial.println("Motor already spinning.");
-#endif
+    logEvent(LOG_ALREADY_SPINNING);
     return (false);
   }
 
-  windUpMotor(); // Needs to happen once PWM is activated so top side can be driven
-
-  // Enable analog comparator
-  AC1.CTRLA = AC_ENABLE_bm | AC_HYSMODE_50mV_gc; // Enable the AC with hysteresis
-
-  // Manually reset timer/counter Bs and enable their interrupts
-  TCB0.CNT = 0; 
-  TCB1.CCMP = 50000; // Just something so TCB1 doesn't immediately trip on first execution
-  TCB0.INTCTRL = TCB_CAPT_bm;
-  TCB1.INTCTRL = TCB_CAPT_bm;
+  // Spin up runs in the background and sets this duty once the motor is running on BEMF
+  spinUpTargetDuty = min(startDuty, maxDuty);
+  windUpMotor();
 
-  bemfSteps[sequenceStep](); // Set proper interrupt conditions
-
-  // Set output PWM
-  motorStatus = true;
-  setPWMDuty(startDuty);  // Set duty for motor
-
-#ifdef UART_COMMS_DEBUG
-  Serial.println("\n! MOTOR ENABLED !\n");
-#endif
+  logEvent(LOG_ENABLED);
 
   return (true);
 }
@@ -300,271 +572,508 @@ void disableMotor() {
   // Disable Analog Comparator (BEMF)
   AC1.CTRLA = 0; 
 
-  // Disable motor timer interrupts
+  // Disable motor timer interrupts, TCB1 is left alone while playing tones since the motor isn't using it
   TCB0.INTCTRL = 0;
-  TCB1.INTCTRL = 0;
+  if (tonesPlaying() == false) {
+    TCB1.INTCTRL = 0;
+    setTCB1Mode(TCB_CNTMODE_SINGLE_gc); // Could have been spinning up or part way through a long delay
+  }
+  commutationExtended = false;
 
   // Lock phases after disabling commutation interrupts
   //allFloat(); // Coast to a stop
   allLow(); // Brake to a stop
 
   duty = 0;
+  dutyTarget = 0;
   motorStatus = false;
+  spinUpState = spinUpStateEnum::STOPPED;
+  lastHalfStep = 0; // No longer spinning under our control
 
-#ifdef UART_COMMS_DEBUG
-  Serial.println("\n! MOTOR DISABLED !\n");
-#endif
+  logEvent(LOG_DISABLED);
 }
 
-// Commutation Period Interrupt
-ISR(TCB0_INT_vect) {
-  //TCB0.INTFLAGS = 1; // Clear interrupt flag (not needed since we are reading CCMP, which auto-clears it)
+/* Period Filter
+
+  A single noisy comparator edge would otherwise shift the next commutation directly. 
+  The last 12 half step periods are kept in a ring buffer with running sums of the 
+  newest 6 (one electrical cycle) and all 12, so averaging costs the same each step 
+  regardless of length. Median of the last three is also available for rejecting 
+  single outliers without the lag of averaging.
+
+  The history is always updated so the filter can be changed at any time.
+*/
+inline uint32_t filterPeriod(uint32_t halfStep) {
+  byte sixAgo = periodIndex + 6;
+  if (sixAgo >= periodHistoryLength) sixAgo -= periodHistoryLength;
+
+  // Swap the oldest of each window for the new period
+  periodSum12 += halfStep;
+  periodSum12 -= periodHistory[periodIndex];
+  periodSum6 += halfStep;
+  periodSum6 -= periodHistory[sixAgo];
+
+  byte previous = (periodIndex == 0) ? (periodHistoryLength - 1) : (periodIndex - 1);
+  byte beforePrevious = (previous == 0) ? (periodHistoryLength - 1) : (previous - 1);
+
+  periodHistory[periodIndex] = halfStep;
+  periodIndex++;
+  if (periodIndex >= periodHistoryLength) periodIndex = 0;
+
+  switch (periodFilter) {
+    case periodFilterEnum::AVERAGE6:
+      return periodSum6 / 6;
+    case periodFilterEnum::AVERAGE12:
+      return periodSum12 / 12;
+    case periodFilterEnum::MEDIAN3: {
+      uint32_t a = periodHistory[previous];
+      uint32_t b = periodHistory[beforePrevious];
+      if (a > b) {
+        uint32_t temp = a;
+        a = b;
+        b = temp;
+      }
+      // a <= b, median is the new period clamped between them
+      if (halfStep < a) return a;
+      if (halfStep > b) return b;
+      return halfStep;
+    }
+    default:
+      return halfStep;
+  }
+}
 
-  unsigned int outputCount; // Used to store the potential output
+void resetPeriodFilter(uint32_t halfStep) {
+  for (byte i = 0; i < periodHistoryLength; i++) periodHistory[i] = halfStep;
+  periodIndex = 0;
+  periodSum6 = halfStep * 6;
+  periodSum12 = halfStep * 12;
+}
 
-  /* Trying to determine Rollover and Debouncing
+void setDirection(bool reversed) {
+  if (motorStatus) return; // The interrupts could be using the table
 
-    Since I am measuring the period of an entire phase, I would like to try and extend the 
-    effective range by trying to estimate if a rollover occured in TCB0 while trying to 
-    catch phase length. This is done by having the commutation interrupt record the count 
-    in TCB0 when it goes so when TCB0 runs it can compare it's event time to the one for 
-    when TCB0 went. If 
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    memcpy(steps, reversed ? reverseSteps : forwardSteps, sizeof(steps));
+    reverse = reversed;
+  }
+}
 
-    TCB0.CCMP > Recorded count - They happened in the same cycle
-    TCB0.CCMP < Recorded count - There was a rollover inbetween them
+void setPeriodFilter(periodFilterEnum filter) {
+  if (filter > periodFilterEnum::MEDIAN3) filter = periodFilterEnum::RAW;
+  periodFilter = filter;
+}
 
-    Checking for rollover allows me to almost double the period it can measure so it should 
-    be able to safely step up to 10ms (as low as 100Hz).
+// Commutation Period Interrupt
+inline void zeroCrossing() {
+  //TCB0.INTFLAGS = 1; // Clear interrupt flag (not needed since we are reading CCMP, which auto-clears it)
 
-    Debouncing is needed to prevent the inductive kickback from triggering false readings. 
-    A constant is used to set a "debouncing" period in number of steps (each ~0.1us).
-  */
+  unsigned int captured = TCB0.CCMP;
+  unsigned long now = clockMicros();
 
-  if (TCB0.CCMP > countAtCommutation) {
-    
-    // Check for bouncing
-    if (TCB0.CCMP < (countAtCommutation + timerDebounce)) {
-      TCB0.CNT = TCB0.CCMP;     // Continue the count as if uninterrupted
-      return;
-    }
+  /* Rollover and Debouncing
 
-    // No rollover, get half phase
-    outputCount = TCB0.CCMP / 2; 
+    TCB0 counts at 10MHz so its 16 bits only cover about 6.5ms. To measure longer steps 
+    the number of times it rolled over is worked out from the clock since the last 
+    crossing. The clock is only used to pick the rollover count, so it only needs to be 
+    within half a rollover (3.2ms) of the truth, the exact period still comes from TCB0. 
+    Even with the RTC a few percent out this allows steps from the debounce period up to 
+    well past 50ms.
+
+    Debouncing is needed to prevent the inductive kickback from triggering false readings. 
+    Any crossing within the debounce period (each count ~0.1us) after the commutation is 
+    ignored, as is anything before the commutation since the comparator is already 
+    watching the next step's floating phase. For very short steps the debounce period is 
+    cut to half the half step so the real crossing isn't ignored too. It comes from the 
+    step period rather than the commutation delay, which shrinks to almost nothing at 
+    full advance and would leave the kickback unblanked.
+  */
+  uint32_t interval = captured;
+  uint32_t coarse = (now - lastCrossingMicros) * 10;
+  if ((coarse + 32768) > captured) interval += (coarse + 32768 - captured) & 0xFFFF0000;
+
+  uint32_t debounce = lastHalfStep / 2; // Shrink debounce for very short steps so they can still be caught
+  if (debounce > timerDebounce) debounce = timerDebounce;
+
+  if (interval < (lastCommutationDelay + debounce)) {
+    TCB0.CNT = captured;     // Continue the count as if uninterrupted
+    traceRejected();
+#ifdef PROFILE_ISRS
+    isrTimerResets++;
+#endif
+    return;
   }
-  else {
-    // Likely a rollover occured, so we need to add time for the first phase
-    outputCount = 32768 + (TCB0.CCMP / 2); 
 
-    // Check for bouncing, but need to half the threshold to match the "halved" period measured
-    if (outputCount < ((countAtCommutation/2) + (timerDebounce/2))) {
-      TCB0.CNT = TCB0.CCMP;     // Continue the count as if uninterrupted
+  lastCrossingMicros = now;
+  uint32_t outputCount = interval / 2; // Half step
+
+  // A step wildly different to the last few means the crossings aren't from the rotor
+  if ((outputCount > (lastHalfStep * 2)) || ((outputCount * 2) < lastHalfStep)) {
+    if (++badIntervals >= desyncIntervalLimit) {
+      desynced(desyncCauseEnum::INTERVAL);
       return;
     }
   }
-  
-  TCB1.CNT = 0; // Reset TCB1 in case it was accidentally triggered well before this
-  TCB1.CCMP = outputCount;
-  countAtCommutation = 0; // Reset this
+  else badIntervals = 0;
+
+  stepCommutated = false;
+
+  // Smooth out noisy crossings before using the period
+  uint32_t halfStep = filterPeriod(outputCount);
+
+  // Commutating at the half step is 30 degrees after the crossing, advance comes off that
+  uint32_t commutationDelay = halfStep;
+  if (advanceFraction != 0) commutationDelay -= (halfStep * advanceFraction) >> 8;
+
+  scheduleCommutation(commutationDelay);
+  lastHalfStep = halfStep; // Kept for RPM since CCMP gets set to its max after commutating
 
   sequenceStep++;             // Increment step by 1, next part in the sequence of 6
   sequenceStep %= 6;
-  bemfSteps[sequenceStep]();
+  setBEMF(sequenceStep);
+  traceStep(sequenceStep, interval, duty);
 
-#ifdef UART_COMMS_DEBUG
-  /* Debug statements
-    Three character summaries (one for each phase), ordered A-B-C.
-      H - Driven high
-      L - Driven low
-      R - Looking for rising edge (floating)
-      F - Looking for falling edge (floating)
-     
-    Could reduce each phase's state to two bits to condense it under a byte, 
-    thus waste less time sending, but it will be harder to read.
-    */ 
-  if (reverse == 0) {
-    switch (sequenceStep) {
-      case 0:
-        Serial.println("HLF");
-        break;
-      case 1:
-        Serial.println("HRL");
-        break;
-      case 2:
-        Serial.println("FHL");
-        break;
-      case 3:
-        Serial.println("LHR");
-        break;
-      case 4:
-        Serial.println("LFH");
-        break;
-      case 5:
-        Serial.println("RLH");
-        break;
+  // Closed loop speed control and the advance curve are run once per electrical cycle
+  // The first cycle after starting or recovering can begin on any step, so it is skipped
+  halfCycleCount += outputCount;
+  if (sequenceStep == 0) {
+    bool governing = (controlScheme == ctrlSchemeEnum::RPM);
+
+    if (halfCycleWhole && (governing || (advanceCurveFlat == false))) {
+      // Half cycle is the sum of six half steps, so it replaces halfStep * 6 for getting RPM
+      uint32_t rpm = (rpmNumerator * 6) / halfCycleCount;
+
+      if (governing) runRPMGovernor(rpm);
+      if (advanceCurveFlat == false) updateTimingAdvance(rpm);
     }
+
+    if (governing == false) governorPrimed = false; // Reseed when control is handed back
+    halfCycleCount = 0;
+    halfCycleWhole = true;
   }
-  else {
-    switch (sequenceStep) {
-      case 0:
-        Serial.println("HLR");
-        break;
-      case 1:
-        Serial.println("FLH");
-        break;
-      case 2:
-        Serial.println("LRH");
-        break;
-      case 3:
-        Serial.println("LHF");
-        break;
-      case 4:
-        Serial.println("RHL");
-        break;
-      case 5:
-        Serial.println("HFL");
-        break;
+
+  logEvent(LOG_STEP, sequenceStep | (reverse << 3)); // Printed as the state of each phase
+}
+
+/* Desync Detection
+
+  The motor is considered desynced (commutation no longer following the rotor) if any of
+    - A few steps in a row are less than half or more than double the filtered step
+    - TCB1 goes to commutate a step a second time, two steps after the last crossing
+    - No crossing is seen for four steps' worth of time (checked from loop())
+
+  To recover the duty in use is kept and a short spin up is run, it resumes at that 
+  duty once the rotor is followed again. The count of each cause is kept for telemetry.
+*/
+void desynced(desyncCauseEnum cause) {
+  desyncCounts[cause]++;
+  traceTrigger();
+
+  logEvent(LOG_DESYNC, cause);
+
+  if (dutyTarget >= minDuty) spinUpTargetDuty = dutyTarget; // Resume where it was headed
+
+  // Restart speed measurement as if starting
+  lastHalfStep = 0;
+  halfCycleCount = 0;
+  halfCycleWhole = false;
+  governorPrimed = false;
+  badIntervals = 0;
+
+  commutationExtended = false; // TCB1 is restarted as a periodic timer for the alignment
+
+  spinUpAttempt = 0;
+  beginAlignment(recoveryAlignCount);
+}
+
+void checkDesync() {
+  if (spinUpState != spinUpStateEnum::RUNNING) return;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    // Four steps (eight half steps in 0.1us ticks) since the last crossing
+    unsigned long timeout = (lastHalfStep * 4) / 5;
+    if (timeout < desyncMinTimeout) timeout = desyncMinTimeout;
+
+    if ((spinUpState == spinUpStateEnum::RUNNING) && ((clockMicros() - lastCrossingMicros) > timeout)) {
+      desynced(desyncCauseEnum::MISSED);
     }
   }
+}
+
+void clearDesyncCounts() {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    for (byte i = 0; i < desyncCauseCount; i++) desyncCounts[i] = 0;
+  }
+}
+
+/* Long Commutation Delays
+
+  TCB1 can only count 6.5ms in one go, so longer delays are waited out in chunks. The 
+  first chunk runs in single shot mode as normal (it was already started by the 
+  crossing), then TCB1 is switched to periodic mode to count the rest before being put 
+  back for the commutation.
+
+  A crossing that comes while still waiting out the last long delay doesn't start TCB1, 
+  which is in periodic mode. It is left counting in that mode for the new delay, and 
+  put back to single shot at the commutation the same as after a long delay. Here and 
+  everywhere else the mode is only changed through setTCB1Mode().
+*/
+void setTCB1Mode(byte mode) {
+  TCB1.CTRLA &= ~TCB_ENABLE_bm;
+  TCB1.CTRLB = mode;
+  TCB1.CTRLA |= TCB_ENABLE_bm;
+}
+
+void scheduleCommutation(uint32_t delay) {
+  lastCommutationDelay = delay;
+  commutationExtended = commutationExtended || (delay > 65535); // Still periodic if the crossing came early
+  commutationDelayLeft = 0;
+
+  if (delay > 65535) {
+    commutationDelayLeft = delay - 65535;
+    delay = 65535;
+  }
+
+  TCB1.CNT = 0; // Reset TCB1 in case it was accidentally triggered well before this
+  TCB1.CCMP = delay;
+
+#ifdef PROFILE_ISRS
+  isrCommutationScheduled(delay);
+#endif
+}
+
+bool extendCommutationDelay() {
+  if (commutationDelayLeft == 0) {
+    // Done waiting, commutate and go back to triggering off the comparator
+    setTCB1Mode(TCB_CNTMODE_SINGLE_gc);
+    commutationExtended = false;
+    return false;
+  }
+
+  TCB1.INTFLAGS = 1; // Clear flag
+
+  unsigned int chunk = (commutationDelayLeft > 65535) ? 65535 : commutationDelayLeft;
+  commutationDelayLeft -= chunk;
+
+  setTCB1Mode(TCB_CNTMODE_INT_gc);
+  TCB1.CNT = 0;
+  TCB1.CCMP = chunk;
+  return true;
+}
+
+ISR(TCB0_INT_vect) {
+#ifdef PROFILE_ISRS
+  isrTimerResets++; // Capture reset TCB0
+#endif
+
+  if (spinUpState != spinUpStateEnum::RUNNING) {
+    spinUpCrossing();
+    return;
+  }
+
+#ifdef PROFILE_ISRS
+  isrProfileScope profile(isrProfileEnum::ISR_CROSSING, TCB0.CNT); // Count started at the crossing
 #endif
+
+  zeroCrossing();
 }
 
 // Commutation Interrupt
-ISR(TCB1_INT_vect) {
+inline void commutationTimer() {
   TCB1.INTFLAGS = 1; // Clear flag
 
-  // Record TCB0 count at commutation
-  countAtCommutation = TCB0.CNT;
+  /* Commutating the same step twice means TCB1 timed out waiting for a crossing. A 
+    rejected edge after commutating restarts the single shot though, and its longest 
+    count (6.5ms) is shorter than a slow step, so it is only a time out once two steps 
+    have passed without a crossing.
+  */
+  if (stepCommutated) {
+    if ((clockMicros() - lastCrossingMicros) > ((lastHalfStep * 2) / 5)) desynced(desyncCauseEnum::TIMEOUT); // Four half steps in 0.1us ticks
+    return;
+  }
+  stepCommutated = true;
 
-  motorSteps[sequenceStep]();
+  commutate(sequenceStep);
 
   TCB1.CCMP = 65535; // Set to max
 }
 
+ISR(TCB1_INT_vect) {
+  if (spinUpState != spinUpStateEnum::RUNNING) {
+    TCB1.INTFLAGS = 1; // Clear flag
+    if (spinUpState == spinUpStateEnum::STOPPED) tonesTimer(); // Only used for tones while stopped
+    else spinUpTimer();
+    return;
+  }
+
+#ifdef PROFILE_ISRS
+  isrProfileScope profile(isrProfileEnum::ISR_COMMUTATION, commutationExtended ? isrNoLatency : isrCommutationLatency());
+#endif
+
+  if (commutationExtended && extendCommutationDelay()) return;
 
-// Buzzer function.
-void buzz(int periodMicros, int durationMillis) { // Buzz with a period of
-  if (motorStatus) return; // Will not run if motor is enabled and spinning.
-  // It would [greatly] suck if the drone "buzzed" mid-flight
+  commutationTimer();
+}
 
-  // Ensure period is in allowed tolerances
-  periodMicros = constrain(periodMicros, minBuzzPeriod, maxBuzzPeriod);
+// RPM estimation function
+unsigned int getCurrentRPM() {
+  uint32_t halfStep;
 
-  /*
-    Buzz works by powering one motor phase (AHBL) for a few us then holding off
-    for the remainder of half the period, then fires another phase (AHCL) before 
-    holding for the rest of the period.
+  // Period is updated by a higher priority interrupt, so make sure it isn't torn
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    halfStep = lastHalfStep;
+  }
+
+  if (halfStep == 0) return 0; // Stopped
+
+  /* A rotation takes (halfStep * 12 * cyclesPerRotation) ticks at 10MHz, so 
+    RPM = 600,000,000 / (halfStep * 12 * cyclesPerRotation) = rpmNumerator / halfStep
+    
+    The numerator only changes with cyclesPerRotation so it is kept precomputed.
   */
+  uint32_t rpm = rpmNumerator / halfStep;
+  if (rpm > 65535) rpm = 65535;
 
-  const unsigned int holdOn = 10;                         // Time the motor is pulled high (microseconds)
-  int holdOff = (periodMicros / 2) - holdOn;              // Gets this holdoff period
-  unsigned long endOfBuzzing = millis() + durationMillis; // Marks endpoint
+  return rpm;
+}
 
-  allLow(); // Ensure we start floating
+void setCyclesPerRotation(byte cycles) {
+  if (cycles == 0) cycles = 1; // Avoid dividing by zero
 
-  // Buzz for the duration
-  while (millis() < endOfBuzzing) {
-    // Clear the state of all pins so only the phases of interest are driven
-    //PORTA.OUTCLR = PIN5_bm; // Redunant since it will be set soon anyways
-    PORTC.OUTCLR = PIN3_bm | PIN4_bm;
-    PORTB.OUTCLR = PIN0_bm | PIN1_bm | PIN5_bm;
-    PORTA.OUTSET = PIN5_bm; // AH
-    PORTB.OUTSET = PIN1_bm; // BL
-    delayMicroseconds(holdOn);
-    allLow();
-    delayMicroseconds(holdOff);
+  uint32_t numerator = 50000000UL / cycles;
 
-    //PORTA.OUTCLR = PIN5_bm;
-    PORTC.OUTCLR = PIN3_bm | PIN4_bm;
-    PORTB.OUTCLR = PIN0_bm | PIN1_bm | PIN5_bm;
-    PORTA.OUTSET = PIN5_bm; // AH
-    PORTB.OUTSET = PIN0_bm; // CL
-    delayMicroseconds(holdOn);
-    allLow();
-    delayMicroseconds(holdOff);
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    cyclesPerRotation = cycles;
+    rpmNumerator = numerator;
   }
-
-  disableMotor(); // Redisable the motor entirely
 }
 
-// RPM estimation function
-unsigned int getCurrentRPM() {
-  float rpm;
+/* RPM Governor
+
+  A fixed point PI controller run once per electrical cycle (every six steps) from 
+  TCB0's interrupt. The speed comes from the sum of the six half step periods measured
+  in that cycle, so it is averaged over the whole cycle and needs only one division.
+
+  The integral is kept in Q16 duty counts so small gains are possible without floats.
+  It is seeded with the duty in use when the governor takes over so there is no jump.
+  Anti-windup is done by clamping the integral to the allowed duty range and not 
+  integrating further while the output is saturated in the direction of the error.
+  The error is clamped to maxRPMError first, so even the largest gains can't overflow.
+*/
+void runRPMGovernor(uint32_t rpm) {
+  const int32_t dutyFloor = int32_t(minDuty) << 16;
+  const int32_t dutyCeiling = int32_t(maxDuty) << 16;
+
+  if (governorPrimed == false) {
+    rpmIntegral = int32_t(duty) << 16;
+    governorPrimed = true;
+  }
 
-  // Get the half step avoiding the default value
-  unsigned int halfStep = TCB1.CCMP;
-  while (halfStep == 65535) halfStep = TCB1.CCMP;
+  int32_t error = int32_t(targetRPM) - int32_t(rpm);
+  error = constrain(error, -maxRPMError, maxRPMError);
 
-  rpm = halfStep * 12;            // Extrapolate period to complete on six-step cycle
-  rpm = rpm * cyclesPerRotation;  // Extrapolate rotational period
-  rpm = 10000.0 / rpm;            // Determine rotations per millisecond (RPmS) (timers count at 10MHz)
-  rpm = rpm * 60000.0;            // Convert RPmS to RPM
-  // RPmS is used to avoid a large difference in powers when doing division
+  int32_t output = rpmIntegral + (int32_t(rpmGainP) * error);
 
-  unsigned int temp = rpm;
-  return temp;
+  // Only integrate if it will not drive an already saturated output further
+  if (!((output >= dutyCeiling) && (error > 0)) && !((output <= dutyFloor) && (error < 0))) {
+    rpmIntegral += int32_t(rpmGainI) * error;
+    rpmIntegral = constrain(rpmIntegral, dutyFloor, dutyCeiling);
+  }
+
+  output = constrain(output, dutyFloor, dutyCeiling);
+  byte newDuty = output >> 16;
+
+  if (newDuty != dutyTarget) setPWMDuty(newDuty); // Avoid restarting the PWM timers needlessly
 }
 
-/* NOTE: The high sides should never be set to HIGH.
+/* Timing Advance
 
-  They should always be LOW or overriden by PWM so the state doesn't matter.
-  I use this assumption to potentially simplify this code, by using OUTSET
-  or OUTCLR to adjust the lows but leave the highs to be enabled by the PWM
-  override when needed. This is only used when A needs to be driven low.
+  Normally commutation happens half a step (30 degrees) after the zero crossing. At speed 
+  the delays in the ISR and the winding inductance make the motor lag, so commutating 
+  earlier helps. The advance is kept as a Q8 fraction of 30 degrees so taking it off the 
+  half step in the ISR is a multiply and a shift.
 
-  This could prove to be an optimization in the future to put all the highs
-  on one PORT (probably PORTB) and leave the lows on the other (PORTC) so
-  they can be manipulated with simpler code. 
-  
-  This will need a hardware revision.
-*/ 
-void AHBL() {
-  // Set up PWM pin(s) for high side
-  TCA0.SPLIT.CTRLB = TCA_SPLIT_HCMP2EN_bm;
+  The advance follows a curve of a few points by RPM, linearly interpolated between them. 
+  Setting a single advance just makes the curve flat, which skips the interpolation.
+*/
+void updateTimingAdvance(uint32_t rpm) {
+  byte advance;
 
-  // Set pin for low side and leave others cleared
-  PORTB.OUTCLR = PIN0_bm | PIN1_bm | PIN5_bm;
-  PORTB.OUTSET = PIN1_bm;
+  if (rpm <= advanceCurveRPM[0]) advance = advanceCurve[0];
+  else if (rpm >= advanceCurveRPM[advanceCurvePoints - 1]) advance = advanceCurve[advanceCurvePoints - 1];
+  else {
+    byte i = 0;
+    while (rpm >= advanceCurveRPM[i + 1]) i++;
+
+    // Interpolate between point i and the next
+    uint16_t span = advanceCurveRPM[i + 1] - advanceCurveRPM[i];
+    int16_t rise = int16_t(advanceCurve[i + 1]) - int16_t(advanceCurve[i]);
+    int32_t offset = (int32_t(rpm - advanceCurveRPM[i]) * rise) / span;
+    advance = advanceCurve[i] + offset;
+  }
+
+  if (advance != timingAdvance) applyTimingAdvance(advance);
 }
-void AHCL() {
-  // Set up PWM pin(s) for high side
-  TCA0.SPLIT.CTRLB = TCA_SPLIT_HCMP2EN_bm;
 
-  // Set pin for low side and leave others cleared
-  PORTB.OUTCLR = PIN0_bm | PIN1_bm | PIN5_bm;
-  PORTB.OUTSET = PIN0_bm;
+void applyTimingAdvance(byte advance) {
+  if (advance > maxTimingAdvance) advance = maxTimingAdvance;
+
+  uint16_t fraction = (uint16_t(advance) * 32) / 15; // advance / 120 as Q8
+  if (fraction > 255) fraction = 255;
+
+  timingAdvance = advance;
+  advanceFraction = fraction;
 }
-void BHCL() {
-  // Set up PWM pin(s) for high side
-  TCA0.SPLIT.CTRLB = TCA_SPLIT_HCMP0EN_bm;
 
-  // Set pin for low side and leave others cleared
-  PORTB.OUTCLR = PIN0_bm | PIN1_bm | PIN5_bm;
-  PORTB.OUTSET = PIN0_bm;
+void setRPMGains(uint16_t gainP, uint16_t gainI) {
+  // Both used by TCB0's interrupt, so neither can be torn
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    rpmGainP = gainP;
+    rpmGainI = gainI;
+  }
 }
-void BHAL() {
-  // Set up PWM pin(s) for high side
-  TCA0.SPLIT.CTRLB = TCA_SPLIT_HCMP0EN_bm;
 
-  // Set pin for low side and leave others cleared
-  PORTB.OUTCLR = PIN0_bm | PIN1_bm | PIN5_bm;
-  PORTB.OUTSET = PIN5_bm;
+void setTimingAdvance(byte advance) {
+  if (advance > maxTimingAdvance) advance = maxTimingAdvance;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    for (byte i = 0; i < advanceCurvePoints; i++) advanceCurve[i] = advance;
+    advanceCurveFlat = true;
+    applyTimingAdvance(advance);
+  }
 }
-void CHAL() {
-  // Set up PWM pin(s) for high side
-  TCA0.SPLIT.CTRLB = TCA_SPLIT_HCMP1EN_bm;
 
-  // Set pin for low side and leave others cleared
-  PORTB.OUTCLR = PIN0_bm | PIN1_bm | PIN5_bm;
-  PORTB.OUTSET = PIN5_bm;
+bool setAdvanceCurvePoint(byte index, uint16_t rpm, byte advance) {
+  if (index >= advanceCurvePoints) return false;
+  if (advance > maxTimingAdvance) advance = maxTimingAdvance;
+
+  // Points need to stay in order of RPM for the interpolation
+  if ((index > 0) && (rpm <= advanceCurveRPM[index - 1])) return false;
+  if ((index < (advanceCurvePoints - 1)) && (rpm >= advanceCurveRPM[index + 1])) return false;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    advanceCurveRPM[index] = rpm;
+    advanceCurve[index] = advance;
+
+    advanceCurveFlat = true;
+    for (byte i = 1; i < advanceCurvePoints; i++) {
+      if (advanceCurve[i] != advanceCurve[0]) advanceCurveFlat = false;
+    }
+    if (advanceCurveFlat) applyTimingAdvance(advance);
+  }
+
+  return true;
 }
-void CHBL() {
-  // Set up PWM pin(s) for high side
-  TCA0.SPLIT.CTRLB = TCA_SPLIT_HCMP1EN_bm;
 
-  // Set pin for low side and leave others cleared
-  PORTB.OUTCLR = PIN0_bm | PIN1_bm | PIN5_bm;
-  PORTB.OUTSET = PIN1_bm;
+void getAdvanceCurvePoint(byte index, uint16_t &rpm, byte &advance) {
+  if (index >= advanceCurvePoints) index = advanceCurvePoints - 1;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    rpm = advanceCurveRPM[index];
+    advance = advanceCurve[index];
+  }
 }
+
 void allFloat() {
   TCA0.SPLIT.CTRLB = 0; // No PWM control over output
 
@@ -584,46 +1093,35 @@ void allLow() {
   PORTB.OUTSET = PIN0_bm | PIN1_bm | PIN5_bm;
 }
 
-/* Comparator functions
-  Since the timers are always looking for rising edges I need to invert the 
-  comparison results for when we are watching for falling BEMF.
-
-  This approach reduces the code executed per call from three lines to one.
-*/ 
-
-void aRisingBEMF() {
-  AC1.MUXCTRLA = AC_MUXPOS_PIN1_gc | AC_MUXNEG_PIN1_gc;
-}
-void aFallingBEMF() {
-  AC1.MUXCTRLA = AC_MUXPOS_PIN1_gc | AC_MUXNEG_PIN1_gc | AC_INVERT_bm;
-}
-void bRisingBEMF() {
-  AC1.MUXCTRLA = AC_MUXPOS_PIN0_gc | AC_MUXNEG_PIN1_gc;
-}
-void bFallingBEMF() {
-  AC1.MUXCTRLA = AC_MUXPOS_PIN0_gc | AC_MUXNEG_PIN1_gc | AC_INVERT_bm;
-}
-void cRisingBEMF() {
-  AC1.MUXCTRLA = AC_MUXPOS_PIN3_gc | AC_MUXNEG_PIN1_gc;
-}
-void cFallingBEMF() {
-  AC1.MUXCTRLA = AC_MUXPOS_PIN3_gc | AC_MUXNEG_PIN1_gc | AC_INVERT_bm;
-}
+#ifdef BENCHMARK
+void benchmarkRunningState(uint16_t halfStep) {
+  // Nothing driven and no duty, so commutating only moves the low side pins
+  allLow();
+  outputDuty(0);
+
+  // Comparator off so only the benchmark's strobes reach the timers, the filters would reject them
+  AC1.CTRLA = 0;
+  TCB0.EVCTRL = TCB_CAPTEI_bm;
+  setTCB1Mode(TCB_CNTMODE_SINGLE_gc);
+  TCB1.EVCTRL = TCB_CAPTEI_bm;
+  TCB1.CCMP = 65535;
+  TCB0.INTFLAGS = TCB_CAPT_bm;
+  TCB1.INTFLAGS = TCB_CAPT_bm;
+  TCB0.INTCTRL = TCB_CAPT_bm;
+  TCB1.INTCTRL = TCB_CAPT_bm;
 
-// Function to prepare a buzz outside an interrupt
-void setToBuzz(unsigned int period, unsigned int duration) {
-  interruptBuzzDuration = duration;
-  interruptBuzzPeriod = period;
+  // Steady running, just commutated
+  motorStatus = true;
+  spinUpState = spinUpStateEnum::RUNNING;
+  stepCommutated = true;
+  commutationExtended = false;
+  badIntervals = 0;
+  lastHalfStep = halfStep;
+  lastCommutationDelay = halfStep;
+  resetPeriodFilter(halfStep);
+
+  // Next crossing is a whole step after the last
+  TCB0.CNT = halfStep * 2;
+  lastCrossingMicros = clockMicros() - (halfStep / 5);
 }
-
-// Run a buzz specified from an interrupt
-void runInterruptBuzz() {
-  // Only bother buzzing when a request was recently made
-  if (interruptBuzzPeriod > 0) {
-    buzz(interruptBuzzPeriod, interruptBuzzDuration);
-
-    // Clear until next interrupt sets them
-    interruptBuzzDuration = 0;
-    interruptBuzzPeriod = 0;
-  }
-}
\ No newline at end of file
+#endif
@@ -7,6 +7,11 @@
 extern const byte maxDuty;       // Upper limit to PWM (MUST be less than 256)
 extern volatile byte duty;       // Current PWM duty
 extern const byte minDuty;       // Stores minimum allowed duty
+extern volatile byte dutyTarget; // Duty being ramped towards (what was last set)
+
+// Duty ramp, most the duty changes each millisecond (counts), 0 for no limit
+extern volatile byte dutyRampUp;
+extern volatile byte dutyRampDown;
 
 // Commutation Constants
 extern volatile byte cyclesPerRotation;
@@ -17,29 +22,69 @@ extern volatile ctrlSchemeEnum controlScheme; // Determines whether the ESC uses
 
 // RPM related
 extern volatile unsigned int targetRPM;
+extern volatile uint16_t rpmGainP; // Governor proportional gain (Q16 duty counts per RPM)
+extern volatile uint16_t rpmGainI; // Governor integral gain (Q16 duty counts per RPM per electrical cycle)
+
+// Desync detection
+enum desyncCauseEnum: byte {INTERVAL = 0, TIMEOUT = 1, MISSED = 2}; // Erratic step period, TCB1 timed out, no crossings for a while
+const byte desyncCauseCount = 3;
+extern volatile unsigned int desyncCounts[desyncCauseCount]; // Number of desyncs detected by cause
+
+// Period filtering, for smoothing the measured step periods
+enum periodFilterEnum: byte {RAW = 0, AVERAGE6 = 1, AVERAGE12 = 2, MEDIAN3 = 3}; // None, mean of last 6 or 12, median of last 3
+extern volatile periodFilterEnum periodFilter;
+
+// Timing advance (all in quarter degrees)
+extern const byte maxTimingAdvance;     // Largest advance allowed (30 degrees)
+extern const byte advanceCurvePoints;   // Number of points on the advance curve
+extern volatile byte timingAdvance;     // Advance currently applied
 
 // Motor rotation variables and constants
 extern volatile bool reverse;
-extern volatile bool motorStatus; // Stores if the motor is disabled (false) or not
+extern volatile bool motorStatus; // Stores if the motor is disabled (false) or not (includes spinning up)
+
+// Spin up
+enum spinUpStateEnum: byte {STOPPED = 0, ALIGNING = 1, RAMPING = 2, HANDOVER = 3, RUNNING = 4}; // Stages of spinning up
+extern volatile spinUpStateEnum spinUpState; // Current stage of spinning up, RUNNING once commutating off BEMF
 
 ////////////////////////////////////////////////////////////
 // Function declarations
 
+/** @name setDirection
+   *  @brief Sets the direction the motor spins. Ignored unless the motor is disabled, as it swaps the table the commutation interrupts use.
+   *  @param reversed Spin in reverse
+   */
+void setDirection(bool reversed);
+
 /** @name setPWMDuty
-   *  @brief Set the PWM duty of the motor
-   *  @param deisredDuty Desired duty
+   *  @brief Set the PWM duty of the motor. While running, changes are ramped to at the limits set by setDutyRamp().
+   *  @param deisredDuty Desired duty, below minDuty disables the motor straight away
+   *  @param immediate Skips the ramp, e.g. to cut the throttle in an emergency
    */
-void setPWMDuty(byte deisredDuty);
+void setPWMDuty(byte deisredDuty, bool immediate = false);
+
+/** @name runDutyRamp
+   *  @brief Moves the duty a step towards the one set
+   *  @note Should be called every millisecond
+   */
+void runDutyRamp();
+
+/** @name setDutyRamp
+   *  @brief Sets how fast the duty may change while running
+   *  @param up Most the duty can rise each millisecond (counts), 0 for no limit
+   *  @param down Most the duty can fall each millisecond (counts), 0 for no limit
+   */
+void setDutyRamp(byte up, byte down);
 
 /** @name enableMotor
-   *  @brief Use this to enable the motor
-   *  @param startDuty Motor duty to start with
+   *  @brief Use this to enable the motor. Returns immediately, the motor spins up in the background.
+   *  @param startDuty Motor duty to use once spun up
    *  @return Returns true if the motor was enabled without issue. False if duty selected was too low or motor is already spinning.
    */
 bool enableMotor(byte startDuty);
 
 /** @name windUpMotor
-   *  @brief Winds up the motor to start spinning
+   *  @brief Starts winding up the motor, done in the background by TCB1. Hands over to BEMF commutation once the rotor is following.
    */
 void windUpMotor();
 
@@ -53,13 +98,6 @@ void setupMotor();
    */
 void disableMotor();
 
-/** @name buzz
-   *  @brief Use this for a buzzes for user awareness. Motor needs to be disabled to work.
-   *  @param  periodMicros Period of buzz tone in microseconds
-   *  @param  durationMillis Duration of buzz overall in milliseconds
-   */
-void buzz(int periodMicros, int durationMillis);
-
 /** @name allFloat
    *  @brief Sets all motor half-bridges to float, motor coasts to a stop.
    */
@@ -70,22 +108,78 @@ void allFloat();
    */
 void allLow();    // Set all outputs to float (braking)
 
+/** @name setTCB1Mode
+   *  @brief Changes TCB1's count mode, disabling it while the mode is written. TCB1 is 
+   *  shared by the motor and the tones, and its mode is only ever changed through this.
+   *  @param mode TCB_CNTMODE_SINGLE_gc or TCB_CNTMODE_INT_gc
+   */
+void setTCB1Mode(byte mode);
+
 /** @name getCurrentRPM
-   *  @brief Extrapolate current RPM based on the half-step duration
-   *  @return Extrapolated RPM as an unsigned int
+   *  @brief Extrapolate current RPM based on the last valid half-step duration. Does not block.
+   *  @return Extrapolated RPM as an unsigned int, 0 if the motor is stopped
    */
 unsigned int getCurrentRPM(); // Returns current RPM
 
-/** @name setToBuzz
-   *  @brief Use this to set the system to buzz outside an interrupt. Motor needs to be disabled to work.
-   *  @param  periodMicros Period of buzz tone in microseconds
-   *  @param  durationMillis Duration of buzz overall in milliseconds
+/** @name setCyclesPerRotation
+   *  @brief Sets the number of electrical cycles per rotation and updates the precomputed RPM conversion
+   *  @param cycles Electrical cycles per mechanical rotation (pole pairs)
+   */
+void setCyclesPerRotation(byte cycles);
+
+/** @name checkDesync
+   *  @brief Checks that zero crossings are still arriving, recovers the motor if not. Should be called regularly from loop().
+   */
+void checkDesync();
+
+/** @name clearDesyncCounts
+   *  @brief Resets the desync counts
+   */
+void clearDesyncCounts();
+
+/** @name setPeriodFilter
+   *  @brief Sets the filter used on measured step periods for commutation and RPM
+   *  @param filter Filter to use, invalid values select RAW
+   */
+void setPeriodFilter(periodFilterEnum filter);
+
+/** @name setRPMGains
+   *  @brief Sets the gains of the RPM governor, used from its next run
+   *  @param gainP Proportional gain (Q16 duty counts per RPM of error)
+   *  @param gainI Integral gain (Q16 duty counts per RPM of error, per electrical cycle)
+   */
+void setRPMGains(uint16_t gainP, uint16_t gainI);
+
+/** @name setTimingAdvance
+   *  @brief Sets a fixed commutation timing advance, used at all speeds
+   *  @param advance Advance in quarter degrees (0 to 120, i.e. 0 to 30 degrees)
+   */
+void setTimingAdvance(byte advance);
+
+/** @name setAdvanceCurvePoint
+   *  @brief Sets a point on the RPM indexed timing advance curve, advance is interpolated between points
+   *  @param index Point to set (0 to advanceCurvePoints - 1)
+   *  @param rpm RPM of the point, must be between the RPM of its neighbouring points
+   *  @param advance Advance at that RPM in quarter degrees (0 to 120)
+   *  @return Returns true if the point was set, false if the index or RPM was invalid
+   */
+bool setAdvanceCurvePoint(byte index, uint16_t rpm, byte advance);
+
+/** @name getAdvanceCurvePoint
+   *  @brief Reads a point on the timing advance curve
+   *  @param index Point to read (clamped to the last point)
+   *  @param rpm Returns the RPM of the point
+   *  @param advance Returns the advance at the point in quarter degrees
    */
-void setToBuzz(unsigned int period, unsigned int duration);
+void getAdvanceCurvePoint(byte index, uint16_t &rpm, byte &advance);
 
-/** @name runInterruptBuzz
-   *  @brief Runs a buzz that was called for within an interrupt using "setToBuzz"
+#ifdef BENCHMARK
+/** @name benchmarkRunningState
+   *  @brief Puts the commutation code in its running state with a zero crossing due, without driving the bridge. Only for timing it (see benchmark.h).
+   *  @param halfStep Half step period to act as if the motor is turning at (TCB ticks)
+   *  @note Interrupts should be off, the comparator is left off and the timers' event filters are dropped so strobed events are captured
    */
-void runInterruptBuzz();
+void benchmarkRunningState(uint16_t halfStep);
+#endif
 
 #endif
\ No newline at end of file
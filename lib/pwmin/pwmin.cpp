@@ -1,72 +1,298 @@
 #include "pwmin.h"
 #include "motor.h"
+#include "settings.h"
+#include "uartcomms.h"
+#include "isrprofile.h"
+#include "tones.h"
+#include "clock.h"
+#include <util/atomic.h>
 
 // Most PWM variables are locally scoped
 
 const byte PWMInPinMask = PIN3_bm;
+const uint16_t inputCounterMask = 0x0FFF; // TCD0 is 12 bits
 
-volatile unsigned long PWMTimeOutMark = 0; // Records when to alert control timeout with millis()
+volatile unsigned long PWMLastPulse = 0; // clockMillis() of the last valid pulse
 const unsigned int PWMTimeOutPeriod = 1000; // Tolerated timeout for PWM waves in ms
 
-const unsigned int PWMPeriodMax = 2000; // Maximum expected PWM period
-const unsigned int PWMPeriodMin = 1000; // Minimum expected PWM period
+volatile pwmProtocolEnum pwmProtocol = pwmProtocolEnum::PWM_NONE;
+volatile uint16_t pwmPulseWidth = 0;
 
+/* Protocols
 
-void pwmInputSetup() {
+  Widths are in TCD0 counts (0.05 us). Pulses are accepted a little outside the nominal
+  range of each protocol (and clamped), the bands are far enough apart for this to be
+  unambiguous. The protocol is locked in after pwmDetectPulses pulses in a row fall in the 
+  same band, after which anything outside its band is ignored.
+
+  The endpoints used for throttle are calibrated (see calibratePWMInput()), the scale
+  factors turn a width past the minimum into duty (Q16) and are worked out when they change.
+
+  TCD0 only counts to 4096, so it is slowed down for the longer protocols to fit a whole
+  pulse in its range (the width is then shifted up to 0.05 us). Until the protocol is
+  known it runs at the speed for standard PWM, 0.8 us a count is still enough to tell
+  Multishot from the others. Once locked in it is set to the speed for the protocol.
+*/
+const uint16_t pwmAcceptMin[pwmProtocolCount] = {0, 900 * 20, 115 * 20, 4 * 20};
+const uint16_t pwmAcceptMax[pwmProtocolCount] = {0, 2100 * 20, 265 * 20, 27 * 20};
+const uint16_t pwmNominalMin[pwmProtocolCount] = {0, 1000 * 20, 125 * 20, 5 * 20};
+const uint16_t pwmNominalMax[pwmProtocolCount] = {0, 2000 * 20, 250 * 20, 25 * 20};
+uint16_t pwmWidthMin[pwmProtocolCount];
+uint16_t pwmWidthMax[pwmProtocolCount];
+uint32_t pwmDutyScale[pwmProtocolCount];
+
+// TCD0 prescaler for each (wraps after 3.3 ms, 410 us or 205 us), and the shift from its counts to 0.05 us
+const byte pwmCapturePrescaler[pwmProtocolCount] = {TCD_SYNCPRES_DIV4_gc | TCD_CNTPRES_DIV4_gc, TCD_SYNCPRES_DIV4_gc | TCD_CNTPRES_DIV4_gc,
+                                                    TCD_SYNCPRES_DIV2_gc | TCD_CNTPRES_DIV1_gc, TCD_SYNCPRES_DIV1_gc | TCD_CNTPRES_DIV1_gc};
+const byte pwmCaptureShift[pwmProtocolCount] = {4, 4, 1, 0};
+byte pwmShift = 0;                  // Shift for TCD0's current speed
+unsigned int pwmCaptureRange = 0;   // Time TCD0 takes to wrap at its current speed (us)
+
+const byte pwmDetectPulses = 10;
+const unsigned int pwmFullScaleRPM = 30000; // Target RPM at full throttle in the RPM control scheme
+byte pwmCandidate = pwmProtocolEnum::PWM_NONE; // Band the recent pulses fell in
+byte pwmCandidateCount = 0;
+
+// Rising edge of the pulse being measured
+uint16_t pwmRiseCapture = 0;
+unsigned long pwmRiseMicros = 0;  // clockMicros(), only to reject pulses too long to measure
+bool pwmRiseSeen = false;
+
+// Calibration
+const unsigned int pwmCalibrationStart = 2000;  // Time allowed for the protocol to be detected (ms)
+const unsigned int pwmCalibrationHold = 2000;   // Time full throttle is measured for (ms)
+const unsigned int pwmCalibrationTimeOut = 10000; // Time allowed to lower to minimum (ms)
+const unsigned int pwmCalibrationSettle = 1000; // Time minimum needs to be held (ms)
+
+void pwmPulse(uint16_t width);
+void applyPWMEndpoints();
+void setPWMCapture(byte protocol);
+uint16_t readPulseWidth();
+
+void inputCaptureSetup(byte prescaler) {
   PORTA.DIRCLR = PWMInPinMask; // Set to input
-  PORTA.PIN3CTRL = PORT_ISC_BOTHEDGES_gc; // Set interrupt on both edges
+  PORTA.PIN3CTRL = PORT_ISC_INTDISABLE_gc; // Event system takes the pin, no pin interrupt
+
+  // Rising edges capture to A, falling to B
+  EVSYS.ASYNCCH3 = EVSYS_ASYNCCH3_PORTA_PIN3_gc;
+  EVSYS.ASYNCUSER6 = EVSYS_ASYNCUSER6_ASYNCCH3_gc;
+  EVSYS.ASYNCUSER7 = EVSYS_ASYNCUSER7_ASYNCCH3_gc;
+
+  // Most of TCD0's set up can only be written while it is stopped
+  TCD0.CTRLA = 0;
+  while ((TCD0.STATUS & TCD_ENRDY_bm) == 0) {
+    // Wait for TCD0 to stop
+  }
+
+  TCD0.CTRLB = TCD_WGMODE_ONERAMP_gc;
+  TCD0.CMPBCLR = inputCounterMask; // Count through all 12 bits
+  TCD0.INPUTCTRLA = TCD_INPUTMODE_NONE_gc; // Events don't touch the (unused) outputs
+  TCD0.INPUTCTRLB = TCD_INPUTMODE_NONE_gc;
+  TCD0.EVCTRLA = TCD_CFG_ASYNC_gc | TCD_EDGE_RISE_HIGH_gc | TCD_ACTION_CAPTURE_gc | TCD_TRIGEI_bm;
+  TCD0.EVCTRLB = TCD_CFG_ASYNC_gc | TCD_EDGE_FALL_LOW_gc | TCD_ACTION_CAPTURE_gc | TCD_TRIGEI_bm;
+  TCD0.INTFLAGS = TCD_TRIGA_bm | TCD_TRIGB_bm; // Anything captured before is in the old counts
+  TCD0.INTCTRL = TCD_TRIGA_bm | TCD_TRIGB_bm;
+
+  while ((TCD0.STATUS & TCD_ENRDY_bm) == 0) {
+    // Wait for TCD0 to be ready to enable
+  }
+  TCD0.CTRLA = TCD_CLKSEL_20MHZ_gc | prescaler | TCD_ENABLE_bm;
 }
 
-// All interrupts on a port are handled by one interrupt
-ISR(PORTA_PORT_vect) {
+void pwmInputSetup() {
+  applyPWMEndpoints();
+  setPWMCapture(pwmProtocol);
+}
 
-  static unsigned long lastPWMRise = 0;
-  static unsigned long lastPWMFall = 0;
-  static unsigned int lastPWMDutyPeriod = 0;
+void setPWMCapture(byte protocol) {
+  pwmShift = pwmCaptureShift[protocol];
+  pwmCaptureRange = (uint32_t(inputCounterMask + 1) << pwmShift) / 20; // 20 counts a microsecond undivided
+  pwmRiseSeen = false;
+  inputCaptureSetup(pwmCapturePrescaler[protocol]);
+}
 
-  unsigned long currentMicros = micros(); // Record micros at start
-  unsigned int temp = 0;
+void applyPWMEndpoints() {
+  // Loads the endpoints from the settings and works out the scale factors for them
+  for (byte i = 1; i < pwmProtocolCount; i++) {
+    uint16_t newMin = settings.pwmWidthMin[i - 1];
+    uint16_t newMax = settings.pwmWidthMax[i - 1];
 
-  // Check which edge occured based on current input state of pin
-  if ((PORTA.IN & PWMInPinMask) == 0) {
-    // Falling edge just occured
+    // Fall back on nominal if they don't make sense for the protocol
+    uint16_t nominalRange = pwmNominalMax[i] - pwmNominalMin[i];
+    if ((newMin < pwmAcceptMin[i]) || (newMax > pwmAcceptMax[i]) || (newMax <= newMin) || ((newMax - newMin) < (nominalRange / 2))) {
+      newMin = pwmNominalMin[i];
+      newMax = pwmNominalMax[i];
+    }
 
-    lastPWMDutyPeriod = currentMicros - lastPWMRise;
-    lastPWMFall = currentMicros;
+    uint16_t range = newMax - newMin;
+    uint32_t newScale = ((uint32_t(maxDuty) << 16) + range - 1) / range; // Rounded up so the top reaches maxDuty
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      pwmWidthMin[i] = newMin;
+      pwmWidthMax[i] = newMax;
+      pwmDutyScale[i] = newScale;
+    }
+  }
+}
+
+uint16_t readPulseWidth() {
+  uint16_t width;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    width = pwmPulseWidth;
+  }
+  return width;
+}
+
+bool calibratePWMInput() {
+  // Wait to see what protocol is in use
+  unsigned long startTime = clockMillis();
+  while ((pwmProtocol == pwmProtocolEnum::PWM_NONE) && ((clockMillis() - startTime) < pwmCalibrationStart)) {
+    delay(10); // Wait for pulses
+  }
+  if (pwmProtocol == pwmProtocolEnum::PWM_NONE) return false;
 
-    // Use this period to control the motor
-    temp = constrain(lastPWMDutyPeriod, PWMPeriodMin, PWMPeriodMax);
-    temp = map(temp, PWMPeriodMin, PWMPeriodMax, 0, maxDuty);
+  // Only calibrate if the input starts in the top tenth of the nominal range
+  byte protocol = pwmProtocol;
+  uint16_t nominalRange = pwmNominalMax[protocol] - pwmNominalMin[protocol];
+  uint16_t highThreshold = pwmNominalMax[protocol] - (nominalRange / 10);
+  uint16_t lowThreshold = pwmNominalMin[protocol] + (nominalRange / 10);
+  if (readPulseWidth() < highThreshold) return false;
 
-    setPWMDuty(temp);
+#ifdef UART_COMMS_DEBUG
+  Serial.println("Throttle calibration started, measuring maximum.");
+#endif
 
+  // Measure the maximum
+  uint16_t newMax = 0;
+  startTime = clockMillis();
+  while ((clockMillis() - startTime) < pwmCalibrationHold) {
+    uint16_t width = readPulseWidth();
+    if (width < highThreshold) return false; // Dropped too early, abandon
+    newMax = max(newMax, width);
+    delay(1);
   }
-  else {
-    // Rising edge just happened
-    lastPWMRise = currentMicros;
+  queueTone(500, 200); // One beep to lower the throttle
 
-    PWMTimeOutMark = millis() + PWMTimeOutPeriod; // Record next timeout threshold
+  // Wait for the minimum, which needs to be held
+  uint16_t newMin = 0xFFFF;
+  unsigned long lowSince = 0;
+  startTime = clockMillis();
+  while ((clockMillis() - startTime) < pwmCalibrationTimeOut) {
+    delay(1);
+    uint16_t width = readPulseWidth();
+
+    if (width > lowThreshold) {
+      lowSince = 0;
+      newMin = 0xFFFF;
+      continue;
+    }
+
+    if (lowSince == 0) lowSince = clockMillis();
+    newMin = min(newMin, width);
+    if ((clockMillis() - lowSince) >= pwmCalibrationSettle) break;
   }
+  if ((lowSince == 0) || ((clockMillis() - lowSince) < pwmCalibrationSettle)) return false;
+
+  // Keep the new endpoints
+  settings.pwmWidthMin[protocol - 1] = newMin;
+  settings.pwmWidthMax[protocol - 1] = newMax;
+  saveSettings();
+  applyPWMEndpoints();
 
-  
-  PORTA.INTFLAGS = PWMInPinMask; // Clear interrupt at completion
+#ifdef UART_COMMS_DEBUG
+  Serial.printf("Throttle calibrated from %u to %u (0.05 us)\n", newMin, newMax);
+#endif
+
+  queueTone(500, 200); // Two beeps when done
+  queueTone(0, 200);
+  queueTone(500, 200);
+  return true;
 }
 
-bool checkPWMTimeOut() {
-  bool timedOut = false;
-
-  // Check for time out
-  if (millis() > PWMTimeOutMark) {
-    
-    // Check it is not 0, since we may not have recieved first signal yet
-    if (PWMTimeOutMark != 0) {
-      timedOut = true;
+#ifndef USE_DSHOT_CONTROL
+ISR(TCD0_TRIG_vect) {
+#ifdef PROFILE_ISRS
+  isrProfileScope profile(isrProfileEnum::ISR_INPUT);
+#endif
+  byte flags = TCD0.INTFLAGS & (TCD_TRIGA_bm | TCD_TRIGB_bm);
+  uint16_t rise = TCD0.CAPTUREA;
+  uint16_t fall = TCD0.CAPTUREB;
+  unsigned long now = clockMicros();
+  TCD0.INTFLAGS = flags;
+
+  // A pulse shorter than the interrupt latency (e.g. Multishot) has both edges waiting
+  // Rising edge is handled first unless the falling edge came before it (end of the last pulse)
+  bool fallFirst = ((fall - pwmRiseCapture) & inputCounterMask) < ((rise - pwmRiseCapture) & inputCounterMask);
+
+  for (byte i = 0; i < 2; i++) {
+    if ((flags & TCD_TRIGA_bm) && !((flags & TCD_TRIGB_bm) && fallFirst)) {
+      // Rising edge
+      flags &= ~TCD_TRIGA_bm;
+      pwmRiseCapture = rise;
+      pwmRiseMicros = now;
+      pwmRiseSeen = true;
+    }
+    else if (flags & TCD_TRIGB_bm) {
+      // Falling edge, complete pulse if its start was seen
+      flags &= ~TCD_TRIGB_bm;
+      if (pwmRiseSeen == false) continue;
+      pwmRiseSeen = false;
+
+      // TCD0 is slowed enough for a whole pulse to fit in its count, longer ones would wrap
+      // The clock can't measure them but can tell they were that long
+      if ((now - pwmRiseMicros) > pwmCaptureRange) continue;
+      uint16_t width = ((fall - pwmRiseCapture) & inputCounterMask) << pwmShift;
+
+      pwmPulse(width);
     }
   }
 
-  return timedOut;
+  // Protocol was just found, measure it at its own speed from the next pulse
+  if ((pwmProtocol != pwmProtocolEnum::PWM_NONE) && (pwmShift != pwmCaptureShift[pwmProtocol])) setPWMCapture(pwmProtocol);
+}
+#endif
+
+void pwmPulse(uint16_t width) {
+  // Find the band it is in
+  byte band = pwmProtocolEnum::PWM_NONE;
+  for (byte i = 1; i < pwmProtocolCount; i++) {
+    if ((width >= pwmAcceptMin[i]) && (width <= pwmAcceptMax[i])) band = i;
+  }
+
+  if (pwmProtocol == pwmProtocolEnum::PWM_NONE) {
+    // Still detecting, need a run of pulses in the same band
+    if ((band != pwmProtocolEnum::PWM_NONE) && (band == pwmCandidate)) pwmCandidateCount++;
+    else pwmCandidateCount = 1;
+    pwmCandidate = band;
+
+    if ((band == pwmProtocolEnum::PWM_NONE) || (pwmCandidateCount < pwmDetectPulses)) return;
+    pwmProtocol = pwmProtocolEnum(band);
+  }
+  else if (band != pwmProtocol) return; // Glitch or noise, ignore
+
+  pwmPulseWidth = width;
+  PWMLastPulse = clockMillis(); // Restart the time out
+
+  // Use this width to control the motor, as a duty or a target RPM depending on the control scheme
+  uint16_t temp = constrain(width, pwmWidthMin[band], pwmWidthMax[band]) - pwmWidthMin[band];
+  temp = min((temp * pwmDutyScale[band]) >> 16, maxDuty);
+
+  if (temp < minDuty) setPWMDuty(0, true); // Below the arming threshold is a stop in either scheme
+  else if (controlScheme == ctrlSchemeEnum::RPM) {
+    targetRPM = (uint32_t(temp) * pwmFullScaleRPM) / maxDuty;
+    if (motorStatus == false) setPWMDuty(minDuty + 1); // Duty controlTask() winds up with, the governor takes it from there
+  }
+  else setPWMDuty(temp);
 }
 
-/* TODO: Add code to calibrate it to a device's period if it isn't perfectly between 1 and 2 ms
-      - Will definitely need to use EEPROM to store these values between boots
-*/
\ No newline at end of file
+bool checkPWMTimeOut() {
+  // Can't time out before the first signal
+  if (pwmProtocol == pwmProtocolEnum::PWM_NONE) return false;
+
+  unsigned long lastPulse;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    lastPulse = PWMLastPulse;
+  }
+
+  // Compared as a difference so it works when the clock wraps
+  return (clockMillis() - lastPulse) > PWMTimeOutPeriod;
+}
@@ -3,15 +3,47 @@
 
 #include <Arduino.h>
 
+// Throttle input on PA3. Only one can be used, both capture the pin's edges with TCD0
+//#define USE_DSHOT_CONTROL // Use DShot150 instead of PWM, can also be set in the build flags
+#ifndef USE_DSHOT_CONTROL
+#define USE_PWM_CONTROL     // Use PWM input (servo, OneShot125 or Multishot) for controlling speed
+#endif
+
+// Pulse protocols recognized, found from the widths of the first pulses recieved
+enum pwmProtocolEnum: byte {PWM_NONE = 0, PWM_STANDARD = 1, PWM_ONESHOT125 = 2, PWM_MULTISHOT = 3}; // None yet, 1-2 ms, 125-250 us, 5-25 us
+extern volatile pwmProtocolEnum pwmProtocol;
+const byte pwmProtocolCount = 4;
+extern const uint16_t pwmNominalMin[pwmProtocolCount]; // Nominal endpoints of each protocol (0.05 us)
+extern const uint16_t pwmNominalMax[pwmProtocolCount];
+
+extern volatile uint16_t pwmPulseWidth; // Last valid pulse width (0.05 us, a count of TCD0 undivided)
+
+const byte inputCaptureFullSpeed = TCD_SYNCPRES_DIV1_gc | TCD_CNTPRES_DIV1_gc; // TCD0 counting at 20 MHz
+
+/** @name inputCaptureSetup
+   *  @brief Sets up TCD0 to capture the input pin's edges through the event system. Rising edges go to CAPTUREA, falling edges to CAPTUREB.
+   *  @param prescaler TCD0's synchronizer and counter prescaler settings (TCD0.CTRLA), its 12 bits wrap every 4096 of these counts
+   *  @note TCD0 is stopped while it is set up, so edges during it are missed
+   */
+void inputCaptureSetup(byte prescaler);
+
 /** @name pwmInputSetup
-   *  @brief Sets up PWM input pin to operate
+   *  @brief Sets up PWM input pin to operate, using the endpoints from the settings
+   *  @note Settings need to be loaded first
    */
 void pwmInputSetup();
 
+/** @name calibratePWMInput
+   *  @brief Calibrates the throttle endpoints if the input is at full throttle. Blocks until done, for use in setup.
+   *  @note Full throttle is held until a beep, then the input is lowered to minimum until two beeps. The endpoints are then saved.
+   *  @return Returns true if new endpoints were saved
+   */
+bool calibratePWMInput();
+
 /** @name checkPWMTimeOut
   * @brief Checks if the PWM input has timed out (not been detected in a set period)
   * @return Returns true if PWM has timed out
   * */   
 bool checkPWMTimeOut();
 
-#endif
\ No newline at end of file
+#endif
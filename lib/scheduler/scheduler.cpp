@@ -0,0 +1,91 @@
+#include "scheduler.h"
+
+const schedulerTask *schedulerTasks = nullptr;
+byte schedulerTaskCount = 0;
+schedulerStats taskStats[schedulerMaxTasks];
+
+unsigned int schedulerLoad = 0;
+unsigned long loadWindowStart = 0;  // clockMicros() at the start of the current window
+unsigned long busyMicros = 0;       // Time spent running tasks in the current window
+
+// Adds to a count, stopping at its maximum
+inline void saturatingAdd(unsigned int &count, unsigned long amount) {
+  if (amount > (0xFFFFU - count)) count = 0xFFFF;
+  else count += amount;
+}
+
+void schedulerSetup(const schedulerTask *tasks, byte count) {
+  schedulerTasks = tasks;
+  schedulerTaskCount = min(count, schedulerMaxTasks);
+
+  unsigned long now = clockMicros();
+  for (byte i = 0; i < schedulerTaskCount; i++) taskStats[i].due = now;
+
+  resetSchedulerStats();
+}
+
+void runScheduler() {
+  for (byte i = 0; i < schedulerTaskCount; i++) {
+    const schedulerTask &task = schedulerTasks[i];
+    schedulerStats &stats = taskStats[i];
+
+    unsigned long start = clockMicros();
+    unsigned long late = 0;
+
+    if (task.period != 0) {
+      if (long(start - stats.due) < 0) continue; // Not due yet
+
+      late = start - stats.due;
+      if (late >= task.period) {
+        // A whole period behind, carry on from now rather than running it back to back
+        saturatingAdd(stats.skipped, late / task.period);
+        stats.due = start + task.period;
+      }
+      else stats.due += task.period;
+    }
+
+    task.run();
+
+    unsigned long runTime = clockMicros() - start;
+    busyMicros += runTime;
+
+    if (stats.runs != 0xFFFFFFFF) stats.runs++;
+    if ((late + runTime) > task.deadline) saturatingAdd(stats.overruns, 1);
+    if (runTime > stats.longestRun) stats.longestRun = min(runTime, 0xFFFFUL);
+    if (late > stats.latestStart) stats.latestStart = min(late, 0xFFFFUL);
+  }
+
+  // Load over the last window
+  unsigned long window = clockMicros() - loadWindowStart;
+  if (window >= schedulerLoadWindow) {
+    schedulerLoad = min(busyMicros, window) / (window / 1000);
+    loadWindowStart += window;
+    busyMicros = 0;
+  }
+}
+
+void resetSchedulerStats() {
+  for (byte i = 0; i < schedulerTaskCount; i++) {
+    schedulerStats &stats = taskStats[i];
+    stats.runs = 0;
+    stats.overruns = 0;
+    stats.skipped = 0;
+    stats.longestRun = 0;
+    stats.latestStart = 0;
+  }
+
+  schedulerLoad = 0;
+  loadWindowStart = clockMicros();
+  busyMicros = 0;
+}
+
+void printSchedulerStats() {
+  for (byte i = 0; i < schedulerTaskCount; i++) {
+    const schedulerStats &stats = taskStats[i];
+
+    // Times in us
+    Serial.printf("%s - runs: %lu, overruns: %u, skipped: %u, longest run: %u, latest start: %u\n", schedulerTasks[i].name,
+                  stats.runs, stats.overruns, stats.skipped, stats.longestRun, stats.latestStart);
+  }
+  Serial.printf("Load: %u.%u%%\n", schedulerLoad / 10, schedulerLoad % 10);
+}
@@ -0,0 +1,75 @@
+#ifndef ESC_SCHEDULER_HEADER
+#define ESC_SCHEDULER_HEADER
+
+#include <Arduino.h>
+#include "clock.h"
+
+/* Scheduler
+
+  loop() runs a fixed table of tasks, each at its own period, rather than calling
+  everything every pass. Tasks run to completion one after another, anything time
+  critical is left to the interrupts.
+
+  Time is kept with clockMicros() (in steps of about 30.5 us) and only ever compared as
+  the difference from an earlier reading, so nothing breaks when it wraps (every 71
+  minutes) as long as periods and deadlines are well under half of that. A task is next due a period after it was last
+  due rather than after it last ran, so it doesn't drift. If it falls a whole period
+  behind the missed runs are skipped (and counted) and it carries on from now. A period
+  of zero runs the task every pass.
+
+  Each task has a deadline, the time after becoming due it should have finished by, and
+  runs that finish later are counted as overruns. The longest run and latest start are
+  kept too. Time not spent in a task is idle, the share of each second spent running
+  tasks is kept as the load so the headroom left for more work is known.
+
+  Counts stop once they reach their maximum.
+*/
+
+struct schedulerTask {
+  const char *name;
+  void (*run)();
+  unsigned long period;     // Time between runs (us), 0 to run every pass
+  unsigned long deadline;   // Time after being due it should be done by (us)
+};
+
+struct schedulerStats {
+  unsigned long due;        // clockMicros() when it is next due
+  unsigned long runs;
+  unsigned int overruns;    // Runs finished past the deadline
+  unsigned int skipped;     // Runs missed from falling a whole period behind
+  unsigned int longestRun;  // (us)
+  unsigned int latestStart; // Most a run started after being due (us)
+};
+
+const byte schedulerMaxTasks = 8;
+const unsigned long schedulerLoadWindow = 1000000; // Time the load is measured over (us)
+
+extern unsigned int schedulerLoad; // Share of the last window spent running tasks (tenths of a percent)
+
+////////////////////////////////////////////////////////////
+// Function declarations
+
+/** @name schedulerSetup
+   *  @brief Sets the tasks to be run, all are due straight away
+   *  @param tasks Table of tasks, in the order they are checked each pass
+   *  @param count Number of tasks, anything past schedulerMaxTasks is left out
+   */
+void schedulerSetup(const schedulerTask *tasks, byte count);
+
+/** @name runScheduler
+   *  @brief Runs any tasks that are due, one pass through the table
+   *  @note Should be all loop() does
+   */
+void runScheduler();
+
+/** @name resetSchedulerStats
+   *  @brief Clears the statistics of all the tasks and the load
+   */
+void resetSchedulerStats();
+
+/** @name printSchedulerStats
+   *  @brief Prints the statistics of all the tasks and the load over UART
+   */
+void printSchedulerStats();
+
+#endif
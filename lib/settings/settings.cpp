@@ -0,0 +1,47 @@
+#include "settings.h"
+#include <EEPROM.h>
+#include <stddef.h>
+#include <util/crc16.h>
+#include "pwmin.h"
+#include "uartcomms.h"
+
+const int settingsAddress = 0; // Start of the block in EEPROM
+
+escSettings settings;
+
+byte settingsCRC(const escSettings &toCheck) {
+  // CRC of everything before the CRC itself
+  const byte *bytes = (const byte *)&toCheck;
+  byte crc = 0;
+  for (byte i = 0; i < offsetof(escSettings, crc); i++) crc = _crc8_ccitt_update(crc, bytes[i]);
+  return crc;
+}
+
+bool loadSettings() {
+  EEPROM.get(settingsAddress, settings);
+
+  if ((settings.version == settingsVersion) && (settings.crc == settingsCRC(settings))) return true;
+
+#ifdef UART_COMMS_DEBUG
+  Serial.println("Stored settings invalid, using defaults.");
+#endif
+
+  resetSettings();
+  return false;
+}
+
+void saveSettings() {
+  settings.version = settingsVersion;
+  settings.crc = settingsCRC(settings);
+  EEPROM.put(settingsAddress, settings);
+}
+
+void resetSettings() {
+  settings.version = settingsVersion;
+  settings.dshotReversed = false;
+
+  for (byte i = 0; i < settingsPWMProtocols; i++) {
+    settings.pwmWidthMin[i] = pwmNominalMin[i + 1];
+    settings.pwmWidthMax[i] = pwmNominalMax[i + 1];
+  }
+}
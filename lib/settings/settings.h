@@ -0,0 +1,42 @@
+#ifndef ESC_SETTINGS_HEADER
+#define ESC_SETTINGS_HEADER
+
+#include <Arduino.h>
+
+/* Settings kept in EEPROM between boots
+
+  Stored as one block with a version and a CRC-8 at the end. If either doesn't match
+  when loaded (blank EEPROM, corrupted, or from an older layout) the defaults are used.
+  Bump settingsVersion whenever escSettings changes.
+*/
+
+const byte settingsVersion = 1;
+const byte settingsPWMProtocols = 3; // Standard, OneShot125, Multishot (pwmProtocolEnum less one)
+
+struct escSettings {
+  byte version;
+  bool dshotReversed;                         // Spin direction set by DShot command, relative to the pad
+  uint16_t pwmWidthMin[settingsPWMProtocols]; // Calibrated PWM endpoints (0.05 us units) for each protocol
+  uint16_t pwmWidthMax[settingsPWMProtocols];
+  byte crc;
+};
+
+extern escSettings settings;
+
+/** @name loadSettings
+   *  @brief Loads the settings from EEPROM, resetting them to defaults if invalid
+   *  @return Returns true if the stored settings were valid
+   */
+bool loadSettings();
+
+/** @name saveSettings
+   *  @brief Saves the current settings to EEPROM. Only changed bytes are written.
+   */
+void saveSettings();
+
+/** @name resetSettings
+   *  @brief Sets all settings to their defaults, does not save them
+   */
+void resetSettings();
+
+#endif
@@ -0,0 +1,231 @@
+#include "tones.h"
+#include <util/atomic.h>
+#include "motor.h"
+#include "clock.h"
+
+// Note period limits (microseconds)
+const unsigned int maxTonePeriod = 2000;
+const unsigned int minTonePeriod = 200;
+
+const unsigned int toneHoldOn = 100;      // Time a phase is pulsed for (TCB ticks, 10us)
+const unsigned int toneRestTicks = 10000; // Rests are counted out in milliseconds (TCB ticks)
+
+const unsigned long beaconDelay = 30000;  // Idle time before the beacon starts (ms)
+const unsigned int beaconInterval = 4000; // Time between beacons (ms)
+
+struct toneNote {
+  unsigned int periodMicros;    // 0 for a rest
+  unsigned int durationMillis;
+};
+
+struct melody {
+  const toneNote *notes;
+  byte length;
+};
+
+const toneNote startupNotes[] = {{1000, 300}, {800, 300}, {640, 400}};
+const toneNote armedNotes[] = {{500, 100}, {0, 100}, {500, 100}};
+const toneNote errorNotes[] = {{1500, 300}, {0, 100}, {2000, 600}};
+const toneNote beaconNotes[] = {{300, 200}, {0, 150}, {300, 200}};
+
+const melody melodies[melodyCount] = {
+  {startupNotes, 3},
+  {armedNotes, 3},
+  {errorNotes, 3},
+  {beaconNotes, 3}
+};
+
+/* Queue
+
+  A ring of notes already converted to what TCB1 needs: the ticks to wait between
+  pulses and how many pulses (half periods) make up the duration. Doing that when
+  queueing keeps the divisions out of the interrupt.
+
+  Adding is done with interrupts held off so notes can come from loop() or interrupts
+  (e.g. the spin up giving up), only tonesTimer() takes from the tail.
+*/
+struct queuedTone {
+  uint16_t holdOff;   // TCB ticks from the end of one pulse to the start of the next, or of each millisecond of a rest
+  uint32_t count;     // Pulses (half periods) or milliseconds of rest
+  bool rest;
+};
+
+const byte toneQueueLength = 8;
+queuedTone toneQueue[toneQueueLength];
+volatile byte toneHead = 0;   // Where the next note goes
+volatile byte toneTail = 0;   // Next note to play
+
+// Note being played, only used in the interrupt once playing
+volatile bool tonesActive = false; // TCB1 is being used for tones
+uint16_t toneHoldOff = 0;
+uint32_t toneCountLeft = 0;
+bool toneRest = false;
+bool tonePulseOn = false;
+bool toneSecondPhase = false;      // Alternates the low side pulsed each half period
+
+// Beacon
+unsigned long beaconIdleSince = 0;
+unsigned long lastBeacon = 0;
+
+// Function Prototypes
+bool addTone(unsigned int periodMicros, unsigned int durationMillis); // Adds to the queue, interrupts need to be off
+void startTones();  // Takes over TCB1 to start playing, interrupts need to be off
+
+
+bool queueTone(unsigned int periodMicros, unsigned int durationMillis) {
+  bool queued = false;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (motorStatus == false) {
+      queued = addTone(periodMicros, durationMillis);
+      if (queued) startTones();
+    }
+  }
+  return queued;
+}
+
+bool playMelody(melodyEnum melody) {
+  if (melody >= melodyCount) return false;
+  const toneNote *notes = melodies[melody].notes;
+  byte length = melodies[melody].length;
+
+  bool queued = false;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    byte free = (toneTail - toneHead - 1 + toneQueueLength) % toneQueueLength;
+
+    // All or nothing, half a melody would be confusing
+    if ((motorStatus == false) && (free >= length)) {
+      for (byte i = 0; i < length; i++) addTone(notes[i].periodMicros, notes[i].durationMillis);
+      startTones();
+      queued = true;
+    }
+  }
+  return queued;
+}
+
+bool addTone(unsigned int periodMicros, unsigned int durationMillis) {
+  byte next = (toneHead + 1) % toneQueueLength;
+  if (next == toneTail) return false; // Full
+
+  queuedTone &tone = toneQueue[toneHead];
+  tone.rest = (periodMicros == 0);
+
+  if (tone.rest) {
+    tone.holdOff = toneRestTicks;
+    tone.count = durationMillis;
+  }
+  else {
+    periodMicros = constrain(periodMicros, minTonePeriod, maxTonePeriod);
+
+    unsigned int halfPeriod = periodMicros / 2;
+    tone.holdOff = (halfPeriod * 10) - toneHoldOn;
+    tone.count = (uint32_t(durationMillis) * 1000) / halfPeriod;
+  }
+
+  toneHead = next;
+  return true;
+}
+
+void startTones() {
+  if (tonesActive) return; // Will get to the new notes after the current
+
+  allLow(); // Start with nothing driven
+
+  toneCountLeft = 0;
+  tonePulseOn = false;
+  tonesActive = true;
+
+  // Periodic interrupt from TCB1, the first loads the note
+  setTCB1Mode(TCB_CNTMODE_INT_gc);
+  TCB1.EVCTRL = 0;
+  TCB1.CCMP = toneHoldOn;
+  TCB1.CNT = 0;
+  TCB1.INTFLAGS = TCB_CAPT_bm;
+  TCB1.INTCTRL = TCB_CAPT_bm;
+}
+
+void stopTones() {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (tonesActive) {
+      TCB1.INTCTRL = 0;
+      allLow();
+      tonesActive = false;
+    }
+    toneTail = toneHead;
+  }
+}
+
+bool tonesPlaying() {
+  return tonesActive;
+}
+
+/* Playing
+
+  Each half period one phase is pulsed high (AH) against a low side for toneHoldOn,
+  then everything is pulled low for the rest of it. The low side alternates between
+  BL and CL so the rotor is pulled back and forth about the same spot rather than
+  being turned. TCB1's compare value is changed each interrupt to the time to the next.
+*/
+void tonesTimer() {
+  if (tonePulseOn) {
+    // End of a pulse
+    allLow();
+    tonePulseOn = false;
+    TCB1.CCMP = toneHoldOff;
+    return;
+  }
+
+  if (toneCountLeft == 0) {
+    if (toneTail == toneHead) {
+      // Nothing left to play, hand TCB1 back
+      TCB1.INTCTRL = 0;
+      allLow();
+      tonesActive = false;
+      return;
+    }
+
+    const queuedTone &tone = toneQueue[toneTail];
+    toneHoldOff = tone.holdOff;
+    toneCountLeft = tone.count;
+    toneRest = tone.rest;
+    toneTail = (toneTail + 1) % toneQueueLength;
+
+    if (toneCountLeft == 0) {
+      TCB1.CCMP = toneHoldOn; // Nothing to it, move on to the next
+      return;
+    }
+  }
+
+  toneCountLeft--;
+
+  if (toneRest) {
+    TCB1.CCMP = toneHoldOff;
+    return;
+  }
+
+  // Clear the state of all pins so only the phases of interest are driven
+  PORTC.OUTCLR = PIN3_bm | PIN4_bm;
+  PORTB.OUTCLR = PIN0_bm | PIN1_bm | PIN5_bm;
+  PORTA.OUTSET = PIN5_bm; // AH
+  PORTB.OUTSET = toneSecondPhase ? PIN0_bm : PIN1_bm; // CL or BL
+  toneSecondPhase = !toneSecondPhase;
+
+  tonePulseOn = true;
+  TCB1.CCMP = toneHoldOn;
+}
+
+void beaconCheck(bool idle) {
+  unsigned long now = clockMillis();
+
+  if (idle == false) {
+    beaconIdleSince = now;
+    return;
+  }
+
+  if ((now - beaconIdleSince) < beaconDelay) return;
+  if ((now - lastBeacon) < beaconInterval) return;
+  if (tonesActive) return; // Let anything else finish first
+
+  if (playMelody(MELODY_BEACON)) lastBeacon = now;
+}
@@ -0,0 +1,72 @@
+#ifndef ESC_TONES_HEADER
+#define ESC_TONES_HEADER
+
+#include <Arduino.h>
+
+/* Tones
+
+  The motor is used as a speaker by pulsing a phase for a few microseconds every half
+  period of the note. This used to be done with delays in a loop, stalling everything
+  else (even the I2C and PWM time out handling) for as long as it played.
+
+  Now notes are queued and played by TCB1, which has nothing to do while the motor is
+  stopped. It is put in periodic mode like during spin up and its interrupt alternates
+  between starting a pulse and ending it, so playing costs a couple of short interrupts
+  a period. Queued notes play back to back, a period of zero is a rest.
+
+  Tones only play while the motor is disabled, it would [greatly] suck if the drone
+  buzzed mid-flight. Starting the motor cuts off anything still playing.
+*/
+
+// Sequences of notes for letting the user know what is going on
+enum melodyEnum: byte {
+  MELODY_STARTUP = 0,   // Set up and ready
+  MELODY_ARMED = 1,     // Input is valid and the motor can be started
+  MELODY_ERROR = 2,     // Gave up starting the motor
+  MELODY_BEACON = 3     // Lost and looking to be found
+};
+const byte melodyCount = 4;
+
+////////////////////////////////////////////////////////////
+// Function declarations
+
+/** @name queueTone
+   *  @brief Adds a note to be played after any already queued. Safe to use from interrupts.
+   *  @param periodMicros Period of the note in microseconds, 0 for a rest
+   *  @param durationMillis Duration of the note in milliseconds
+   *  @return Returns false if the motor is enabled or the queue is full
+   */
+bool queueTone(unsigned int periodMicros, unsigned int durationMillis);
+
+/** @name playMelody
+   *  @brief Queues all the notes of a melody. Safe to use from interrupts.
+   *  @param melody Melody to play
+   *  @return Returns false if the motor is enabled or it didn't fit in the queue
+   */
+bool playMelody(melodyEnum melody);
+
+/** @name stopTones
+   *  @brief Stops playing and empties the queue, leaving the phases pulled low
+   */
+void stopTones();
+
+/** @name tonesPlaying
+   *  @brief Checks if anything is still playing (or queued)
+   *  @return Returns true while TCB1 is being used for tones
+   */
+bool tonesPlaying();
+
+/** @name tonesTimer
+   *  @brief Handles TCB1's interrupt while tones are playing
+   *  @note Only to be run from TCB1's interrupt, and only when the motor is stopped
+   */
+void tonesTimer();
+
+/** @name beaconCheck
+   *  @brief Plays the beacon every few seconds once the ESC has been idle a while, so a downed drone can be found
+   *  @param idle True while there is no signal (or nothing for the ESC to do)
+   *  @note Should be called every pass of the main control loop
+   */
+void beaconCheck(bool idle);
+
+#endif
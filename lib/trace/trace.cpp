@@ -0,0 +1,63 @@
+#include "trace.h"
+#include <util/atomic.h>
+
+volatile traceStateEnum traceState = traceStateEnum::TRACE_IDLE;
+
+traceEntry traceBuffer[traceLength];
+volatile byte traceHead = 0;
+volatile bool traceWrapped = false;
+volatile byte traceRejects = 0;
+volatile byte tracePending = 0;
+volatile byte traceRemaining = 0;
+
+void traceArm() {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    traceHead = 0;
+    traceWrapped = false;
+    traceRejects = 0;
+    tracePending = 0;
+    traceState = traceStateEnum::TRACE_ARMED;
+  }
+}
+
+void traceTrigger(byte after) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (traceState != traceStateEnum::TRACE_ARMED) {
+      // Already triggered or not recording
+    }
+    else if (after == 0) {
+      // No more steps are coming, mark the last one
+      if (traceCount() != 0) traceBuffer[(traceHead - 1) & (traceLength - 1)].stepFlags |= traceTriggerFlag_bm;
+      traceState = traceStateEnum::TRACE_DONE;
+    }
+    else {
+      tracePending = traceTriggerFlag_bm;
+      traceRemaining = after;
+      traceState = traceStateEnum::TRACE_TRIGGERED;
+    }
+  }
+}
+
+void traceStop() {
+  if (traceState != traceStateEnum::TRACE_IDLE) traceState = traceStateEnum::TRACE_DONE;
+}
+
+byte traceCount() {
+  return traceWrapped ? traceLength : traceHead;
+}
+
+byte traceRead(byte *dest, uint16_t offset, byte count) {
+  // Oldest entry is at the head once the buffer has wrapped, otherwise the start
+  const uint16_t traceBytes = traceLength * sizeof(traceEntry);
+  uint16_t validBytes = traceCount() * sizeof(traceEntry);
+  uint16_t start = traceWrapped ? (traceHead * sizeof(traceEntry)) : 0;
+
+  if (offset >= validBytes) return 0;
+  if (count > (validBytes - offset)) count = validBytes - offset;
+
+  const byte *source = (const byte *)traceBuffer;
+  for (byte i = 0; i < count; i++) {
+    dest[i] = source[(start + offset + i) % traceBytes];
+  }
+  return count;
+}
@@ -0,0 +1,104 @@
+#ifndef ESC_TRACE_HEADER
+#define ESC_TRACE_HEADER
+
+#include <Arduino.h>
+
+/* Commutation trace
+
+  A ring buffer of the most recent steps, recorded from the zero crossing interrupt so it
+  costs a few cycles per step. It only records once armed. Once triggered (by a desync, a
+  fault, or a command) it records tracePostTrigger more steps and then stops, so the
+  buffer holds what happened either side of the trigger until it is read out.
+
+  Each entry is four bytes, laid out as traceEntry and sent as is when dumped:
+    0   - Bits 0-2: step entered, bits 3-6: crossings rejected by the debounce since the
+          last step (saturates at 15), bit 7: trigger happened on this step
+    1   - Duty in effect
+    2-3 - Step interval in 0.8 us (TCB0 counts / 8), saturates at 65535. A word, low
+          byte first (little endian) unlike the registers
+*/
+
+struct traceEntry {
+  byte stepFlags;
+  byte duty;
+  uint16_t interval;
+};
+
+enum traceStateEnum: byte {TRACE_IDLE = 0, TRACE_ARMED = 1, TRACE_TRIGGERED = 2, TRACE_DONE = 3}; // Not recording, recording, recording until stopped, stopped
+extern volatile traceStateEnum traceState;
+
+const byte traceLength = 128;         // Entries kept, must be a power of two
+const byte tracePostTrigger = 32;     // Entries recorded after a trigger
+const byte traceTriggerFlag_bm = 0x80;
+const byte traceRejectsShift = 3;
+
+extern traceEntry traceBuffer[traceLength];
+extern volatile byte traceHead;       // Next entry to be written
+extern volatile bool traceWrapped;    // Buffer has filled at least once
+extern volatile byte traceRejects;    // Crossings rejected since the last entry
+extern volatile byte tracePending;    // Flags for the next entry
+extern volatile byte traceRemaining;  // Entries left to record once triggered
+
+/** @name traceArm
+   *  @brief Clears the trace and starts recording
+   */
+void traceArm();
+
+/** @name traceTrigger
+   *  @brief Marks the next step and stops recording once a number of steps follow it. Does nothing unless armed.
+   *  @param after Steps to record after the trigger. Zero marks the last step recorded and stops now, for when the motor is being stopped.
+   */
+void traceTrigger(byte after = tracePostTrigger);
+
+/** @name traceStop
+   *  @brief Stops recording straight away, keeping what was recorded
+   */
+void traceStop();
+
+/** @name traceCount
+   *  @brief Number of entries recorded
+   *  @return Entries that can be read, up to traceLength
+   */
+byte traceCount();
+
+/** @name traceRead
+   *  @brief Copies bytes of the trace out, oldest entry first
+   *  @param dest Where to copy to
+   *  @param offset Byte offset into the trace (entries are sizeof(traceEntry) bytes)
+   *  @param count Bytes to copy
+   *  @return Number of bytes copied, less than count at the end of the trace
+   *  @note Should be stopped or done first, otherwise entries may change while being read
+   */
+byte traceRead(byte *dest, uint16_t offset, byte count);
+
+/** @name traceStep
+   *  @brief Records a step. Called from the zero crossing interrupt.
+   *  @param step Step entered
+   *  @param interval Step interval in TCB0 counts
+   *  @param duty Duty in effect
+   */
+inline void traceStep(byte step, uint32_t interval, byte duty) {
+  if ((traceState != TRACE_ARMED) && (traceState != TRACE_TRIGGERED)) return;
+
+  traceEntry &entry = traceBuffer[traceHead];
+  entry.stepFlags = step | (min(traceRejects, 15) << traceRejectsShift) | tracePending;
+  entry.duty = duty;
+  interval >>= 3;
+  entry.interval = (interval > 0xFFFF) ? 0xFFFF : interval;
+
+  traceRejects = 0;
+  tracePending = 0;
+  traceHead = (traceHead + 1) & (traceLength - 1);
+  if (traceHead == 0) traceWrapped = true;
+
+  if ((traceState == TRACE_TRIGGERED) && (--traceRemaining == 0)) traceState = TRACE_DONE;
+}
+
+/** @name traceRejected
+   *  @brief Records a crossing rejected by the debounce. Called from the zero crossing interrupt.
+   */
+inline void traceRejected() {
+  if (traceRejects < 255) traceRejects++;
+}
+
+#endif
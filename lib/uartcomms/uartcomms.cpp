@@ -2,6 +2,10 @@
 
 #include "motor.h"
 #include "led.h"
+#include "trace.h"
+#include "isrprofile.h"
+#include "tones.h"
+#include "scheduler.h"
 
 const uint32_t UART_BAUDRATE = 115200;
 
@@ -78,7 +82,7 @@ void uartCommands() {
     // Number of cycles in a rotation
     if (Serial.available()) {
       Serial.read(); // Remove dash
-      cyclesPerRotation = Serial.parseInt();
+      setCyclesPerRotation(Serial.parseInt());
     }
     // Feedback
     Serial.printf("Cycles in a rotaion: %d (%d steps)\n", cyclesPerRotation, cyclesPerRotation * 6);      
@@ -125,7 +129,121 @@ void uartCommands() {
     
     Serial.printf("Buzzing with period of %d us for %d ms.\n", buzzPeriod, buzzDuration);
 
-    setToBuzz(buzzPeriod, buzzDuration);
+    queueTone(buzzPeriod, buzzDuration);
+  }
+  else if (currentUARTInstruction == 10) {
+    // Timing advance in quarter degrees, for all speeds
+    if (Serial.available()) {
+      Serial.read(); // Remove dash
+      setTimingAdvance(Serial.parseInt());
+    }
+    // Feedback
+    Serial.printf("Timing advance: %d quarter degrees\n", timingAdvance);
+  }
+  else if (currentUARTInstruction == 11) {
+    // Timing advance curve point
+    // Expects parameters split by a letter. E.g. 11a2a10000a40 sets point 2 to 10 degrees at 10000 RPM
+    
+    delay(100);
+
+    byte pointIndex = Serial.parseInt();
+    if (Serial.available()) {
+      unsigned int pointRPM = Serial.parseInt();
+      byte pointAdvance = Serial.parseInt();
+
+      if (setAdvanceCurvePoint(pointIndex, pointRPM, pointAdvance) == false) Serial.println("Invalid advance point.");
+    }
+
+    // Feedback
+    uint16_t pointRPM;
+    byte pointAdvance;
+    getAdvanceCurvePoint(pointIndex, pointRPM, pointAdvance);
+    Serial.printf("Advance point %d: %d quarter degrees at %u RPM\n", pointIndex, pointAdvance, pointRPM);
+  }
+  else if (currentUARTInstruction == 12) {
+    // Period filter (0 - raw, 1 - average of 6, 2 - average of 12, 3 - median of 3)
+    if (Serial.available()) {
+      Serial.read(); // Remove dash
+      setPeriodFilter(periodFilterEnum(Serial.parseInt()));
+    }
+    // Feedback
+    Serial.printf("Period filter: %d\n", periodFilter);
+  }
+  else if (currentUARTInstruction == 13) {
+    // Desync counts, cleared if followed by a dash
+    if (Serial.available()) clearDesyncCounts();
+
+    // Feedback
+    Serial.printf("Desyncs - Interval: %u, Timeout: %u, Missed: %u\n", desyncCounts[0], desyncCounts[1], desyncCounts[2]);
+  }
+  else if (currentUARTInstruction == 14) {
+    // Commutation trace (0 - stop, 1 - arm, 2 - trigger, 3 - dump)
+    // Dump is a line with the entry count, then the raw entries (see trace.h)
+    byte traceCommand = 255;
+    if (Serial.available()) {
+      Serial.read(); // Remove dash
+      traceCommand = Serial.parseInt();
+    }
+
+    if (traceCommand == 0) traceStop();
+    else if (traceCommand == 1) traceArm();
+    else if (traceCommand == 2) traceTrigger();
+    else if (traceCommand == 3) {
+      traceStop();
+      Serial.printf("Trace dump: %d entries\n", traceCount());
+
+      byte chunk[16];
+      uint16_t offset = 0;
+      byte count;
+      while ((count = traceRead(chunk, offset, sizeof(chunk))) != 0) {
+        for (byte i = 0; i < count; i++) Serial.write(chunk[i]);
+        offset += count;
+      }
+      Serial.println();
+    }
+
+    // Feedback
+    Serial.printf("Trace state: %d, %d entries\n", traceState, traceCount());
+  }
+  else if (currentUARTInstruction == 15) {
+    // Interrupt profiling statistics, cleared after printing if followed by a dash
+    printISRProfiles();
+    if (Serial.available()) resetISRProfiles();
+  }
+  else if (currentUARTInstruction == 16) {
+    // Task statistics and load of the main loop, cleared after printing if followed by a dash
+    printSchedulerStats();
+    if (Serial.available()) resetSchedulerStats();
+  }
+  else if (currentUARTInstruction == 17) {
+    // Duty ramp limits in counts per millisecond, 0 for no limit
+    // Expects parameters split by a letter. E.g. 17a2a4 ramps up by 2 and down by 4
+    
+    delay(100);
+
+    if (Serial.available()) {
+      byte rampUp = Serial.parseInt();
+      byte rampDown = Serial.parseInt();
+      setDutyRamp(rampUp, rampDown);
+    }
+
+    // Feedback
+    Serial.printf("Duty ramp up: %d, down: %d\n", dutyRampUp, dutyRampDown);
+  }
+  else if (currentUARTInstruction == 18) {
+    // RPM governor gains (Q16 duty counts per RPM of error)
+    // Expects parameters split by a letter. E.g. 18a200a60 sets the proportional gain to 200 and integral to 60
+    
+    delay(100);
+
+    if (Serial.available()) {
+      uint16_t gainP = Serial.parseInt();
+      uint16_t gainI = Serial.parseInt();
+      setRPMGains(gainP, gainI);
+    }
+
+    // Feedback
+    Serial.printf("Governor gains P: %u, I: %u\n", rpmGainP, rpmGainI);
   }
 
   // Clear buffer of any other fluff
@@ -5,45 +5,102 @@
 #include <uartcomms.h>
 #include <led.h>
 #include <pwmin.h>
-
-#define USE_PWM_CONTROL // Use PWM input for controlling speed
+#include <dshot.h>
+#include <settings.h>
+#include <trace.h>
+#include <eventlog.h>
+#include <benchmark.h>
+#include <tones.h>
+#include <scheduler.h>
+#include <clock.h>
 
 void emergencyStop(); // Declared here to be used in loop()
+#ifdef ALLOW_UART_COMMS
+void uartTask();      // Checks for commands over UART
+#endif
+void controlTask();   // Starts and stops the motor with the input signal
+
+// Everything loop() does, periods and deadlines in microseconds (see scheduler.h)
+const schedulerTask tasks[] = {
+#ifdef ALLOW_UART_COMMS
+  {"UART", uartTask, 10000, 200000},        // Commands wait for their parameters, so they are slow
+#endif
+  {"Event log", eventLogDrain, 0, 10000},   // Print debug messages queued by interrupts (only with UART_COMMS_DEBUG)
+  {"I2C", i2cCommands, 1000, 1000},         // Apply anything recieved over I2C
+  {"LED", nonBlockingLEDBlink, 5000, 5000},
+  {"Desync", checkDesync, 1000, 1000},      // Shortest desync time out is 5 ms
+  {"Duty ramp", runDutyRamp, 1000, 1000},   // Ramp limits are per millisecond
+  {"Control", controlTask, 1000, 1000}
+};
 
 
 
 void setup() {
+  clockSetup(); // Everything else may need the time
   LEDSetup(); // Set up LED first to indicate it is powered
 
 #ifdef ALLOW_UART_COMMS
   uartSetup(); // Needs to go first to allow potential printing of debugging statements
 #endif
 
+  loadSettings();
   setupMotor();
   i2cSetup();
 
-#ifdef USE_PWM_CONTROL
+#if defined(USE_DSHOT_CONTROL)
+  dshotSetup();
+#elif defined(USE_PWM_CONTROL)
   pwmInputSetup();
 #endif
   
   // Alert user set up is complete
   LEDBlinkBlocking(250, 20); // Lights before buzing to get code on before motor goes
-  buzz(1000,1000);
+  playMelody(MELODY_STARTUP); // Plays in the background
+
+#if !defined(USE_DSHOT_CONTROL) && defined(USE_PWM_CONTROL)
+  calibratePWMInput(); // Only does anything if the throttle is at full
+#endif
 
   LEDOn();
+
+  schedulerSetup(tasks, sizeof(tasks) / sizeof(tasks[0]));
+
+#ifdef BENCHMARK
+  runBenchmarks(); // Prints its report, the ESC needs a reset after
+  while (true) {
+    // Nothing else is run in a benchmark build
+  }
+#endif
 }
 
 void loop() {
+  runScheduler();
+}
 
 #ifdef ALLOW_UART_COMMS
-  delay(10); // Let messages arrive
-  if (Serial.available()) uartCommands(); // Check for commands over UART
+void uartTask() {
+  if (Serial.available()) {
+    delay(10); // Let the rest of the message arrive
+    uartCommands();
+  }
+}
 #endif
 
-  nonBlockingLEDBlink();
-  runInterruptBuzz();
-
-#ifdef USE_PWM_CONTROL
+// Starts and stops the motor with the input signal
+void controlTask() {
+#if defined(USE_DSHOT_CONTROL)
+  dshotCommands();
+  beaconCheck(dshotArmed == false); // Disarmed for a while means nothing is sending, the drone might be lost
+  if (checkDShotFailsafe() == true) {
+    // Stop, but keep listening so it can be rearmed
+    traceTrigger(0);
+    disableMotor();
+  }
+  else {
+    // Wind up once armed and given throttle
+    if ((motorStatus == false) && (dshotDuty >= minDuty)) enableMotor(dshotDuty);
+  }
+#elif defined(USE_PWM_CONTROL)
   if (checkPWMTimeOut() == true) {
     // If timed out 
     emergencyStop();
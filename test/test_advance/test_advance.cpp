@@ -0,0 +1,129 @@
+#include <unity.h>
+#include <bldc_sim.h>
+#include <motor.h>
+#include <tones.h>
+
+/* Timing advance
+
+  The simulated motor measures how far each commutation is from the ideal point (30 degrees
+  after the zero crossing) against the real rotor angle. Advancing the timing should move
+  that error earlier by the advance, so each speed is run without advance and then with
+  it, and the shift compared. Along the curve, the advance applied should also be the one
+  interpolated for the speed the motor is at.
+*/
+
+const unsigned long advStartTimeOut = 3000000; // (us)
+const unsigned long advSettleTime = 300000;    // Run after any change before measuring (us)
+const unsigned long advMeasureTime = 200000;   // (us)
+const double advShiftTolerance = 1.5;          // Electrical degrees the shift may be off by
+const byte advCurveTolerance = 2;              // Quarter degrees the applied advance may be off the curve by
+
+unsigned long desyncTotal() {
+  unsigned long total = 0;
+  for (byte i = 0; i < desyncCauseCount; i++) total += desyncCounts[i];
+  return total;
+}
+
+void startMotor(byte duty) {
+  clearDesyncCounts();
+  enableMotor(duty);
+
+  unsigned long taken = 0;
+  while ((spinUpState != spinUpStateEnum::RUNNING) && (taken < advStartTimeOut)) {
+    simRun(1000);
+    taken += 1000;
+  }
+  TEST_ASSERT_EQUAL_MESSAGE(spinUpStateEnum::RUNNING, spinUpState, "motor never started");
+}
+
+// Mean commutation timing error (electrical degrees late) once settled
+double measureTiming() {
+  simRun(advSettleTime);
+  simClearStatistics();
+  simRun(advMeasureTime);
+  TEST_ASSERT_NOT_EQUAL(0, simStats.commutations);
+  return simStats.timingErrorSum / simStats.commutations;
+}
+
+// Advance the curve gives for a speed, worked out separately from the firmware
+double curveAdvance(const uint16_t rpms[], const byte advances[], unsigned int rpm) {
+  if (rpm <= rpms[0]) return advances[0];
+  if (rpm >= rpms[advanceCurvePoints - 1]) return advances[advanceCurvePoints - 1];
+
+  byte i = 0;
+  while (rpm >= rpms[i + 1]) i++;
+  return advances[i] + (double(rpm) - rpms[i]) * (double(advances[i + 1]) - advances[i]) / (rpms[i + 1] - rpms[i]);
+}
+
+// Runs a duty without advance then with a fixed one, the timing should move earlier by it
+void checkFixedAdvance(byte duty, byte advance) {
+  setTimingAdvance(0);
+  startMotor(duty);
+  double baseline = measureTiming();
+
+  setTimingAdvance(advance);
+  double advanced = measureTiming();
+
+  TEST_ASSERT_EQUAL(advance, timingAdvance);
+  TEST_ASSERT_DOUBLE_WITHIN(advShiftTolerance, advance / 4.0, baseline - advanced);
+  TEST_ASSERT_EQUAL(0, desyncTotal());
+}
+
+void setUp() {
+  disableMotor();
+  setTimingAdvance(0);
+  simReset(simDefaultMotor);
+  simRun(10000);
+}
+
+void tearDown() {
+  disableMotor();
+  setTimingAdvance(0);
+}
+
+void test_fixed_advance_low_speed() {
+  checkFixedAdvance(60, 40); // 10 degrees
+}
+
+void test_fixed_advance_high_speed() {
+  checkFixedAdvance(200, 80); // 20 degrees
+}
+
+void test_full_advance() {
+  checkFixedAdvance(120, maxTimingAdvance);
+}
+
+// Advance rising with speed, checked at a few duties along it
+void test_curve_follows_speed() {
+  const uint16_t rpms[advanceCurvePoints] = {0, 6000, 12000, 20000};
+  const byte advances[advanceCurvePoints] = {0, 20, 60, 100};
+  const byte duties[] = {60, 100, 160, 240};
+
+  // Each is below the next of the default points, so setting them in order keeps the RPMs ascending
+  for (byte i = 0; i < advanceCurvePoints; i++) TEST_ASSERT_TRUE(setAdvanceCurvePoint(i, rpms[i], advances[i]));
+
+  startMotor(duties[0]);
+  byte lastAdvance = 0;
+  for (byte i = 0; i < sizeof(duties); i++) {
+    setPWMDuty(duties[i]);
+    measureTiming();
+
+    double expected = curveAdvance(rpms, advances, getCurrentRPM());
+    TEST_ASSERT_DOUBLE_WITHIN(advCurveTolerance, expected, timingAdvance);
+    TEST_ASSERT_TRUE(timingAdvance >= lastAdvance); // Faster each time, so never less advance
+    lastAdvance = timingAdvance;
+  }
+  TEST_ASSERT_EQUAL(0, desyncTotal());
+}
+
+int main() {
+  setup();
+  stopTones(); // Pulses of the startup melody would nudge the rotor
+
+  UNITY_BEGIN();
+  RUN_TEST(test_fixed_advance_low_speed);
+  RUN_TEST(test_fixed_advance_high_speed);
+  RUN_TEST(test_full_advance);
+  RUN_TEST(test_curve_follows_speed);
+  return UNITY_END();
+}
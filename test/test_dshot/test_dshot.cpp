@@ -0,0 +1,311 @@
+#include <unity.h>
+#include <native_hal.h>
+#include <dshot.h>
+#include <motor.h>
+#include <tones.h>
+
+/* DShot input
+
+  Built with USE_DSHOT_CONTROL (the native_dshot environment) so TCD0's interrupt is the
+  DShot decoder. Frames are sent as the edges TCD0 would capture, so the whole path is
+  checked: splitting the bits out by their high times, the rate check, the CRC, then
+  throttle scaling, which values are commands, arming and the failsafe.
+*/
+
+const uint16_t tcdMask = 0x0FFF;              // TCD0 is 12 bits, counting at 20 MHz for DShot
+const uint16_t dshot150Period3 = 400;         // Three bit periods of DShot150 (6.67 us each, TCD0 counts)
+const uint16_t dshot300Period3 = 200;
+const uint16_t frameGap = 400;                // Between the end of one frame and the next (20 us)
+const unsigned int dshotZeroFramesToArm = 101; // Counted up to dshotArmFrames, armed by the next
+const byte dshotBadFramesToFailsafe = 20;
+const unsigned long dshotTimeOut = 100;       // (ms)
+
+uint16_t frameStart = 0; // TCD0 count the next frame starts at
+
+uint16_t makeFrame(uint16_t value, bool telemetry) {
+  uint16_t data = (value << 1) | telemetry;
+  uint16_t crc = (data ^ (data >> 4) ^ (data >> 8)) & 0x0F;
+  return (data << 4) | crc;
+}
+
+// Sends a frame as its rising and falling edges, a "1" is high for 75% of the bit and a "0" 37.5%
+// With late set the interrupt is held off until both edges of each bit are captured
+void sendFrame(uint16_t frame, uint16_t period3 = dshot150Period3, bool late = false) {
+  for (byte i = 0; i < 16; i++) {
+    uint16_t rise = frameStart + ((i * period3) / 3);
+    uint16_t high = (frame & (0x8000 >> i)) ? (period3 / 4) : (period3 / 8);
+
+    if (late) cli();
+    nativeTCDCapture(false, rise & tcdMask);
+    nativeTCDCapture(true, (rise + high) & tcdMask);
+    if (late) {
+      sei();
+      TCD0_TRIG_vect();
+    }
+  }
+  frameStart += ((16 * period3) / 3) + frameGap;
+}
+
+void sendValue(uint16_t value, bool telemetry = false) {
+  sendFrame(makeFrame(value, telemetry));
+}
+
+void arm() {
+  for (unsigned int i = 0; i < dshotZeroFramesToArm; i++) sendValue(0);
+  TEST_ASSERT_TRUE(dshotArmed);
+}
+
+void setUp() {
+  dshotDisarm();
+  dshotCommands(); // Catch up with being disarmed
+  stopTones();
+}
+
+void tearDown() {
+  stopTones();
+}
+
+void test_decode_known_frames() {
+  uint16_t value;
+  bool telemetry;
+
+  TEST_ASSERT_TRUE(dshotDecodeFrame(0x82C6, value, telemetry)); // Throttle 1046
+  TEST_ASSERT_EQUAL(1046, value);
+  TEST_ASSERT_FALSE(telemetry);
+
+  TEST_ASSERT_TRUE(dshotDecodeFrame(0x0000, value, telemetry)); // Stop
+  TEST_ASSERT_EQUAL(0, value);
+
+  TEST_ASSERT_TRUE(dshotDecodeFrame(0xFFFF, value, telemetry)); // Full throttle, telemetry requested
+  TEST_ASSERT_EQUAL(dshotThrottleMax, value);
+  TEST_ASSERT_TRUE(telemetry);
+}
+
+void test_decode_rejects_bad_crc() {
+  uint16_t value;
+  bool telemetry;
+
+  for (uint16_t throttle = 0; throttle <= dshotThrottleMax; throttle += 89) {
+    uint16_t frame = makeFrame(throttle, throttle & 1);
+    TEST_ASSERT_TRUE(dshotDecodeFrame(frame, value, telemetry));
+
+    // Any single bit flipped, in the data or the CRC, must fail
+    for (byte bit = 0; bit < 16; bit++) {
+      TEST_ASSERT_FALSE(dshotDecodeFrame(frame ^ (1 << bit), value, telemetry));
+    }
+  }
+}
+
+void test_dshot150_edges() {
+  arm();
+  unsigned int badFrames = dshotBadFrames;
+
+  // Every bit position gets a 0 and a 1 across these, in rising order
+  const uint16_t values[] = {dshotThrottleMin, 0x2AA, 1046, 0x555, dshotThrottleMax};
+  byte lastDuty = 0;
+  for (uint16_t value : values) {
+    sendValue(value);
+    TEST_ASSERT_GREATER_THAN(lastDuty, dshotDuty);
+    lastDuty = dshotDuty;
+  }
+  TEST_ASSERT_EQUAL(maxDuty, lastDuty);
+  TEST_ASSERT_EQUAL(badFrames, dshotBadFrames);
+}
+
+void test_both_edges_in_one_interrupt() {
+  arm();
+  unsigned int badFrames = dshotBadFrames;
+
+  sendFrame(makeFrame(1046, false), dshot150Period3, true);
+  TEST_ASSERT_EQUAL(badFrames, dshotBadFrames);
+  TEST_ASSERT_NOT_EQUAL(0, dshotDuty);
+}
+
+void test_dshot300_rejected() {
+  arm();
+  sendValue(dshotThrottleMin);
+  byte duty = dshotDuty;
+  unsigned int badFrames = dshotBadFrames;
+
+  // Valid frame at twice the rate, faster than the interrupt keeps up with on the chip
+  sendFrame(makeFrame(dshotThrottleMax, false), dshot300Period3);
+  TEST_ASSERT_EQUAL(badFrames + 1, dshotBadFrames);
+  TEST_ASSERT_EQUAL(duty, dshotDuty);
+
+  // Too slow as well
+  sendFrame(makeFrame(dshotThrottleMax, false), dshot150Period3 + (dshot150Period3 / 4));
+  TEST_ASSERT_EQUAL(badFrames + 2, dshotBadFrames);
+  TEST_ASSERT_EQUAL(duty, dshotDuty);
+
+  // Still in step for the next good frame
+  sendValue(dshotThrottleMax);
+  TEST_ASSERT_EQUAL(maxDuty, dshotDuty);
+}
+
+void test_lost_edges_rejected() {
+  arm();
+  sendValue(dshotThrottleMin);
+  byte duty = dshotDuty;
+  unsigned int badFrames = dshotBadFrames;
+
+  // Half a frame then nothing, the next frame's first rise comes after a gap
+  uint16_t frame = makeFrame(dshotThrottleMax, false);
+  for (byte i = 0; i < 8; i++) {
+    uint16_t rise = frameStart + ((i * dshot150Period3) / 3);
+    nativeTCDCapture(false, rise & tcdMask);
+    nativeTCDCapture(true, (rise + ((frame & (0x8000 >> i)) ? (dshot150Period3 / 4) : (dshot150Period3 / 8))) & tcdMask);
+  }
+  frameStart += ((16 * dshot150Period3) / 3) + frameGap;
+
+  sendValue(dshotThrottleMax);
+  TEST_ASSERT_EQUAL(badFrames + 1, dshotBadFrames);
+  TEST_ASSERT_EQUAL(maxDuty, dshotDuty);
+  TEST_ASSERT_NOT_EQUAL(duty, dshotDuty);
+}
+
+void test_throttle_scaling() {
+  arm();
+
+  sendValue(dshotThrottleMin);
+  TEST_ASSERT_EQUAL(minDuty, dshotDuty);
+
+  sendValue(dshotThrottleMax);
+  TEST_ASSERT_EQUAL(maxDuty, dshotDuty);
+
+  sendValue((dshotThrottleMin + dshotThrottleMax + 1) / 2);
+  TEST_ASSERT_UINT_WITHIN(1, (minDuty + maxDuty) / 2, dshotDuty);
+
+  sendValue(0);
+  TEST_ASSERT_EQUAL(0, dshotDuty);
+}
+
+void test_throttle_ignored_until_armed() {
+  sendValue(dshotThrottleMax);
+  TEST_ASSERT_FALSE(dshotArmed);
+  TEST_ASSERT_EQUAL(0, dshotDuty);
+}
+
+void test_commands_are_not_throttle() {
+  arm();
+  sendValue(dshotThrottleMin + 100);
+  byte duty = dshotDuty;
+
+  // Everything from 1 to 47 is a command, none of them change the throttle
+  for (uint16_t value = 1; value < dshotThrottleMin; value++) {
+    sendValue(value);
+    TEST_ASSERT_EQUAL(duty, dshotDuty);
+  }
+}
+
+void test_beep_command() {
+  sendValue(DSHOT_CMD_BEEP1);
+  dshotCommands();
+  TEST_ASSERT_TRUE(tonesPlaying());
+}
+
+void test_setting_commands_need_repeats() {
+  bool wasReversed = reverse;
+
+  // Without the telemetry bit, or not repeated enough, they are ignored
+  for (byte i = 0; i < 10; i++) sendValue(DSHOT_CMD_SPIN_DIRECTION_REVERSED);
+  dshotCommands();
+  TEST_ASSERT_EQUAL(wasReversed, reverse);
+
+  sendValue(0); // Breaks the run
+  for (byte i = 0; i < 5; i++) sendValue(DSHOT_CMD_SPIN_DIRECTION_REVERSED, true);
+  dshotCommands();
+  TEST_ASSERT_EQUAL(wasReversed, reverse);
+
+  sendValue(DSHOT_CMD_SPIN_DIRECTION_REVERSED, true);
+  dshotCommands();
+  TEST_ASSERT_NOT_EQUAL(wasReversed, reverse);
+
+  // Back to normal for the other tests
+  for (byte i = 0; i < 6; i++) sendValue(DSHOT_CMD_SPIN_DIRECTION_NORMAL, true);
+  dshotCommands();
+  TEST_ASSERT_EQUAL(wasReversed, reverse);
+}
+
+void test_arming_counter() {
+  for (unsigned int i = 0; i < (dshotZeroFramesToArm - 1); i++) sendValue(0);
+  TEST_ASSERT_FALSE(dshotArmed);
+
+  // Throttle restarts the count
+  sendValue(dshotThrottleMin);
+  for (unsigned int i = 0; i < (dshotZeroFramesToArm - 1); i++) sendValue(0);
+  TEST_ASSERT_FALSE(dshotArmed);
+
+  sendValue(0);
+  TEST_ASSERT_TRUE(dshotArmed);
+
+  // Bad frames don't count towards it, or restart it
+  setUp();
+  for (unsigned int i = 0; i < (dshotZeroFramesToArm - 1); i++) sendValue(0);
+  sendFrame(makeFrame(0, false) ^ 0x01);
+  TEST_ASSERT_FALSE(dshotArmed);
+  sendValue(0);
+  TEST_ASSERT_TRUE(dshotArmed);
+}
+
+void test_failsafe_timeout() {
+  arm();
+  sendValue(dshotThrottleMax);
+
+  nativeAdvanceMicros((dshotTimeOut - 10) * 1000);
+  TEST_ASSERT_FALSE(checkDShotFailsafe());
+  TEST_ASSERT_TRUE(dshotArmed);
+
+  // A valid frame restarts the time out
+  sendValue(dshotThrottleMax);
+  nativeAdvanceMicros((dshotTimeOut - 10) * 1000);
+  TEST_ASSERT_FALSE(checkDShotFailsafe());
+
+  nativeAdvanceMicros(20000);
+  TEST_ASSERT_TRUE(checkDShotFailsafe());
+  TEST_ASSERT_FALSE(dshotArmed);
+  TEST_ASSERT_EQUAL(0, dshotDuty);
+
+  // Throttle is ignored until armed again
+  sendValue(dshotThrottleMax);
+  TEST_ASSERT_EQUAL(0, dshotDuty);
+  TEST_ASSERT_FALSE(checkDShotFailsafe()); // Only reported once
+}
+
+void test_failsafe_bad_frames() {
+  arm();
+  uint16_t badFrame = makeFrame(dshotThrottleMax, false) ^ 0x01;
+
+  for (byte i = 0; i < (dshotBadFramesToFailsafe - 1); i++) sendFrame(badFrame);
+  TEST_ASSERT_FALSE(checkDShotFailsafe());
+
+  // A valid frame restarts the run
+  sendValue(dshotThrottleMax);
+  for (byte i = 0; i < (dshotBadFramesToFailsafe - 1); i++) sendFrame(badFrame);
+  TEST_ASSERT_FALSE(checkDShotFailsafe());
+
+  sendFrame(badFrame);
+  TEST_ASSERT_TRUE(checkDShotFailsafe());
+  TEST_ASSERT_FALSE(dshotArmed);
+}
+
+int main() {
+  setup(); // Sets up the DShot input in this build
+  stopTones();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_decode_known_frames);
+  RUN_TEST(test_decode_rejects_bad_crc);
+  RUN_TEST(test_dshot150_edges);
+  RUN_TEST(test_both_edges_in_one_interrupt);
+  RUN_TEST(test_dshot300_rejected);
+  RUN_TEST(test_lost_edges_rejected);
+  RUN_TEST(test_throttle_scaling);
+  RUN_TEST(test_throttle_ignored_until_armed);
+  RUN_TEST(test_commands_are_not_throttle);
+  RUN_TEST(test_beep_command);
+  RUN_TEST(test_setting_commands_need_repeats);
+  RUN_TEST(test_arming_counter);
+  RUN_TEST(test_failsafe_timeout);
+  RUN_TEST(test_failsafe_bad_frames);
+  return UNITY_END();
+}
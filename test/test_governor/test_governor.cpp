@@ -0,0 +1,142 @@
+#include <unity.h>
+#include <bldc_sim.h>
+#include <motor.h>
+#include <tones.h>
+
+/* RPM governor step response
+
+  The governor is run against the simulated motor (hal/bldc_sim), started at a duty and
+  handed to RPM control at the speed it got to. The target is then stepped and the speed
+  sampled every millisecond to check it gets there in time, without overshooting much
+  and without desyncing.
+*/
+
+const unsigned long govStartTimeOut = 3000000; // (us)
+const unsigned long govSettleTime = 300000;    // Step must be within the band by this long after (us)
+const unsigned int govSettleBand = 3;          // Percent of the target
+const unsigned int govMaxOvershoot = 15;       // Percent of the step
+
+struct stepResponse {
+  unsigned long settleMicros; // Time it last entered the band, 0 if it never left it
+  unsigned int peakRPM;       // Furthest past the starting speed in the direction of the step
+  unsigned int finalRPM;
+};
+
+unsigned long desyncTotal() {
+  unsigned long total = 0;
+  for (byte i = 0; i < desyncCauseCount; i++) total += desyncCounts[i];
+  return total;
+}
+
+// Starts the motor at a duty, then hands it to the governor at its current speed
+unsigned int startGoverned(byte startDuty) {
+  clearDesyncCounts();
+  enableMotor(startDuty);
+
+  unsigned long taken = 0;
+  while ((spinUpState != spinUpStateEnum::RUNNING) && (taken < govStartTimeOut)) {
+    simRun(1000);
+    taken += 1000;
+  }
+  TEST_ASSERT_EQUAL_MESSAGE(spinUpStateEnum::RUNNING, spinUpState, "motor never started");
+
+  simRun(200000); // Settle at the starting duty
+  unsigned int rpm = getCurrentRPM();
+  targetRPM = rpm;
+  controlScheme = ctrlSchemeEnum::RPM;
+  simRun(100000);
+  return rpm;
+}
+
+stepResponse stepTarget(unsigned int target, unsigned long runMicros) {
+  unsigned int start = getCurrentRPM();
+  bool up = target > start;
+  unsigned int band = (uint32_t(target) * govSettleBand) / 100;
+
+  stepResponse response = {0, start, 0};
+  targetRPM = target;
+
+  for (unsigned long elapsed = 1000; elapsed <= runMicros; elapsed += 1000) {
+    simRun(1000);
+    unsigned int rpm = getCurrentRPM();
+
+    if (up ? (rpm > response.peakRPM) : (rpm < response.peakRPM)) response.peakRPM = rpm;
+    bool inBand = (rpm + band >= target) && (rpm <= target + band);
+    if (!inBand) response.settleMicros = elapsed + 1000; // Can't have settled before the next sample
+    response.finalRPM = rpm;
+  }
+  return response;
+}
+
+// Overshoot past the target as a percentage of the step
+unsigned int overshootPercent(const stepResponse &response, unsigned int from, unsigned int target) {
+  unsigned int step = (target > from) ? (target - from) : (from - target);
+  int past = (target > from) ? (int(response.peakRPM) - int(target)) : (int(target) - int(response.peakRPM));
+  if (past <= 0) return 0;
+  return (uint32_t(past) * 100) / step;
+}
+
+void setUp() {
+  disableMotor();
+  controlScheme = ctrlSchemeEnum::PWM;
+  setRPMGains(200, 60);
+  simReset(simDefaultMotor);
+  simRun(10000);
+}
+
+void tearDown() {
+  disableMotor();
+  controlScheme = ctrlSchemeEnum::PWM;
+}
+
+void test_holds_speed_at_handover() {
+  unsigned int start = startGoverned(100);
+  stepResponse response = stepTarget(start, 300000);
+
+  TEST_ASSERT_UINT_WITHIN((start * govSettleBand) / 100, start, response.finalRPM);
+  TEST_ASSERT_EQUAL(0, desyncTotal());
+}
+
+void test_step_up() {
+  unsigned int start = startGoverned(80);
+  unsigned int target = start + (start / 2);
+  stepResponse response = stepTarget(target, 600000);
+
+  TEST_ASSERT_LESS_THAN(govSettleTime, response.settleMicros);
+  TEST_ASSERT_LESS_OR_EQUAL(govMaxOvershoot, overshootPercent(response, start, target));
+  TEST_ASSERT_UINT_WITHIN((target * govSettleBand) / 100, target, response.finalRPM);
+  TEST_ASSERT_EQUAL(0, desyncTotal());
+}
+
+void test_step_down() {
+  unsigned int start = startGoverned(140);
+  unsigned int target = start - (start / 3);
+  stepResponse response = stepTarget(target, 600000);
+
+  TEST_ASSERT_LESS_THAN(govSettleTime, response.settleMicros);
+  TEST_ASSERT_LESS_OR_EQUAL(govMaxOvershoot, overshootPercent(response, start, target));
+  TEST_ASSERT_UINT_WITHIN((target * govSettleBand) / 100, target, response.finalRPM);
+  TEST_ASSERT_EQUAL(0, desyncTotal());
+}
+
+// Largest gains and a target far from the speed, the products must not overflow and flip the output
+void test_large_error_saturates() {
+  startGoverned(80);
+  setRPMGains(65535, 65535);
+  stepTarget(60000, 200000);
+
+  TEST_ASSERT_EQUAL(maxDuty, dutyTarget);
+  TEST_ASSERT_EQUAL(0, desyncTotal());
+}
+
+int main() {
+  setup();
+  stopTones(); // Pulses of the startup melody would nudge the rotor
+
+  UNITY_BEGIN();
+  RUN_TEST(test_holds_speed_at_handover);
+  RUN_TEST(test_step_up);
+  RUN_TEST(test_step_down);
+  RUN_TEST(test_large_error_saturates);
+  return UNITY_END();
+}